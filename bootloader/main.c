@@ -1,27 +1,68 @@
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 #include <system.h>
+#include <transport.h>
 #include <uart.h>
 #include <comm.h>
 #include <update.h>
 #include <boot.h>
+#include <boot_mode.h>
+#include <crc32.h>
+#if TRANSPORT_USB
+#include <usb_cdc.h>
+#endif
+#if UPDATE_STAGING
+#include <staging.h>
+#include <w25q.h>
+#endif
+
+/* Host link is chosen at build time */
+#if TRANSPORT_USB
+static const struct transport_t *const transport = &usb_cdc_transport;
+#else
+static const struct transport_t *const transport = &uart_transport;
+#endif
+
+/* Image downloaded into external flash is copied into the firmware slot before it's verified,
+ * a failed copy leaves the staged image for the next attempt */
+#if UPDATE_STAGING
+static void install_staged_image(void)
+{
+    (void)staging_install();
+}
+#else
+static void install_staged_image(void)
+{
+}
+#endif
 
 int main(void)
 {
     system_init();
-    uart_init();
-    comm_init();
+    crc32_init();
+#if UPDATE_STAGING
+    (void)staging_init(&w25q_storage);
+#endif
+    transport->init();
+    comm_init(transport);
 
-    /* Run update procedure */
-    update_run();
+    /* Normal boot goes straight to verification, unless the firmware or strap asks for update */
+    update_run(boot_mode_is_update_requested() ? UPDATE_MODE_REQUESTED : UPDATE_MODE_LISTEN);
+    install_staged_image();
 
-    /* Validate image */
-    if (!boot_verify_image()) {
-        system_panic();
+    /* Without a valid image there's nothing to boot, keep waiting for the host */
+    while (!boot_verify_image()) {
+        update_run(UPDATE_MODE_RECOVERY);
+        install_staged_image();
     }
 
-    /* Deinit peripherals */
-    uart_deinit();
+    /* Deinit peripherals, last response has to reach the host first */
+    transport->flush();
+    transport->deinit();
+#if UPDATE_STAGING
+    staging_deinit();
+#endif
+    crc32_deinit();
     system_deinit();
 
     /* Boot main app */
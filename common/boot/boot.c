@@ -2,14 +2,19 @@
 #include "keys.h"
 #include "firmware_info.h"
 #include <flash.h>
+#include <crc32.h>
+#include <system.h>
 #include <utils.h>
 #include <sha-256.h>
 #include <uECC.h>
+#include <string.h>
 #include <libopencm3/cm3/scb.h>
 #include <libopencm3/stm32/memorymap.h>
 
 typedef void (*boot_entry_point_t)(void);
 
+_Static_assert(BOOT_IMAGE_DIGEST_SIZE == SIZE_OF_SHA_256_HASH, "Image digest has to hold SHA-256");
+
 #define BOOT_FW_CHUNK_SIZE 32
 
 static void boot_compute_fw_hash(uint8_t *hash, size_t fw_size)
@@ -32,9 +37,42 @@ static void boot_compute_fw_hash(uint8_t *hash, size_t fw_size)
     sha_256_close(&sha256);
 }
 
+static bool boot_check_fw_crc(uint32_t expected_crc, size_t fw_size)
+{
+    size_t bytes_read = 0;
+    uint8_t buffer[BOOT_FW_CHUNK_SIZE];
+
+    if (expected_crc == FW_CRC32_NONE) {
+        return true;
+    }
+
+    crc32_reset();
+
+    while (bytes_read < fw_size) {
+        const size_t bytes_to_read = MIN(fw_size - bytes_read, BOOT_FW_CHUNK_SIZE);
+
+        flash_read(FW_VECTOR_TABLE_ENTRY_OFFSET + bytes_read, buffer, bytes_to_read);
+        crc32_write(buffer, bytes_to_read);
+
+        bytes_read += bytes_to_read;
+    }
+
+    return (crc32_read() == expected_crc);
+}
+
+static const struct uECC_Curve_t *boot_get_curve(void)
+{
+    /* Only the curve selected with ECDSA_CURVE is compiled into micro-ecc */
+#if uECC_SUPPORTS_secp256r1
+    return uECC_secp256r1();
+#else
+    return uECC_secp256k1();
+#endif
+}
+
 static bool boot_verify_signature(const uint8_t *fw_hash, const uint8_t *signature)
 {
-    const struct uECC_Curve_t *curve = uECC_secp256k1();
+    const struct uECC_Curve_t *curve = boot_get_curve();
     const int status = uECC_verify(ecdsa_public_key, fw_hash, SIZE_OF_SHA_256_HASH, signature, curve);
 
     return (status != 0);
@@ -42,8 +80,19 @@ static bool boot_verify_signature(const uint8_t *fw_hash, const uint8_t *signatu
 
 bool boot_verify_image(void)
 {
-    uint8_t fw_hash[SIZE_OF_SHA_256_HASH];
+    uint8_t fw_hash[BOOT_IMAGE_DIGEST_SIZE];
+    struct boot_verify_times_t times;
+
+    return boot_verify_image_digest(fw_hash, &times);
+}
+
+bool boot_verify_image_digest(uint8_t *fw_hash, struct boot_verify_times_t *times)
+{
     struct fw_header_t header;
+    uint32_t start_us;
+
+    memset(fw_hash, 0, BOOT_IMAGE_DIGEST_SIZE);
+    memset(times, 0, sizeof(*times));
 
     /* Read firmware header */
     flash_read(FLASH_MAIN_APP_START, &header, sizeof(header));
@@ -58,15 +107,25 @@ bool boot_verify_image(void)
         return false;
     }
 
+    /* Corrupted or partially written image is caught long before the signature check would */
+    start_us = system_get_us();
+    const bool crc_valid = boot_check_fw_crc(header.crc32, header.length);
+    times->crc_us = system_get_us() - start_us;
+    if (!crc_valid) {
+        return false;
+    }
+
     /* Compute SHA256 of the firmware */
+    start_us = system_get_us();
     boot_compute_fw_hash(fw_hash, header.length);
+    times->hash_us = system_get_us() - start_us;
 
     /* Verify signature */
-    if (!boot_verify_signature(fw_hash, header.ecdsa_signature)) {
-        return false;
-    }
+    start_us = system_get_us();
+    const bool signature_valid = boot_verify_signature(fw_hash, header.ecdsa_signature);
+    times->signature_us = system_get_us() - start_us;
 
-    return true;
+    return signature_valid;
 }
 
 void boot_set_vector_table(void)
@@ -1,8 +1,22 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#define BOOT_IMAGE_DIGEST_SIZE 32
+
+/* Time spent in each step of the image check, zero for steps not reached */
+struct boot_verify_times_t
+{
+    uint32_t crc_us;
+    uint32_t hash_us;
+    uint32_t signature_us;
+};
 
 bool boot_verify_image(void);
 
+/* Gives back SHA-256 of the code covered by the signature, zeroed if the header is broken */
+bool boot_verify_image_digest(uint8_t *fw_hash, struct boot_verify_times_t *times);
+
 void boot_set_vector_table(void);
 __attribute__((noreturn)) void boot_jump_to_firmware(void);
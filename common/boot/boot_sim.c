@@ -0,0 +1,67 @@
+#include "boot.h"
+#include "firmware_info.h"
+#include <flash.h>
+#include <crc32.h>
+#include <utils.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Host stand-in, SHA-256 and micro-ecc are not built for host tests. The image is checked the
+ * same way up to the CRC, which counts as the signature, the digest is left zeroed. */
+#define BOOT_FW_CHUNK_SIZE 32
+
+static bool boot_check_fw_crc(uint32_t expected_crc, size_t fw_size)
+{
+    size_t bytes_read = 0;
+    uint8_t buffer[BOOT_FW_CHUNK_SIZE];
+
+    /* Without the CRC nothing would be checked at all */
+    if (expected_crc == FW_CRC32_NONE) {
+        return false;
+    }
+
+    crc32_reset();
+
+    while (bytes_read < fw_size) {
+        const size_t bytes_to_read = MIN(fw_size - bytes_read, BOOT_FW_CHUNK_SIZE);
+
+        flash_read(FLASH_MAIN_APP_START + sizeof(struct fw_header_t) + bytes_read, buffer, bytes_to_read);
+        crc32_write(buffer, bytes_to_read);
+
+        bytes_read += bytes_to_read;
+    }
+
+    return (crc32_read() == expected_crc);
+}
+
+bool boot_verify_image(void)
+{
+    uint8_t fw_hash[BOOT_IMAGE_DIGEST_SIZE];
+    struct boot_verify_times_t times;
+
+    return boot_verify_image_digest(fw_hash, &times);
+}
+
+bool boot_verify_image_digest(uint8_t *fw_hash, struct boot_verify_times_t *times)
+{
+    struct fw_header_t header;
+
+    memset(fw_hash, 0, BOOT_IMAGE_DIGEST_SIZE);
+    memset(times, 0, sizeof(*times));
+
+    flash_read(FLASH_MAIN_APP_START, &header, sizeof(header));
+    if ((header.device_id != FW_DEVICE_ID) || (header.length > FW_CODE_MAX_SIZE)) {
+        return false;
+    }
+
+    return boot_check_fw_crc(header.crc32, header.length);
+}
+
+void boot_set_vector_table(void)
+{
+}
+
+__attribute__((noreturn)) void boot_jump_to_firmware(void)
+{
+    abort();
+}
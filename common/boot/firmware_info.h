@@ -10,7 +10,10 @@
 
 /* Bits [6:0] in SCB->VTOR in Cortex-M3 are reserved,
  * so the header has to be padded to multiple of 128. */
-#define FW_HEADER_PADDING_SIZE 36
+#define FW_HEADER_PADDING_SIZE 32
+
+/* Images signed before the CRC was added have header padding in its place */
+#define FW_CRC32_NONE 0xFFFFFFFF
 
 struct fw_header_t
 {
@@ -19,6 +22,7 @@ struct fw_header_t
     uint32_t device_id;
     uint32_t length;
     uint8_t ecdsa_signature[FW_ECDSA_SIGNATURE_SIZE];
+    uint32_t crc32;         // CRC-32 of the code, cheap check before the signature
     uint8_t padding[FW_HEADER_PADDING_SIZE];
 } __attribute__((packed));
 
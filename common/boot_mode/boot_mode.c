@@ -0,0 +1,54 @@
+#include "boot_mode.h"
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/f1/bkp.h>
+
+/* Backup registers are 16-bit, they survive reset but not power loss */
+#define BOOT_MODE_UPDATE_MAGIC 0xB0A7
+#define BOOT_MODE_REGISTER BKP_DR1
+
+static void boot_mode_unlock_backup(void)
+{
+    rcc_periph_clock_enable(RCC_PWR);
+    rcc_periph_clock_enable(RCC_BKP);
+    pwr_disable_backup_domain_write_protect();
+}
+
+static bool boot_mode_is_strap_set(void)
+{
+#if BOOT_MODE_STRAP
+    rcc_periph_clock_enable(BOOT_MODE_STRAP_PORT_RCC);
+    gpio_set_mode(BOOT_MODE_STRAP_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_PULL_UPDOWN, BOOT_MODE_STRAP_PIN);
+    gpio_set(BOOT_MODE_STRAP_PORT, BOOT_MODE_STRAP_PIN);
+
+    /* Let the pull-up charge the pin before sampling it */
+    for (volatile int i = 0; i < 100; ++i) {
+    }
+
+    return gpio_get(BOOT_MODE_STRAP_PORT, BOOT_MODE_STRAP_PIN) == 0;
+#else
+    return false;
+#endif
+}
+
+__attribute__((noreturn)) void boot_mode_request_update(void)
+{
+    boot_mode_unlock_backup();
+    BOOT_MODE_REGISTER = BOOT_MODE_UPDATE_MAGIC;
+
+    scb_reset_system();
+}
+
+bool boot_mode_is_update_requested(void)
+{
+    boot_mode_unlock_backup();
+
+    const bool requested = ((BOOT_MODE_REGISTER & 0xFFFF) == BOOT_MODE_UPDATE_MAGIC);
+    BOOT_MODE_REGISTER = 0;
+
+    pwr_enable_backup_domain_write_protect();
+
+    return requested || boot_mode_is_strap_set();
+}
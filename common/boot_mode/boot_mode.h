@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+
+/* Update strap, pulled up internally and active when shorted to ground */
+#define BOOT_MODE_STRAP_PORT GPIOB
+#define BOOT_MODE_STRAP_PORT_RCC RCC_GPIOB
+#define BOOT_MODE_STRAP_PIN GPIO12
+
+/* Leaves a request for the bootloader in a backup register and resets the device.
+ * The bootloader then waits for the host instead of booting straight away. */
+__attribute__((noreturn)) void boot_mode_request_update(void);
+
+/* Consumes the request, so the next reset boots normally again. Strap is checked too when enabled. */
+bool boot_mode_is_update_requested(void);
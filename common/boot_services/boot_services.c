@@ -0,0 +1,73 @@
+#include "boot_services.h"
+#include <keys.h>
+#include <utils.h>
+#include <crc32.h>
+#include <uECC.h>
+#include <errno.h>
+
+static bool boot_services_is_firmware_area(size_t addr, size_t size)
+{
+    return (addr >= FLASH_MAIN_APP_START) && (addr <= FLASH_END_ADDR) && (size <= FLASH_END_ADDR - addr);
+}
+
+static bool boot_services_ecdsa_verify(const uint8_t *public_key, const uint8_t *hash, const uint8_t *signature)
+{
+    /* Only the curve selected with ECDSA_CURVE is compiled into micro-ecc */
+#if uECC_SUPPORTS_secp256r1
+    const struct uECC_Curve_t *curve = uECC_secp256r1();
+#else
+    const struct uECC_Curve_t *curve = uECC_secp256k1();
+#endif
+
+    return uECC_verify(public_key, hash, SIZE_OF_SHA_256_HASH, signature, curve) != 0;
+}
+
+static int boot_services_flash_erase(size_t addr, size_t size)
+{
+    if (!boot_services_is_firmware_area(addr, size)) {
+        return -EINVAL;
+    }
+
+    return flash_erase(addr, size);
+}
+
+static int boot_services_flash_write(size_t addr, const void *data, size_t size)
+{
+    if (!boot_services_is_firmware_area(addr, size)) {
+        return -EINVAL;
+    }
+
+    return flash_write(addr, data, size);
+}
+
+static uint16_t boot_services_crc16_xmodem(const void *data, size_t size)
+{
+    return utils_crc16_xmodem(data, size);
+}
+
+static uint32_t boot_services_crc32(const void *data, size_t size)
+{
+    /* Caller may not have clocked the unit, enabling it again does no harm */
+    crc32_init();
+
+    return crc32_compute(data, size);
+}
+
+__attribute__((section(".boot_services"), used)) const struct boot_services_t boot_services = {
+    .magic = BOOT_SERVICES_MAGIC,
+    .version = BOOT_SERVICES_VERSION,
+    .size = sizeof(struct boot_services_t),
+    .sha256_init = sha_256_init,
+    .sha256_write = sha_256_write,
+    .sha256_close = sha_256_close,
+    .aes_init_ctx_iv = AES_init_ctx_iv,
+    .aes_cbc_encrypt = AES_CBC_encrypt_buffer,
+    .aes_cbc_decrypt = AES_CBC_decrypt_buffer,
+    .ecdsa_verify = boot_services_ecdsa_verify,
+    .ecdsa_public_key = ecdsa_public_key,
+    .flash_erase = boot_services_flash_erase,
+    .flash_write = boot_services_flash_write,
+    .flash_read = flash_read,
+    .crc16_xmodem = boot_services_crc16_xmodem,
+    .crc32 = boot_services_crc32,
+};
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sha-256.h>
+#include <aes.h>
+#include <flash.h>
+
+/* Table sits at a fixed offset in the bootloader, right after its vector table.
+ * The offset is also hardcoded in the bootloader's linker script. */
+#define BOOT_SERVICES_OFFSET 0x200
+#define BOOT_SERVICES_ADDR (FLASH_BOOTLOADER_START + BOOT_SERVICES_OFFSET)
+
+#define BOOT_SERVICES_MAGIC 0x53544F42 // "BOTS"
+
+/* Fields are only ever appended, each addition bumps the version */
+#define BOOT_SERVICES_VERSION 2
+
+/* Services run on the caller's stack and don't use any static data, signature
+ * verification needs about 1.5 KiB of stack. Flash services refuse to touch the
+ * bootloader's slot and return -EINVAL then, -EIO on programming failure. */
+struct boot_services_t
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;
+
+    /* SHA-256 */
+    void (*sha256_init)(struct Sha_256 *sha_256, uint8_t *hash);
+    void (*sha256_write)(struct Sha_256 *sha_256, const void *data, size_t size);
+    uint8_t *(*sha256_close)(struct Sha_256 *sha_256);
+
+    /* AES-128 CBC */
+    void (*aes_init_ctx_iv)(struct AES_ctx *ctx, const uint8_t *key, const uint8_t *iv);
+    void (*aes_cbc_encrypt)(struct AES_ctx *ctx, uint8_t *data, size_t size);
+    void (*aes_cbc_decrypt)(struct AES_ctx *ctx, uint8_t *data, size_t size);
+
+    /* ECDSA over the curve the bootloader was built for, SHA-256 sized hash, raw 64-byte signature */
+    bool (*ecdsa_verify)(const uint8_t *public_key, const uint8_t *hash, const uint8_t *signature);
+    const uint8_t *ecdsa_public_key;    // Key the firmware itself was signed with
+
+    /* Flash */
+    int (*flash_erase)(size_t addr, size_t size);
+    int (*flash_write)(size_t addr, const void *data, size_t size);
+    void (*flash_read)(size_t addr, void *data, size_t size);
+
+    /* CRC */
+    uint16_t (*crc16_xmodem)(const void *data, size_t size);
+
+    /* Since version 2. Same CRC-32 as in the image header, computed by the CRC unit, which is left clocked */
+    uint32_t (*crc32)(const void *data, size_t size);
+};
+
+/* Returns NULL if the bootloader doesn't provide services of at least given version */
+const struct boot_services_t *boot_services_get(uint16_t min_version);
@@ -0,0 +1,13 @@
+#include "boot_services.h"
+
+const struct boot_services_t *boot_services_get(uint16_t min_version)
+{
+    const struct boot_services_t *services = (const struct boot_services_t *)BOOT_SERVICES_ADDR;
+
+    /* Older bootloaders have code at this address */
+    if ((services->magic != BOOT_SERVICES_MAGIC) || (services->version < min_version)) {
+        return NULL;
+    }
+
+    return services;
+}
@@ -1,12 +1,12 @@
 #include "comm.h"
-#include <uart.h>
 #include <utils.h>
 #include <ring_buffer.h>
+#include <reed_solomon.h>
 #include <string.h>
 #include <errno.h>
 
-#define COMM_PACKET_BUFFER_COUNT 4
-#define COMM_PACKET_BUFFER_SIZE (COMM_PACKET_BUFFER_COUNT * sizeof(struct comm_packet_t))
+/* Ring buffer keeps one byte empty */
+#define COMM_PACKET_BUFFER_SIZE (COMM_PACKET_BUFFER_COUNT * sizeof(struct comm_packet_t) + 1)
 
 #define COMM_PACKET_LENGTH_SHIFT 0
 #define COMM_PACKET_LENGTH_MASK (0x1F << COMM_PACKET_LENGTH_SHIFT)
@@ -14,23 +14,44 @@
 #define COMM_PACKET_TYPE_SHIFT 5
 #define COMM_PACKET_TYPE_MASK (0x07 << COMM_PACKET_TYPE_SHIFT)
 
+/* With FEC each packet is followed by Reed-Solomon parity */
+#define COMM_FEC_CODEWORD_SIZE (COMM_PACKET_TOTAL_SIZE + REED_SOLOMON_PARITY_SIZE)
+
+/* Packets are COBS encoded and terminated with zero, so the receiver finds the next frame
+ * boundary after any error. Codeword is shorter than 254 bytes, so it's always one code byte.
+ * Frame is complete as soon as it decodes to a whole packet, a lost delimiter costs nothing. */
+#define COMM_FRAME_DELIMITER 0x00
+
+_Static_assert(COMM_FEC_CODEWORD_SIZE < 0xFE, "Codeword has to fit into a single COBS block");
+
 enum comm_state_t
 {
-    COMM_RECEIVE_METADATA = 0,
-    COMM_RECEIVE_DATA,
-    COMM_RECEIVE_CRC,
+    COMM_RECEIVE_FRAME = 0,
     COMM_PROCESS_PACKET
 };
 
 struct comm_ctx_t
 {
+    const struct transport_t *transport;
     enum comm_state_t state;
+    uint8_t rx_span[COMM_RX_SPAN_SIZE];
+    uint8_t rx_span_count;
+    uint8_t rx_span_pos;
     uint8_t rx_count;
+    uint8_t rx_block_left;  // Bytes left until the next code byte
+    bool rx_frame_started;
+    bool rx_frame_error;
+    bool rx_skip_frame;     // Rest of the frame is dropped up to the delimiter
+    uint8_t rx_data[COMM_FEC_CODEWORD_SIZE];
+    bool fec;
     struct comm_packet_t last_tx_packet;
     struct comm_packet_t current_rx_packet;
     struct comm_packet_t retx_packet;
     struct ring_buffer_t packet_buffer;
     uint8_t packet_buffer_data[COMM_PACKET_BUFFER_SIZE];
+    struct comm_stats_t stats;
+    bool streaming;
+    bool rx_halted;
 };
 
 static struct comm_ctx_t ctx;
@@ -40,8 +61,96 @@ static bool comm_is_retx_packet(const struct comm_packet_t *packet)
     return (memcmp(packet, &ctx.retx_packet, COMM_PACKET_TOTAL_SIZE) == 0);
 }
 
-void comm_init(void)
+static size_t comm_encode_frame(const uint8_t *data, size_t size, uint8_t *frame)
+{
+    size_t code_index = 0;
+    size_t frame_size = 1;
+
+    /* Each code byte holds the distance to the next zero, which is left out */
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] == COMM_FRAME_DELIMITER) {
+            frame[code_index] = frame_size - code_index;
+            code_index = frame_size++;
+        } else {
+            frame[frame_size++] = data[i];
+        }
+    }
+    frame[code_index] = frame_size - code_index;
+    frame[frame_size++] = COMM_FRAME_DELIMITER;
+
+    return frame_size;
+}
+
+static void comm_put_rx_byte(uint8_t byte)
 {
+    if (ctx.rx_count >= sizeof(ctx.rx_data)) {
+        ctx.rx_frame_error = true;
+        return;
+    }
+
+    ctx.rx_data[ctx.rx_count++] = byte;
+}
+
+static bool comm_frame_has_size(size_t size)
+{
+    return !ctx.rx_frame_error && (ctx.rx_block_left == 0) && (ctx.rx_count == size);
+}
+
+static void comm_reset_frame(void)
+{
+    ctx.rx_count = 0;
+    ctx.rx_block_left = 0;
+    ctx.rx_frame_started = false;
+    ctx.rx_frame_error = false;
+}
+
+/* Returns true once the frame decodes to exactly one packet, or codeword with FEC */
+static bool comm_decode_frame_byte(uint8_t byte)
+{
+    if (ctx.rx_block_left > 0) {
+        comm_put_rx_byte(byte);
+        --ctx.rx_block_left;
+    } else {
+        /* Code byte, previous block ended with the zero that was left out */
+        if (ctx.rx_frame_started) {
+            comm_put_rx_byte(COMM_FRAME_DELIMITER);
+        }
+        ctx.rx_frame_started = true;
+        ctx.rx_block_left = byte - 1;
+    }
+
+    return comm_frame_has_size(ctx.fec ? COMM_FEC_CODEWORD_SIZE : COMM_PACKET_TOTAL_SIZE);
+}
+
+static void comm_take_frame(void)
+{
+    /* Uncorrectable codeword is left as it is, CRC check rejects it then */
+    if (ctx.rx_count == COMM_FEC_CODEWORD_SIZE) {
+        const int corrected = reed_solomon_decode(ctx.rx_data, COMM_FEC_CODEWORD_SIZE);
+        if (corrected > 0) {
+            ctx.stats.fec_corrections += corrected;
+        }
+    }
+
+    memcpy(&ctx.current_rx_packet, ctx.rx_data, COMM_PACKET_TOTAL_SIZE);
+    comm_reset_frame();
+}
+
+static void comm_handle_rx_error(void)
+{
+    if (ctx.streaming) {
+        ctx.rx_halted = true;
+    } else {
+        ++ctx.stats.retx_sent;
+        comm_write(&ctx.retx_packet);
+    }
+}
+
+void comm_init(const struct transport_t *transport)
+{
+    ctx.transport = transport;
+    reed_solomon_init();
+
     /* Initialize packet ring buffer */
     ring_buffer_init(&ctx.packet_buffer, ctx.packet_buffer_data, sizeof(ctx.packet_buffer_data));
 
@@ -49,13 +158,28 @@ void comm_init(void)
     comm_create_ctrl_packet(&ctx.retx_packet, COMM_PACKET_OP_RETX, NULL, 0);
 }
 
+const struct transport_t *comm_get_transport(void)
+{
+    return ctx.transport;
+}
+
 void comm_write(const struct comm_packet_t *packet)
 {
+    uint8_t codeword[COMM_FEC_CODEWORD_SIZE];
+    uint8_t frame[COMM_FRAME_MAX_SIZE];
+    size_t size = COMM_PACKET_TOTAL_SIZE;
+
     if (packet == NULL) {
         return;
     }
 
-    uart_write(packet, COMM_PACKET_TOTAL_SIZE);
+    memcpy(codeword, packet, COMM_PACKET_TOTAL_SIZE);
+    if (ctx.fec) {
+        reed_solomon_encode(codeword, COMM_PACKET_TOTAL_SIZE, &codeword[COMM_PACKET_TOTAL_SIZE]);
+        size = COMM_FEC_CODEWORD_SIZE;
+    }
+
+    ctx.transport->write(frame, comm_encode_frame(codeword, size, frame));
     ctx.last_tx_packet = *packet;
 }
 
@@ -149,59 +273,146 @@ int comm_create_ctrl_packet(struct comm_packet_t *packet, enum comm_packet_op_t
     return 0;
 }
 
+bool comm_data_available(void)
+{
+    return (ctx.rx_span_pos != ctx.rx_span_count) || ctx.transport->data_available();
+}
+
+size_t comm_read_raw(void *data, size_t size)
+{
+    uint8_t *data_ptr = data;
+    size_t bytes_read = 0;
+
+    /* Leftovers of the last span go first */
+    while ((bytes_read < size) && (ctx.rx_span_pos != ctx.rx_span_count)) {
+        data_ptr[bytes_read++] = ctx.rx_span[ctx.rx_span_pos++];
+    }
+
+    return bytes_read + ctx.transport->read(&data_ptr[bytes_read], size - bytes_read);
+}
+
 void comm_task(void)
 {
-    while (uart_data_available() || (ctx.state == COMM_PROCESS_PACKET)) {
+    while (comm_data_available() || (ctx.state == COMM_PROCESS_PACKET)) {
         switch (ctx.state) {
-            case COMM_RECEIVE_METADATA:
-                ctx.current_rx_packet.metadata = uart_read_byte();
-                ctx.state = COMM_RECEIVE_DATA;
-                break;
+            case COMM_RECEIVE_FRAME: {
+                /* Taking a span at a time saves a call through the transport per byte */
+                if (ctx.rx_span_pos == ctx.rx_span_count) {
+                    ctx.rx_span_count = ctx.transport->read(ctx.rx_span, sizeof(ctx.rx_span));
+                    ctx.rx_span_pos = 0;
+                    if (ctx.rx_span_count == 0) {
+                        return;
+                    }
+                }
+
+                const uint8_t byte = ctx.rx_span[ctx.rx_span_pos++];
+                if (byte != COMM_FRAME_DELIMITER) {
+                    if (!ctx.rx_skip_frame && comm_decode_frame_byte(byte)) {
+                        comm_take_frame();
+                        ctx.state = COMM_PROCESS_PACKET;
+                    }
+                    break;
+                }
 
-            case COMM_RECEIVE_DATA:
-                ctx.current_rx_packet.payload[ctx.rx_count] = uart_read_byte();
-                ++ctx.rx_count;
-                if (ctx.rx_count >= COMM_PACKET_PAYLOAD_SIZE) {
-                    ctx.rx_count = 0;
-                    ctx.state = COMM_RECEIVE_CRC;
+                /* Delimiter after a complete packet or an empty frame carries nothing,
+                 * the host may use the latter to flush a partial frame */
+                ctx.rx_skip_frame = false;
+                if (!ctx.rx_frame_started) {
+                    break;
                 }
-                break;
 
-            case COMM_RECEIVE_CRC:
-                ctx.current_rx_packet.crc.raw[ctx.rx_count] = uart_read_byte();
-                ++ctx.rx_count;
-                if (ctx.rx_count >= sizeof(ctx.current_rx_packet.crc)) {
-                    ctx.rx_count = 0;
+                /* Packet without parity, sent before the host switched FEC on */
+                if (ctx.fec && comm_frame_has_size(COMM_PACKET_TOTAL_SIZE)) {
+                    comm_take_frame();
                     ctx.state = COMM_PROCESS_PACKET;
+                    break;
                 }
-                break;
+
+                /* Frame with a byte lost or inserted doesn't decode to exactly one packet */
+                comm_reset_frame();
+                ++ctx.stats.framing_errors;
+                comm_handle_rx_error();
+            } break;
 
             case COMM_PROCESS_PACKET: {
+                /* Back-pressure, leave the rest in transport buffer until some packets are read */
+                if (ring_buffer_get_free(&ctx.packet_buffer) < COMM_PACKET_TOTAL_SIZE) {
+                    return;
+                }
+
                 /* Validate CRC */
                 const uint16_t computed_crc = comm_compute_crc(&ctx.current_rx_packet);
                 if (ctx.current_rx_packet.crc.value != computed_crc) {
-                    comm_write(&ctx.retx_packet);
-                    ctx.state = COMM_RECEIVE_METADATA;
+                    /* Corrupted frame might have been cut short by an inserted byte, report it just once */
+                    ++ctx.stats.crc_failures;
+                    ctx.rx_skip_frame = true;
+                    comm_handle_rx_error();
+                    ctx.state = COMM_RECEIVE_FRAME;
                     break;
                 }
 
                 /* Handle retransmit request */
                 if (comm_is_retx_packet(&ctx.current_rx_packet)) {
+                    ++ctx.stats.retx_received;
                     comm_write(&ctx.last_tx_packet);
-                    ctx.state = COMM_RECEIVE_METADATA;
+                    ctx.state = COMM_RECEIVE_FRAME;
                     break;
                 }
 
+                /* Data following the corrupted packet is dropped, control packet starts the stream again */
+                if (ctx.rx_halted) {
+                    if (comm_get_packet_type(&ctx.current_rx_packet) == COMM_PACKET_DATA) {
+                        ctx.state = COMM_RECEIVE_FRAME;
+                        break;
+                    }
+                    ctx.rx_halted = false;
+                }
+
                 /* Handle data packet, this should never fail */
                 (void)ring_buffer_write(&ctx.packet_buffer, &ctx.current_rx_packet, COMM_PACKET_TOTAL_SIZE);
 
-                ctx.state = COMM_RECEIVE_METADATA;
+                ctx.state = COMM_RECEIVE_FRAME;
             } break;
 
             default:
                 /* We should never get here, but just in case */
-                ctx.state = COMM_RECEIVE_METADATA;
+                ctx.state = COMM_RECEIVE_FRAME;
                 break;
         }
     }
 }
+
+void comm_set_streaming(bool enabled)
+{
+    ctx.streaming = enabled;
+    ctx.rx_halted = false;
+}
+
+void comm_set_fec(bool enabled)
+{
+    ctx.fec = enabled;
+}
+
+void comm_resume_rx(void)
+{
+    ctx.rx_halted = false;
+}
+
+bool comm_is_rx_halted(void)
+{
+    return ctx.rx_halted;
+}
+
+void comm_get_stats(struct comm_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    *stats = ctx.stats;
+}
+
+void comm_reset_stats(void)
+{
+    memset(&ctx.stats, 0, sizeof(ctx.stats));
+}
@@ -3,6 +3,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <reed_solomon.h>
+#include <transport.h>
 
 #define COMM_PACKET_METADATA_SIZE 1
 #define COMM_PACKET_PAYLOAD_SIZE 16
@@ -11,8 +13,27 @@
 
 #define COMM_PACKET_PADDING_BYTE 0xFF
 
+/* Largest frame on the wire, COBS code byte, packet with FEC parity and delimiter */
+#define COMM_FRAME_MAX_SIZE (1 + COMM_PACKET_TOTAL_SIZE + REED_SOLOMON_PARITY_SIZE + 1)
+
+/* Received bytes are taken from the transport in chunks of up to this size */
+#define COMM_RX_SPAN_SIZE COMM_FRAME_MAX_SIZE
+
+/* Number of received packets that can wait for processing */
+#define COMM_PACKET_BUFFER_COUNT 8
+
 #define COMM_REQUEST_PACKET_SIZE 1
 #define COMM_FW_SIZE_PACKET_SIZE (1 + 4)
+#define COMM_PAGE_REQUEST_PACKET_SIZE (1 + 1)
+#define COMM_CREDITS_PACKET_SIZE (1 + 1)
+#define COMM_REWIND_PACKET_SIZE (1 + 4)
+#define COMM_OPTIONS_PACKET_SIZE (1 + 1 + 1)
+
+/* Link options the host may ask for in update request, after credits */
+#define COMM_OPTION_FEC (1 << 0)
+
+/* Maximum payload of control packet, without operation code */
+#define COMM_CTRL_PACKET_MAX_DATA_SIZE (COMM_PACKET_PAYLOAD_SIZE - 1)
 
 enum comm_packet_type_t
 {
@@ -24,12 +45,40 @@ enum comm_packet_type_t
 enum comm_packet_op_t
 {
     COMM_PACKET_OP_FW_UPDATE_DONE = 0x04,   // Firmware update done
+    COMM_PACKET_OP_INFO_REQUEST = 0x05,     // Installed image information request, paged
     COMM_PACKET_OP_ACK = 0x06,              // General acknowledge
+    COMM_PACKET_OP_ECHO = 0x07,             // Echo request, answered with device timestamp and the data
+    COMM_PACKET_OP_REWIND = 0x08,           // Data transfer goes back to given offset
     COMM_PACKET_OP_UPDATE_REQUEST = 0x11,   // Firmware update request
     COMM_PACKET_OP_FW_SIZE_REQUEST = 0x12,  // Device firmware size request
+    COMM_PACKET_OP_STATS_REQUEST = 0x13,    // Link statistics request, paged
+    COMM_PACKET_OP_MEMORY_REQUEST = 0x14,   // RAM usage request, paged
     COMM_PACKET_OP_NACK = 0x15,             // General negative acknowledge, terminates communication
     COMM_PACKET_OP_SYNCED = 0x16,           // Transmission sync info with ID
-    COMM_PACKET_OP_RETX = 0x18              // Packet retransmission request
+    COMM_PACKET_OP_SESSION_END = 0x17,      // Ends the session, device boots right away
+    COMM_PACKET_OP_RETX = 0x18,             // Packet retransmission request
+    COMM_PACKET_OP_SESSION_REQUEST = 0x19   // Whole update request with host's capabilities, paged
+};
+
+/* Carried by NACK after the operation code, older devices send NACK without it */
+enum comm_nack_reason_t
+{
+    COMM_NACK_UNEXPECTED_PACKET = 0x01,     // Packet doesn't fit the session state
+    COMM_NACK_INVALID_REQUEST = 0x02,       // Request malformed or its version not supported
+    COMM_NACK_WRONG_DEVICE = 0x03,          // Image is meant for another device
+    COMM_NACK_IMAGE_TOO_LARGE = 0x04,       // Image doesn't fit the firmware slot
+    COMM_NACK_FLASH_ERROR = 0x05,           // Erasing or programming failed
+    COMM_NACK_TIMEOUT = 0x06,               // Host went silent
+    COMM_NACK_UP_TO_DATE = 0x07             // Same image is installed already, device boots it
+};
+
+struct comm_stats_t
+{
+    uint32_t crc_failures;
+    uint32_t retx_sent;
+    uint32_t retx_received;
+    uint32_t framing_errors;
+    uint32_t fec_corrections;   // Bytes corrected without retransmission
 };
 
 struct comm_packet_t
@@ -42,7 +91,9 @@ struct comm_packet_t
     } crc;
 } __attribute__((packed));
 
-void comm_init(void);
+/* Transport has to be initialized by the caller */
+void comm_init(const struct transport_t *transport);
+const struct transport_t *comm_get_transport(void);
 
 void comm_write(const struct comm_packet_t *packet);
 void comm_read(struct comm_packet_t *packet);
@@ -59,3 +110,21 @@ uint8_t comm_get_packet_length(const struct comm_packet_t *packet);
 int comm_create_ctrl_packet(struct comm_packet_t *packet, enum comm_packet_op_t op, const void *payload, size_t payload_size);
 
 void comm_task(void);
+
+/* Raw access to received bytes for whoever reads them before packets start flowing */
+bool comm_data_available(void);
+size_t comm_read_raw(void *data, size_t size);
+
+/* In streaming mode several packets are in flight, so corrupted packet can't be simply
+ * retransmitted. Reception halts instead, dropping data packets until a control packet comes
+ * or until the halt is cleared by the user, once it has asked the host to go back. */
+void comm_set_streaming(bool enabled);
+
+/* Appends Reed-Solomon parity to sent packets and expects it on received ones.
+ * Received packets without parity are still accepted. */
+void comm_set_fec(bool enabled);
+void comm_resume_rx(void);
+bool comm_is_rx_halted(void);
+
+void comm_get_stats(struct comm_stats_t *stats);
+void comm_reset_stats(void);
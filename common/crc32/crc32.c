@@ -0,0 +1,52 @@
+#include "crc32.h"
+#include <string.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/crc.h>
+
+void crc32_init(void)
+{
+    rcc_periph_clock_enable(RCC_CRC);
+}
+
+void crc32_deinit(void)
+{
+    rcc_periph_clock_disable(RCC_CRC);
+}
+
+void crc32_reset(void)
+{
+    CRC_CR = CRC_CR_RESET;
+}
+
+void crc32_write(const void *data, size_t size)
+{
+    const uint8_t *data_ptr = data;
+    uint32_t word;
+
+    /* Unit takes a word per clock cycle, data may not be aligned though */
+    while (size >= sizeof(word)) {
+        memcpy(&word, data_ptr, sizeof(word));
+        CRC_DR = word;
+        data_ptr += sizeof(word);
+        size -= sizeof(word);
+    }
+
+    if (size > 0) {
+        memset(&word, CRC32_PAD_BYTE, sizeof(word));
+        memcpy(&word, data_ptr, size);
+        CRC_DR = word;
+    }
+}
+
+uint32_t crc32_read(void)
+{
+    return CRC_DR;
+}
+
+uint32_t crc32_compute(const void *data, size_t size)
+{
+    crc32_reset();
+    crc32_write(data, size);
+
+    return crc32_read();
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* CRC-32 as computed by the STM32 CRC unit: polynomial 0x04C11DB7, initial value 0xFFFFFFFF,
+ * no reflection and no final XOR. Data is taken as little-endian 32-bit words, a trailing
+ * partial word is padded with 0xFF. Host builds use the matching software implementation. */
+#define CRC32_PAD_BYTE 0xFF
+
+void crc32_init(void);
+void crc32_deinit(void);
+
+/* Starts a new computation, there's just one unit, so only one can be in progress */
+void crc32_reset(void);
+
+/* All but the last part have to be a multiple of 4 bytes */
+void crc32_write(const void *data, size_t size);
+uint32_t crc32_read(void);
+
+uint32_t crc32_compute(const void *data, size_t size);
@@ -0,0 +1,71 @@
+#include "crc32.h"
+#include <string.h>
+
+#define CRC32_POLY 0x04C11DB7
+#define CRC32_INIT 0xFFFFFFFF
+
+/* Same as the hardware unit, bit by bit, for host builds */
+struct crc32_ctx_t
+{
+    uint32_t crc;
+};
+
+static struct crc32_ctx_t ctx;
+
+static void crc32_write_word(uint32_t word)
+{
+    ctx.crc ^= word;
+
+    for (size_t i = 0; i < 32; ++i) {
+        if (ctx.crc & 0x80000000) {
+            ctx.crc = (ctx.crc << 1) ^ CRC32_POLY;
+        } else {
+            ctx.crc = ctx.crc << 1;
+        }
+    }
+}
+
+void crc32_init(void)
+{
+}
+
+void crc32_deinit(void)
+{
+}
+
+void crc32_reset(void)
+{
+    ctx.crc = CRC32_INIT;
+}
+
+void crc32_write(const void *data, size_t size)
+{
+    const uint8_t *data_ptr = data;
+    uint32_t word;
+
+    while (size >= sizeof(word)) {
+        memcpy(&word, data_ptr, sizeof(word));
+        crc32_write_word(word);
+        data_ptr += sizeof(word);
+        size -= sizeof(word);
+    }
+
+    if (size > 0) {
+        memset(&word, CRC32_PAD_BYTE, sizeof(word));
+        memcpy(&word, data_ptr, size);
+        crc32_write_word(word);
+    }
+}
+
+uint32_t crc32_read(void)
+{
+    return ctx.crc;
+}
+
+uint32_t crc32_compute(const void *data, size_t size)
+{
+    crc32_reset();
+    crc32_write(data, size);
+
+    return crc32_read();
+}
@@ -1,19 +1,204 @@
 #include "flash.h"
+#include <utils.h>
+#include <scheduler.h>
 #include <errno.h>
 #include <libopencm3/stm32/flash.h>
 
+/* Erase and programming stall any fetch from flash, including interrupt vectors and handlers.
+ * Bootloader's own operations wait for completion in RAM, so UART keeps receiving meanwhile.
+ * Firmware calling through boot services can't use bootloader's RAM, it waits in flash. */
+RAMFUNC static void flash_wait_in_ram(void)
+{
+    while ((FLASH_SR & FLASH_SR_BSY) != 0) {
+    }
+}
+
+RAMFUNC static void flash_erase_page_in_ram(size_t addr)
+{
+    flash_wait_in_ram();
+    FLASH_CR |= FLASH_CR_PER;
+    FLASH_AR = addr;
+    FLASH_CR |= FLASH_CR_STRT;
+    flash_wait_in_ram();
+    FLASH_CR &= ~FLASH_CR_PER;
+}
+
+RAMFUNC static void flash_program_half_word_in_ram(size_t addr, uint16_t value)
+{
+    flash_wait_in_ram();
+    FLASH_CR |= FLASH_CR_PG;
+    *(volatile uint16_t *)addr = value;
+    flash_wait_in_ram();
+    FLASH_CR &= ~FLASH_CR_PG;
+}
+
+bool flash_is_blank(size_t addr, size_t size)
+{
+    const volatile uint16_t *flash_ptr = (volatile uint16_t *)addr;
+
+    for (size_t i = 0; i < size / 2; ++i) {
+        if (flash_ptr[i] != FLASH_ERASED_HALF_WORD) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int flash_erase_page_if_needed(size_t addr, bool in_ram)
+{
+    /* Erasing takes ~20ms, don't waste it on pages that are already blank */
+    if (flash_is_blank(addr, FLASH_PAGE_SIZE)) {
+        return 0;
+    }
+
+    if (in_ram) {
+        flash_erase_page_in_ram(addr);
+    } else {
+        flash_erase_page(addr);
+    }
+
+    if ((FLASH_SR & FLASH_SR_WRPRTERR) != 0) {
+        flash_clear_status_flags();
+        return -EIO;
+    }
+
+    if (!flash_is_blank(addr, FLASH_PAGE_SIZE)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
 void flash_erase_main_app(void)
 {
     flash_unlock();
 
     for (size_t i = FLASH_MAIN_APP_START; i < FLASH_END_ADDR; i += FLASH_PAGE_SIZE) {
-        flash_erase_page(i);
+        (void)flash_erase_page_if_needed(i, true);
     }
 
     flash_lock();
 }
 
-int flash_write(size_t addr, const void *data, size_t size)
+int flash_erase(size_t addr, size_t size)
+{
+    int status = 0;
+
+    flash_unlock();
+    flash_clear_status_flags();
+
+    for (size_t page = addr - (addr % FLASH_PAGE_SIZE); (page < addr + size) && (status == 0); page += FLASH_PAGE_SIZE) {
+        status = flash_erase_page_if_needed(page, false);
+    }
+
+    flash_lock();
+
+    return status;
+}
+
+void flash_erase_plan_init(struct flash_erase_plan_t *plan, size_t addr, size_t size)
+{
+    /* Round the area out to complete pages */
+    plan->next_page = addr - (addr % FLASH_PAGE_SIZE);
+    plan->end = addr + size;
+}
+
+int flash_erase_plan_prepare(struct flash_erase_plan_t *plan, size_t end_addr)
+{
+    /* Never erase past the planned area, writes beyond it will just fail */
+    end_addr = MIN(end_addr, plan->end);
+
+    if (plan->next_page >= end_addr) {
+        return 0;
+    }
+
+    while (plan->next_page < end_addr) {
+        const int status = flash_erase_page_if_needed(plan->next_page, true);
+        if (status != 0) {
+            return status;
+        }
+
+        plan->next_page += FLASH_PAGE_SIZE;
+    }
+
+    scheduler_post_event(SCHEDULER_EVENT_FLASH_READY);
+
+    return 0;
+}
+
+static bool flash_erase_plan_is_in_reach(const struct flash_erase_plan_t *plan, size_t cursor)
+{
+    /* Stay at most one page ahead of the cursor */
+    const size_t cursor_page = cursor - (cursor % FLASH_PAGE_SIZE);
+
+    return (plan->next_page < plan->end) && (plan->next_page <= cursor_page + FLASH_PAGE_SIZE);
+}
+
+bool flash_erase_plan_is_due(struct flash_erase_plan_t *plan, size_t cursor)
+{
+    /* Blank pages are passed over, so each page is scanned only once */
+    while (flash_erase_plan_is_in_reach(plan, cursor)) {
+        if (!flash_is_blank(plan->next_page, FLASH_PAGE_SIZE)) {
+            return true;
+        }
+
+        plan->next_page += FLASH_PAGE_SIZE;
+    }
+
+    return false;
+}
+
+int flash_erase_plan_ahead(struct flash_erase_plan_t *plan, size_t cursor)
+{
+    if (!flash_erase_plan_is_in_reach(plan, cursor)) {
+        return 0;
+    }
+
+    /* Erase at most one page per call */
+    return flash_erase_plan_prepare(plan, plan->next_page + 1);
+}
+
+static int flash_program_if_needed(size_t addr, uint16_t value, bool in_ram)
+{
+    const uint16_t current = *(volatile uint16_t *)addr;
+
+    /* Nothing to do, this is the case for erased padding in particular */
+    if (current == value) {
+        return 0;
+    }
+
+    /* Half word can be programmed only once after erase */
+    if (current != FLASH_ERASED_HALF_WORD) {
+        return -EIO;
+    }
+
+    if (in_ram) {
+        flash_program_half_word_in_ram(addr, value);
+    } else {
+        flash_program_half_word(addr, value);
+    }
+
+    /* Check for programming errors and verify the result right away */
+    if ((FLASH_SR & (FLASH_SR_PGERR | FLASH_SR_WRPRTERR)) != 0) {
+        flash_clear_status_flags();
+        return -EIO;
+    }
+
+    if (*(volatile uint16_t *)addr != value) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+void flash_batch_begin(void)
+{
+    flash_unlock();
+    flash_clear_status_flags();
+}
+
+static int flash_program_range(size_t addr, const void *data, size_t size, bool in_ram)
 {
     /* Address has to be aligned to half word */
     if ((data == NULL) || ((addr % 2) != 0)) {
@@ -24,24 +209,53 @@ int flash_write(size_t addr, const void *data, size_t size)
     const uint8_t *byte_ptr = data;
     const size_t half_words = size / 2;
     const bool not_aligned = size % 2;
-
-    flash_unlock();
+    int status;
 
     /* Write complete half words */
     for (size_t i = 0; i < half_words; ++i) {
-        flash_program_half_word(addr + i * 2, half_word_ptr[i]);
+        status = flash_program_if_needed(addr + i * 2, half_word_ptr[i], in_ram);
+        if (status != 0) {
+            return status;
+        }
     }
 
     /* Write remaining byte if any, leave upper byte not programmed */
     if (not_aligned) {
-        flash_program_half_word(addr + size - 1, byte_ptr[size - 1] | 0xFF00);
+        status = flash_program_if_needed(addr + size - 1, byte_ptr[size - 1] | 0xFF00, in_ram);
+        if (status != 0) {
+            return status;
+        }
     }
 
-    flash_lock();
+    return 0;
+}
+
+int flash_batch_write(size_t addr, const void *data, size_t size)
+{
+    const int status = flash_program_range(addr, data, size, true);
+    if (status != 0) {
+        return status;
+    }
+
+    scheduler_post_event(SCHEDULER_EVENT_FLASH_READY);
 
     return 0;
 }
 
+void flash_batch_end(void)
+{
+    flash_lock();
+}
+
+int flash_write(size_t addr, const void *data, size_t size)
+{
+    flash_batch_begin();
+    const int status = flash_program_range(addr, data, size, false);
+    flash_batch_end();
+
+    return status;
+}
+
 void flash_read(size_t addr, void *data, size_t size)
 {
     uint16_t *half_word_ptr = data;
@@ -1,21 +1,52 @@
 #pragma once
 
 #include <stddef.h>
-
-extern volatile char _bootloader_size[];
+#include <stdbool.h>
 
 #define FLASH_PAGE_SIZE 0x400
 #define FLASH_SIZE 0x10000
 #define FLASH_BASE_ADDR 0x08000000
 #define FLASH_END_ADDR (FLASH_BASE_ADDR + FLASH_SIZE)
 
+/* Set by the build, the same value sizes the slot in both linker scripts */
+#ifndef FLASH_BOOTLOADER_SIZE
+#error "FLASH_BOOTLOADER_SIZE is not defined"
+#endif
+
 #define FLASH_BOOTLOADER_START FLASH_BASE_ADDR
-#define FLASH_BOOTLOADER_SIZE (size_t)_bootloader_size
 
 #define FLASH_MAIN_APP_START (FLASH_BOOTLOADER_START + FLASH_BOOTLOADER_SIZE)
 #define FLASH_MAIN_APP_MAX_SIZE (FLASH_SIZE - FLASH_BOOTLOADER_SIZE)
 
+#define FLASH_ERASED_HALF_WORD 0xFFFF
+
+/* Erase planner, erases only the pages covering given area, one by one just ahead of the
+ * write cursor. Pages that already read as blank are skipped. Has to be used inside a batch. */
+struct flash_erase_plan_t
+{
+    size_t next_page;
+    size_t end;
+};
+
 void flash_erase_main_app(void);
 
+bool flash_is_blank(size_t addr, size_t size);
+
+void flash_erase_plan_init(struct flash_erase_plan_t *plan, size_t addr, size_t size);
+int flash_erase_plan_prepare(struct flash_erase_plan_t *plan, size_t end_addr);
+/* Erase stalls every flash access for ~20ms, check if the next call to ahead() will erase.
+ * Moves the plan past blank pages in reach, they never have to be scanned again. */
+bool flash_erase_plan_is_due(struct flash_erase_plan_t *plan, size_t cursor);
+int flash_erase_plan_ahead(struct flash_erase_plan_t *plan, size_t cursor);
+
+/* Batched programming keeps the flash unlocked between the writes. Half words that
+ * already hold the target value are skipped, the rest is checked and verified. */
+void flash_batch_begin(void);
+int flash_batch_write(size_t addr, const void *data, size_t size);
+void flash_batch_end(void);
+
+/* Standalone erase and write don't touch any static data, not even the scheduler's,
+ * so the firmware can call them through boot services */
+int flash_erase(size_t addr, size_t size);
 int flash_write(size_t addr, const void *data, size_t size);
 void flash_read(size_t addr, void *data, size_t size);
@@ -0,0 +1,193 @@
+#include "flash_sim.h"
+#include <utils.h>
+#include <scheduler.h>
+#include <string.h>
+#include <errno.h>
+
+#define FLASH_SIM_ERASED_BYTE 0xFF
+
+struct flash_sim_ctx_t
+{
+    uint8_t memory[FLASH_SIZE];
+    uint32_t erase_count;
+    uint32_t programmed_bytes;
+};
+
+static struct flash_sim_ctx_t ctx = {
+    .memory = {[0 ... (FLASH_SIZE - 1)] = FLASH_SIM_ERASED_BYTE},
+};
+
+static uint8_t *flash_sim_get_ptr(size_t addr)
+{
+    return &ctx.memory[addr - FLASH_BASE_ADDR];
+}
+
+static bool flash_sim_is_in_range(size_t addr, size_t size)
+{
+    return (addr >= FLASH_BASE_ADDR) && (addr <= FLASH_END_ADDR) && (size <= (FLASH_END_ADDR - addr));
+}
+
+bool flash_is_blank(size_t addr, size_t size)
+{
+    const uint8_t *flash_ptr = flash_sim_get_ptr(addr);
+
+    for (size_t i = 0; i < size; ++i) {
+        if (flash_ptr[i] != FLASH_SIM_ERASED_BYTE) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int flash_sim_erase_page_if_needed(size_t addr)
+{
+    if (!flash_sim_is_in_range(addr, FLASH_PAGE_SIZE)) {
+        return -EIO;
+    }
+
+    if (flash_is_blank(addr, FLASH_PAGE_SIZE)) {
+        return 0;
+    }
+
+    memset(flash_sim_get_ptr(addr), FLASH_SIM_ERASED_BYTE, FLASH_PAGE_SIZE);
+    ++ctx.erase_count;
+
+    return 0;
+}
+
+void flash_erase_main_app(void)
+{
+    for (size_t i = FLASH_MAIN_APP_START; i < FLASH_END_ADDR; i += FLASH_PAGE_SIZE) {
+        (void)flash_sim_erase_page_if_needed(i);
+    }
+}
+
+int flash_erase(size_t addr, size_t size)
+{
+    int status = 0;
+
+    for (size_t page = addr - (addr % FLASH_PAGE_SIZE); (page < addr + size) && (status == 0); page += FLASH_PAGE_SIZE) {
+        status = flash_sim_erase_page_if_needed(page);
+    }
+
+    return status;
+}
+
+void flash_erase_plan_init(struct flash_erase_plan_t *plan, size_t addr, size_t size)
+{
+    plan->next_page = addr - (addr % FLASH_PAGE_SIZE);
+    plan->end = addr + size;
+}
+
+int flash_erase_plan_prepare(struct flash_erase_plan_t *plan, size_t end_addr)
+{
+    end_addr = MIN(end_addr, plan->end);
+
+    if (plan->next_page >= end_addr) {
+        return 0;
+    }
+
+    while (plan->next_page < end_addr) {
+        const int status = flash_sim_erase_page_if_needed(plan->next_page);
+        if (status != 0) {
+            return status;
+        }
+
+        plan->next_page += FLASH_PAGE_SIZE;
+    }
+
+    scheduler_post_event(SCHEDULER_EVENT_FLASH_READY);
+
+    return 0;
+}
+
+static bool flash_erase_plan_is_in_reach(const struct flash_erase_plan_t *plan, size_t cursor)
+{
+    const size_t cursor_page = cursor - (cursor % FLASH_PAGE_SIZE);
+
+    return (plan->next_page < plan->end) && (plan->next_page <= cursor_page + FLASH_PAGE_SIZE);
+}
+
+bool flash_erase_plan_is_due(struct flash_erase_plan_t *plan, size_t cursor)
+{
+    while (flash_erase_plan_is_in_reach(plan, cursor)) {
+        if (!flash_is_blank(plan->next_page, FLASH_PAGE_SIZE)) {
+            return true;
+        }
+
+        plan->next_page += FLASH_PAGE_SIZE;
+    }
+
+    return false;
+}
+
+int flash_erase_plan_ahead(struct flash_erase_plan_t *plan, size_t cursor)
+{
+    if (!flash_erase_plan_is_in_reach(plan, cursor)) {
+        return 0;
+    }
+
+    return flash_erase_plan_prepare(plan, plan->next_page + 1);
+}
+
+static int flash_sim_program_range(size_t addr, const void *data, size_t size)
+{
+    const uint8_t *data_ptr = data;
+
+    if ((data == NULL) || ((addr % 2) != 0) || !flash_sim_is_in_range(addr, size)) {
+        return -EINVAL;
+    }
+
+    /* Byte that is neither erased nor the same stands for a half word programmed twice */
+    uint8_t *flash_ptr = flash_sim_get_ptr(addr);
+    for (size_t i = 0; i < size; ++i) {
+        if ((flash_ptr[i] != data_ptr[i]) && (flash_ptr[i] != FLASH_SIM_ERASED_BYTE)) {
+            return -EIO;
+        }
+        flash_ptr[i] = data_ptr[i];
+    }
+    ctx.programmed_bytes += size;
+
+    return 0;
+}
+
+void flash_batch_begin(void)
+{
+}
+
+int flash_batch_write(size_t addr, const void *data, size_t size)
+{
+    const int status = flash_sim_program_range(addr, data, size);
+    if (status != 0) {
+        return status;
+    }
+
+    scheduler_post_event(SCHEDULER_EVENT_FLASH_READY);
+
+    return 0;
+}
+
+void flash_batch_end(void)
+{
+}
+
+int flash_write(size_t addr, const void *data, size_t size)
+{
+    return flash_sim_program_range(addr, data, size);
+}
+
+void flash_read(size_t addr, void *data, size_t size)
+{
+    memcpy(data, flash_sim_get_ptr(addr), size);
+}
+
+uint32_t flash_sim_get_erase_count(void)
+{
+    return ctx.erase_count;
+}
+
+uint32_t flash_sim_get_programmed_bytes(void)
+{
+    return ctx.programmed_bytes;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "flash.h"
+#include <stdint.h>
+
+/* Host backend kept in memory, behaves like the internal flash: starts erased, half words can be
+ * programmed once after erase and pages already blank are not erased again */
+uint32_t flash_sim_get_erase_count(void);
+
+/* Bytes programmed since start, tells the test how far the code got at a given moment */
+uint32_t flash_sim_get_programmed_bytes(void);
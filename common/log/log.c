@@ -0,0 +1,87 @@
+#include "log.h"
+#include <uart.h>
+#include <ring_buffer.h>
+#include <string.h>
+#include <errno.h>
+#include <libopencm3/cm3/cortex.h>
+
+/* Records are COBS encoded and terminated with zero like packets, the decoder can start anywhere */
+#define LOG_FRAME_DELIMITER 0x00
+#define LOG_ID_SIZE 2
+#define LOG_RECORD_MAX_SIZE (LOG_ID_SIZE + LOG_MAX_ARGS * sizeof(uint32_t))
+#define LOG_FRAME_MAX_SIZE (LOG_RECORD_MAX_SIZE + 2)
+
+struct log_ctx_t
+{
+    struct ring_buffer_t buf;
+    uint8_t buf_data[LOG_BUFFER_SIZE];
+    uint32_t dropped;
+};
+
+static struct log_ctx_t ctx;
+
+static size_t log_encode_frame(const uint8_t *data, size_t size, uint8_t *frame)
+{
+    size_t code_index = 0;
+    size_t frame_size = 1;
+
+    for (size_t i = 0; i < size; ++i) {
+        if (data[i] == LOG_FRAME_DELIMITER) {
+            frame[code_index] = frame_size - code_index;
+            code_index = frame_size++;
+        } else {
+            frame[frame_size++] = data[i];
+        }
+    }
+    frame[code_index] = frame_size - code_index;
+    frame[frame_size++] = LOG_FRAME_DELIMITER;
+
+    return frame_size;
+}
+
+/* Record goes in whole or not at all, the caller masks interrupts */
+static int log_put_record(uint16_t id, const uint32_t *args, size_t count)
+{
+    uint8_t record[LOG_RECORD_MAX_SIZE];
+    uint8_t frame[LOG_FRAME_MAX_SIZE];
+
+    record[0] = id & 0xFF;
+    record[1] = id >> 8;
+    memcpy(&record[LOG_ID_SIZE], args, count * sizeof(uint32_t));
+
+    const size_t frame_size = log_encode_frame(record, LOG_ID_SIZE + count * sizeof(uint32_t), frame);
+    if (ring_buffer_get_free(&ctx.buf) < frame_size) {
+        return -ENOSPC;
+    }
+
+    ring_buffer_write(&ctx.buf, frame, frame_size);
+    return 0;
+}
+
+void log_init(void)
+{
+    ring_buffer_init(&ctx.buf, ctx.buf_data, sizeof(ctx.buf_data));
+    ctx.dropped = 0;
+}
+
+void log_write(uint16_t id, const uint32_t *args, size_t count)
+{
+    if (count > LOG_MAX_ARGS) {
+        return;
+    }
+
+    const uint32_t mask = cm_mask_interrupts(1);
+
+    /* Host learns about the gap before the next record that made it */
+    if ((ctx.dropped > 0) && (log_put_record(LOG_ID_DROPPED, &ctx.dropped, 1) == 0)) {
+        ctx.dropped = 0;
+    }
+
+    if ((ctx.dropped > 0) || (log_put_record(id, args, count) != 0)) {
+        ++ctx.dropped;
+    }
+
+    cm_mask_interrupts(mask);
+
+    uart_write_async(&ctx.buf);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Records are queued in RAM and sent by UART interrupt, nothing is formatted on the device.
+ * Format strings are placed in .logstr, which stays in the ELF only. A string's address in it
+ * is the ID sent on the wire, the host decoder looks it up and formats the arguments. */
+#define LOG_BUFFER_SIZE 256
+#define LOG_MAX_ARGS 4
+
+/* Sent in place of the records that didn't fit into the buffer, with their count */
+#define LOG_ID_DROPPED 0xFFFF
+
+/* Arguments are sent as 32-bit words, so only integer conversions are supported */
+#define LOG(fmt, ...) \
+    do { \
+        static const char log_fmt[] __attribute__((section(".logstr"), used)) = fmt; \
+        const uint32_t log_args[] = {0, ##__VA_ARGS__}; \
+        _Static_assert((sizeof(log_args) / sizeof(log_args[0]) - 1) <= LOG_MAX_ARGS, "Too many log arguments"); \
+        log_write((uint16_t)(uintptr_t)log_fmt, &log_args[1], sizeof(log_args) / sizeof(log_args[0]) - 1); \
+    } while (0)
+
+/* UART has to be initialized first and not written to directly afterwards */
+void log_init(void);
+
+/* Safe to call from interrupts, the record is dropped when the buffer is full */
+void log_write(uint16_t id, const uint32_t *args, size_t count);
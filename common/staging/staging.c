@@ -0,0 +1,297 @@
+#include "staging.h"
+#include <crc32.h>
+#include <utils.h>
+#include <string.h>
+#include <errno.h>
+
+#define STAGING_MAGIC 0x47415453 // "STAG"
+
+struct staging_header_t
+{
+    uint32_t magic;
+    uint32_t size;
+    uint32_t crc32;         // Same CRC as the hardware unit computes, over the whole image
+};
+
+struct staging_ctx_t
+{
+    const struct storage_t *storage;
+    uint8_t buffers[2][STAGING_BUFFER_SIZE];
+    uint8_t fill;           // Buffer being filled, the other one may be written meanwhile
+    size_t fill_size;
+    size_t offset;          // Image bytes handed over to the storage
+    size_t size;
+    struct staging_header_t header;
+};
+
+static struct staging_ctx_t ctx;
+
+static size_t staging_get_image_addr(void)
+{
+    return ctx.storage->erase_size;
+}
+
+static int staging_discard(void)
+{
+    const int result = ctx.storage->erase(0, ctx.storage->erase_size);
+    if (result != 0) {
+        return result;
+    }
+
+    return ctx.storage->wait();
+}
+
+static int staging_compute_crc(size_t size, uint32_t *crc)
+{
+    crc32_reset();
+
+    for (size_t offset = 0; offset < size; offset += STAGING_BUFFER_SIZE) {
+        const size_t chunk = MIN(size - offset, STAGING_BUFFER_SIZE);
+
+        int result = ctx.storage->read(staging_get_image_addr() + offset, ctx.buffers[0], chunk);
+        if (result == 0) {
+            result = ctx.storage->wait();
+        }
+        if (result != 0) {
+            return result;
+        }
+
+        crc32_write(ctx.buffers[0], chunk);
+    }
+
+    *crc = crc32_read();
+    return 0;
+}
+
+static uint32_t staging_compute_installed_crc(size_t size)
+{
+    crc32_reset();
+
+    for (size_t offset = 0; offset < size; offset += STAGING_BUFFER_SIZE) {
+        const size_t chunk = MIN(size - offset, STAGING_BUFFER_SIZE);
+
+        flash_read(FLASH_MAIN_APP_START + offset, ctx.buffers[0], chunk);
+        crc32_write(ctx.buffers[0], chunk);
+    }
+
+    return crc32_read();
+}
+
+static int staging_flush(void)
+{
+    const uint8_t *buffer = ctx.buffers[ctx.fill];
+    const size_t size = ctx.fill_size;
+
+    /* CRC is kept up with the data, only the last part is not a multiple of 4 bytes */
+    crc32_write(buffer, size);
+    const int result = ctx.storage->write(staging_get_image_addr() + ctx.offset, buffer, size);
+
+    ctx.offset += size;
+    ctx.fill ^= 1;
+    ctx.fill_size = 0;
+
+    return result;
+}
+
+int staging_init(const struct storage_t *storage)
+{
+    if (storage == NULL) {
+        return -EINVAL;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.storage = storage;
+
+    return ctx.storage->init();
+}
+
+void staging_deinit(void)
+{
+    ctx.storage->deinit();
+}
+
+int staging_begin(size_t size)
+{
+    const size_t erase_size = ctx.storage->erase_size;
+
+    if ((size == 0) || (size > FLASH_MAIN_APP_MAX_SIZE) || (size > (ctx.storage->get_size() - staging_get_image_addr()))) {
+        return -EINVAL;
+    }
+
+    /* Header goes first, an interrupted download must not look complete */
+    const size_t area_size = ((staging_get_image_addr() + size + erase_size - 1) / erase_size) * erase_size;
+    int result = ctx.storage->erase(0, area_size);
+    if (result == 0) {
+        result = ctx.storage->wait();
+    }
+    if (result != 0) {
+        return result;
+    }
+
+    ctx.fill = 0;
+    ctx.fill_size = 0;
+    ctx.offset = 0;
+    ctx.size = size;
+    crc32_reset();
+
+    return 0;
+}
+
+int staging_write(const void *data, size_t size)
+{
+    const uint8_t *data_ptr = data;
+    const size_t room = STAGING_BUFFER_SIZE - ctx.fill_size;
+
+    if ((data == NULL) || (size > STAGING_BUFFER_SIZE) || (size > (ctx.size - ctx.offset - ctx.fill_size))) {
+        return -EINVAL;
+    }
+
+    if (size < room) {
+        memcpy(&ctx.buffers[ctx.fill][ctx.fill_size], data_ptr, size);
+        ctx.fill_size += size;
+        return 0;
+    }
+
+    /* Filled buffer can go only once the storage is done with the other one */
+    if (ctx.storage->is_busy()) {
+        return -EBUSY;
+    }
+
+    memcpy(&ctx.buffers[ctx.fill][ctx.fill_size], data_ptr, room);
+    ctx.fill_size += room;
+    const int result = staging_flush();
+    if (result != 0) {
+        return result;
+    }
+
+    memcpy(ctx.buffers[ctx.fill], &data_ptr[room], size - room);
+    ctx.fill_size = size - room;
+
+    return 0;
+}
+
+void staging_poll(void)
+{
+    (void)ctx.storage->is_busy();
+}
+
+int staging_commit(void)
+{
+    int result = 0;
+
+    if (ctx.fill_size > 0) {
+        result = staging_flush();
+    }
+    if (result == 0) {
+        result = ctx.storage->wait();
+    }
+    if (result != 0) {
+        return result;
+    }
+
+    if (ctx.offset != ctx.size) {
+        return -EINVAL;
+    }
+
+    /* Read back what has been stored, a failed program would go unnoticed otherwise */
+    const uint32_t crc = crc32_read();
+    uint32_t stored_crc;
+    result = staging_compute_crc(ctx.size, &stored_crc);
+    if (result != 0) {
+        return result;
+    }
+    if (stored_crc != crc) {
+        return -EIO;
+    }
+
+    ctx.header.magic = STAGING_MAGIC;
+    ctx.header.size = ctx.size;
+    ctx.header.crc32 = crc;
+    result = ctx.storage->write(0, &ctx.header, sizeof(ctx.header));
+    if (result != 0) {
+        return result;
+    }
+
+    return ctx.storage->wait();
+}
+
+int staging_install(void)
+{
+    struct flash_erase_plan_t erase_plan;
+
+    int result = ctx.storage->read(0, &ctx.header, sizeof(ctx.header));
+    if (result == 0) {
+        result = ctx.storage->wait();
+    }
+    if (result != 0) {
+        return result;
+    }
+
+    if (ctx.header.magic != STAGING_MAGIC) {
+        return 0;
+    }
+
+    const size_t size = ctx.header.size;
+    if ((size == 0) || (size > FLASH_MAIN_APP_MAX_SIZE)) {
+        (void)staging_discard();
+        return -EINVAL;
+    }
+
+    /* Staged copy is checked before the installed image is touched */
+    uint32_t crc;
+    result = staging_compute_crc(size, &crc);
+    if (result != 0) {
+        return result;
+    }
+    if (crc != ctx.header.crc32) {
+        (void)staging_discard();
+        return -EIO;
+    }
+
+    flash_batch_begin();
+    flash_erase_plan_init(&erase_plan, FLASH_MAIN_APP_START, size);
+
+    /* Next buffer is read by DMA while the current one is erased and programmed */
+    uint8_t current = 0;
+    size_t chunk = MIN(size, STAGING_BUFFER_SIZE);
+    result = ctx.storage->read(staging_get_image_addr(), ctx.buffers[current], chunk);
+
+    for (size_t offset = 0; (result == 0) && (offset < size); offset += chunk) {
+        result = ctx.storage->wait();
+        if (result != 0) {
+            break;
+        }
+
+        chunk = MIN(size - offset, STAGING_BUFFER_SIZE);
+        const size_t next_offset = offset + chunk;
+        if (next_offset < size) {
+            result = ctx.storage->read(staging_get_image_addr() + next_offset, ctx.buffers[current ^ 1],
+                                       MIN(size - next_offset, STAGING_BUFFER_SIZE));
+            if (result != 0) {
+                break;
+            }
+        }
+
+        const size_t write_addr = FLASH_MAIN_APP_START + offset;
+        if ((flash_erase_plan_prepare(&erase_plan, write_addr + chunk) != 0) ||
+            (flash_batch_write(write_addr, ctx.buffers[current], chunk) != 0)) {
+            result = -EIO;
+            break;
+        }
+
+        current ^= 1;
+    }
+
+    flash_batch_end();
+    (void)ctx.storage->wait();
+    if (result != 0) {
+        return result;
+    }
+
+    /* Mark stays until the copy is known to be good, power loss just repeats the copy */
+    if (staging_compute_installed_crc(size) != ctx.header.crc32) {
+        return -EIO;
+    }
+
+    return staging_discard();
+}
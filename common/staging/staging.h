@@ -0,0 +1,32 @@
+#pragma once
+
+#include <storage.h>
+#include <flash.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Image is downloaded into external storage and copied into the firmware slot afterwards, so the
+ * link never waits for internal flash erase and the installed image stays intact until the new one
+ * is complete. Header in the first erase unit marks a complete image, the image follows it. */
+#define STAGING_BUFFER_SIZE FLASH_PAGE_SIZE
+
+int staging_init(const struct storage_t *storage);
+void staging_deinit(void);
+
+/* Erases the area for the image, blocks until done */
+int staging_begin(size_t size);
+
+/* Full buffers are written in background, -EBUSY means both are in use and the data wasn't taken.
+ * Size can't exceed the buffer size. */
+int staging_write(const void *data, size_t size);
+
+/* Storage writes a buffer in several steps, each started from its is_busy(). This or staging_write()
+ * has to be called while buffered data is being written, or the write doesn't go on. */
+void staging_poll(void);
+
+/* Writes the rest, checks what has been stored and marks the image complete, blocks until done */
+int staging_commit(void);
+
+/* Copies a complete staged image into the firmware slot, then clears the mark. An interrupted
+ * copy is repeated on the next call. Returns 0 when there's nothing to install. */
+int staging_install(void);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Flash-like memory outside of the MCU, staging doesn't care what's underneath.
+ * Addresses are relative to the start of the device. */
+struct storage_t
+{
+    size_t erase_size;      // Erase has to be aligned to it
+
+    int (*init)(void);
+    void (*deinit)(void);
+
+    /* Known once the device has been initialized */
+    size_t (*get_size)(void);
+
+    /* Operations run in background and return once started, the next one waits for the previous
+     * and returns its failure instead of starting. Written data has to be erased first,
+     * buffers have to stay untouched until it's done. */
+    int (*erase)(size_t addr, size_t size);
+    int (*write)(size_t addr, const void *data, size_t size);
+    int (*read)(size_t addr, void *data, size_t size);
+
+    /* Moves the operation in progress on, so it has to be polled */
+    bool (*is_busy)(void);
+
+    /* Blocks until the operation in progress is done, returns its result */
+    int (*wait)(void);
+};
@@ -0,0 +1,153 @@
+#include "storage_sim.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#define STORAGE_SIM_ERASED_BYTE 0xFF
+#define STORAGE_SIM_CHUNK_SIZE 256
+
+struct storage_sim_ctx_t
+{
+    const char *path;
+    FILE *file;
+};
+
+static struct storage_sim_ctx_t ctx;
+
+static bool storage_sim_is_in_range(size_t addr, size_t size)
+{
+    return (addr <= STORAGE_SIM_SIZE) && (size <= (STORAGE_SIM_SIZE - addr));
+}
+
+static int storage_sim_fill(size_t addr, size_t size)
+{
+    uint8_t chunk[STORAGE_SIM_CHUNK_SIZE];
+
+    memset(chunk, STORAGE_SIM_ERASED_BYTE, sizeof(chunk));
+    if (fseek(ctx.file, addr, SEEK_SET) != 0) {
+        return -EIO;
+    }
+
+    while (size > 0) {
+        const size_t chunk_size = (size < sizeof(chunk)) ? size : sizeof(chunk);
+        if (fwrite(chunk, 1, chunk_size, ctx.file) != chunk_size) {
+            return -EIO;
+        }
+        size -= chunk_size;
+    }
+
+    return 0;
+}
+
+static int storage_sim_init(void)
+{
+    if (ctx.path == NULL) {
+        return -EINVAL;
+    }
+
+    ctx.file = fopen(ctx.path, "r+b");
+    if (ctx.file != NULL) {
+        return 0;
+    }
+
+    ctx.file = fopen(ctx.path, "w+b");
+    if (ctx.file == NULL) {
+        return -EIO;
+    }
+
+    return storage_sim_fill(0, STORAGE_SIM_SIZE);
+}
+
+static void storage_sim_deinit(void)
+{
+    if (ctx.file != NULL) {
+        fclose(ctx.file);
+        ctx.file = NULL;
+    }
+}
+
+static size_t storage_sim_get_size(void)
+{
+    return STORAGE_SIM_SIZE;
+}
+
+static int storage_sim_erase(size_t addr, size_t size)
+{
+    if (((addr % STORAGE_SIM_ERASE_SIZE) != 0) || ((size % STORAGE_SIM_ERASE_SIZE) != 0) || !storage_sim_is_in_range(addr, size)) {
+        return -EINVAL;
+    }
+
+    return storage_sim_fill(addr, size);
+}
+
+static int storage_sim_read(size_t addr, void *data, size_t size)
+{
+    if ((data == NULL) || !storage_sim_is_in_range(addr, size)) {
+        return -EINVAL;
+    }
+
+    if ((fseek(ctx.file, addr, SEEK_SET) != 0) || (fread(data, 1, size, ctx.file) != size)) {
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int storage_sim_write(size_t addr, const void *data, size_t size)
+{
+    uint8_t chunk[STORAGE_SIM_CHUNK_SIZE];
+    const uint8_t *data_ptr = data;
+
+    if ((data == NULL) || !storage_sim_is_in_range(addr, size)) {
+        return -EINVAL;
+    }
+
+    /* Programming can only clear bits, writing without erase shows up as corrupted data */
+    while (size > 0) {
+        const size_t chunk_size = (size < sizeof(chunk)) ? size : sizeof(chunk);
+        if (storage_sim_read(addr, chunk, chunk_size) != 0) {
+            return -EIO;
+        }
+
+        for (size_t i = 0; i < chunk_size; ++i) {
+            chunk[i] &= data_ptr[i];
+        }
+
+        if ((fseek(ctx.file, addr, SEEK_SET) != 0) || (fwrite(chunk, 1, chunk_size, ctx.file) != chunk_size)) {
+            return -EIO;
+        }
+
+        addr += chunk_size;
+        data_ptr += chunk_size;
+        size -= chunk_size;
+    }
+
+    return 0;
+}
+
+static bool storage_sim_is_busy(void)
+{
+    return false;
+}
+
+static int storage_sim_wait(void)
+{
+    return (fflush(ctx.file) == 0) ? 0 : -EIO;
+}
+
+void storage_sim_set_path(const char *path)
+{
+    ctx.path = path;
+}
+
+const struct storage_t storage_sim = {
+    .erase_size = STORAGE_SIM_ERASE_SIZE,
+    .init = storage_sim_init,
+    .deinit = storage_sim_deinit,
+    .get_size = storage_sim_get_size,
+    .erase = storage_sim_erase,
+    .write = storage_sim_write,
+    .read = storage_sim_read,
+    .is_busy = storage_sim_is_busy,
+    .wait = storage_sim_wait,
+};
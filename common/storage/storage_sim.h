@@ -0,0 +1,12 @@
+#pragma once
+
+#include "storage.h"
+
+/* File-backed backend for host builds, behaves like NOR flash: writes only clear bits */
+#define STORAGE_SIM_SIZE 0x100000
+#define STORAGE_SIM_ERASE_SIZE 0x1000
+
+extern const struct storage_t storage_sim;
+
+/* Has to be set before init, the file is created erased if it doesn't exist */
+void storage_sim_set_path(const char *path);
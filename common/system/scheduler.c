@@ -0,0 +1,72 @@
+#include "scheduler.h"
+#include "system.h"
+#include <errno.h>
+#include <stddef.h>
+#include <libopencm3/cm3/cortex.h>
+
+struct scheduler_task_entry_t
+{
+    scheduler_task_t task;
+    uint32_t events;
+};
+
+struct scheduler_ctx_t
+{
+    volatile uint32_t pending_events;
+    struct scheduler_task_entry_t tasks[SCHEDULER_MAX_TASKS];
+    size_t task_count;
+};
+
+static struct scheduler_ctx_t ctx;
+
+int scheduler_add_task(scheduler_task_t task, uint32_t events)
+{
+    if (task == NULL) {
+        return -EINVAL;
+    }
+
+    if (ctx.task_count >= SCHEDULER_MAX_TASKS) {
+        return -ENOMEM;
+    }
+
+    ctx.tasks[ctx.task_count].task = task;
+    ctx.tasks[ctx.task_count].events = events;
+    ++ctx.task_count;
+
+    return 0;
+}
+
+void scheduler_remove_tasks(void)
+{
+    ctx.task_count = 0;
+    ctx.pending_events = 0;
+}
+
+RAMFUNC void scheduler_post_event(uint32_t events)
+{
+    const uint32_t mask = cm_mask_interrupts(1);
+    ctx.pending_events |= events;
+    cm_mask_interrupts(mask);
+}
+
+void scheduler_run(void)
+{
+    /* Check and sleep with interrupts masked, a pending interrupt still wakes the core up,
+     * but it's handled only after the mask is restored - this way no event can be missed */
+    const uint32_t mask = cm_mask_interrupts(1);
+    const uint32_t events = ctx.pending_events;
+    if (events == 0) {
+        system_sleep();
+        cm_mask_interrupts(mask);
+        return;
+    }
+    ctx.pending_events = 0;
+    cm_mask_interrupts(mask);
+
+    /* Tasks run in the order they have been added */
+    for (size_t i = 0; i < ctx.task_count; ++i) {
+        if ((ctx.tasks[i].events & events) != 0) {
+            ctx.tasks[i].task();
+        }
+    }
+}
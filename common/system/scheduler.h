@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <utils.h>
+
+#define SCHEDULER_MAX_TASKS 4
+
+enum scheduler_event_t
+{
+    SCHEDULER_EVENT_RX = (1 << 0),          // New data in transport Rx buffer
+    SCHEDULER_EVENT_TIMER = (1 << 1),       // SysTick expired
+    SCHEDULER_EVENT_FLASH_READY = (1 << 2)  // Flash operation finished, next one can be started
+};
+
+typedef void (*scheduler_task_t)(void);
+
+int scheduler_add_task(scheduler_task_t task, uint32_t events);
+void scheduler_remove_tasks(void);
+
+/* Can be called from interrupt context, runs from RAM */
+RAMFUNC void scheduler_post_event(uint32_t events);
+
+/* Runs all tasks waiting for any of the pending events, puts the core to sleep if there are none */
+void scheduler_run(void);
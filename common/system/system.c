@@ -1,6 +1,30 @@
 #include "system.h"
+#include "scheduler.h"
+#include "system_time.h"
 #include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/dbgmcu.h>
+#include <libopencm3/stm32/timer.h>
 #include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/cortex.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+#include <libopencm3/cm3/vector.h>
+#include <string.h>
+
+/* Unused stack is filled with this pattern at startup */
+#define SYSTEM_STACK_PAINT 0xC5C5C5C5
+
+/* Alarm timer counts microseconds */
+#define SYSTEM_ALARM_TIMER TIM2
+#define SYSTEM_ALARM_FREQ_HZ 1000000
+
+/* VTOR needs the table aligned to its size rounded up to a power of 2 */
+#define SYSTEM_VECTOR_TABLE_ALIGN 512
+
+_Static_assert(sizeof(vector_table) <= SYSTEM_VECTOR_TABLE_ALIGN, "Vector table doesn't fit the alignment");
+
+/* Provided by the linker script */
+extern unsigned _ram_start, _ebss, _stack;
 
 struct system_ctx_t
 {
@@ -9,20 +33,66 @@ struct system_ctx_t
 
 static struct system_ctx_t ctx;
 
-void sys_tick_handler(void)
+/* Placed at the start of RAM by the linker script, so the alignment costs nothing */
+__attribute__((section(".ram_vectors"), aligned(SYSTEM_VECTOR_TABLE_ALIGN)))
+static vector_table_t system_ram_vector_table;
+
+RAMFUNC_HANDLER void sys_tick_handler(void)
 {
     ++ctx.ticks;
+    scheduler_post_event(SCHEDULER_EVENT_TIMER);
+}
+
+RAMFUNC_HANDLER void tim2_isr(void)
+{
+    /* One-shot, whoever needs the next one sets it */
+    TIM_DIER(SYSTEM_ALARM_TIMER) &= ~TIM_DIER_CC1IE;
+    TIM_SR(SYSTEM_ALARM_TIMER) = ~TIM_SR_CC1IF;
+    scheduler_post_event(SCHEDULER_EVENT_TIMER);
+}
+
+static void system_paint_stack(void)
+{
+    uint32_t sp;
+    volatile uint32_t *word = (volatile uint32_t *)&_ebss;
+
+    /* Everything below current stack pointer is unused yet, interrupts are not running */
+    __asm__ __volatile__("mrs %0, msp\n" : "=r"(sp));
+    while ((uint32_t)word < sp) {
+        *word++ = SYSTEM_STACK_PAINT;
+    }
 }
 
 void system_init(void)
 {
+    system_paint_stack();
+
     /* Configure RCC */
-    rcc_clock_setup_pll(&rcc_hsi_configs[SYSTEM_HSI_CONFIG]);
+    rcc_clock_setup_pll(&SYSTEM_CLOCK_CONFIG);
 
     /* Configure SysTick */
-    systick_set_frequency(SYSTEM_SYSTICK_FREQ_HZ, rcc_hsi_configs[SYSTEM_HSI_CONFIG].ahb_frequency);
+    systick_set_frequency(SYSTEM_SYSTICK_FREQ_HZ, SYSTEM_CLOCK_CONFIG.ahb_frequency);
     systick_counter_enable();
     systick_interrupt_enable();
+
+    /* Configure alarm timer, APB1 timers run at twice the bus clock when it's divided */
+    const uint32_t timer_freq = (rcc_apb1_frequency == rcc_ahb_frequency) ? rcc_apb1_frequency : (2 * rcc_apb1_frequency);
+    rcc_periph_clock_enable(RCC_TIM2);
+    TIM_PSC(SYSTEM_ALARM_TIMER) = (timer_freq / SYSTEM_ALARM_FREQ_HZ) - 1;
+    TIM_ARR(SYSTEM_ALARM_TIMER) = 0xFFFF;
+    TIM_EGR(SYSTEM_ALARM_TIMER) = TIM_EGR_UG;
+    TIM_SR(SYSTEM_ALARM_TIMER) = 0;
+    TIM_CR1(SYSTEM_ALARM_TIMER) |= TIM_CR1_CEN;
+    nvic_enable_irq(NVIC_TIM2_IRQ);
+
+    /* Keep debugger connected while the core sleeps */
+    DBGMCU_CR |= DBGMCU_CR_SLEEP;
+}
+
+void system_relocate_vector_table(void)
+{
+    memcpy(&system_ram_vector_table, &vector_table, sizeof(vector_table));
+    SCB_VTOR = (uint32_t)&system_ram_vector_table;
 }
 
 void system_deinit(void)
@@ -31,6 +101,11 @@ void system_deinit(void)
     systick_interrupt_disable();
     systick_counter_disable();
     systick_clear();
+
+    /* Disable alarm timer */
+    nvic_disable_irq(NVIC_TIM2_IRQ);
+    rcc_periph_reset_pulse(RST_TIM2);
+    rcc_periph_clock_disable(RCC_TIM2);
 }
 
 uint32_t system_get_ticks(void)
@@ -38,18 +113,83 @@ uint32_t system_get_ticks(void)
     return ctx.ticks;
 }
 
+uint32_t system_get_us(void)
+{
+    uint32_t ticks;
+    uint32_t counter;
+    bool reload_pending;
+
+    /* Read again if SysTick has expired or reloaded in the meantime, so the pending flag belongs
+     * to the counter value. Flag stays set while the handler is held off by masked interrupts. */
+    do {
+        ticks = ctx.ticks;
+        counter = systick_get_value();
+        reload_pending = ((SCB_ICSR & SCB_ICSR_PENDSTSET) != 0);
+    } while ((ticks != ctx.ticks) || (systick_get_value() > counter));
+
+    return system_time_from_systick(ticks, counter, systick_get_reload(), reload_pending);
+}
+
 void system_delay_ms(uint32_t ms)
 {
-    const uint32_t end_tick = system_get_ticks() + ms;
+    const uint32_t start_tick = system_get_ticks();
+
+    /* SysTick wakes the core up every tick, subtraction keeps it working across wraparound */
+    while ((system_get_ticks() - start_tick) < ms) {
+        system_sleep();
+    }
+}
+
+void system_set_alarm_us(uint32_t delay_us)
+{
+    const uint16_t delay = (uint16_t)((delay_us > 0) ? MIN(delay_us, SYSTEM_ALARM_MAX_US) : 1);
+    const uint16_t start = TIM_CNT(SYSTEM_ALARM_TIMER);
+
+    TIM_CCR1(SYSTEM_ALARM_TIMER) = (uint16_t)(start + delay);
+    TIM_SR(SYSTEM_ALARM_TIMER) = ~TIM_SR_CC1IF;
+    TIM_DIER(SYSTEM_ALARM_TIMER) |= TIM_DIER_CC1IE;
 
-    while (system_get_ticks() < end_tick) {
-        __asm__ __volatile__("nop\n");
+    /* Compare may have matched before its flag got cleared, it would come only after a wraparound */
+    if ((uint16_t)(TIM_CNT(SYSTEM_ALARM_TIMER) - start) >= delay) {
+        scheduler_post_event(SCHEDULER_EVENT_TIMER);
     }
 }
 
+void system_get_memory(struct system_memory_t *memory)
+{
+    const uint32_t *word = (const uint32_t *)&_ebss;
+    const uint32_t *stack_top = (const uint32_t *)&_stack;
+
+    /* Stack grows down, so the paint is intact from the end of .bss up to the peak */
+    while ((word < stack_top) && (*word == SYSTEM_STACK_PAINT)) {
+        ++word;
+    }
+
+    memory->ram_size = (uint32_t)&_stack - (uint32_t)&_ram_start;
+    memory->static_size = (uint32_t)&_ebss - (uint32_t)&_ram_start;
+    memory->stack_size = (uint32_t)&_stack - (uint32_t)&_ebss;
+    memory->stack_peak = (uint32_t)stack_top - (uint32_t)word;
+}
+
+void system_sleep(void)
+{
+    __asm__ __volatile__("wfi\n");
+}
+
 __attribute__((noreturn)) void system_panic(void)
 {
+    cm_disable_interrupts();
+
+    /* Masked interrupts still wake the core up, so their sources are stopped as well */
+    systick_interrupt_disable();
+    systick_counter_disable();
+    SCB_ICSR = SCB_ICSR_PENDSTCLR;
+    for (uint32_t i = 0; i < ((NVIC_IRQ_COUNT + 31) / 32); ++i) {
+        NVIC_ICER(i) = 0xFFFFFFFF;
+        NVIC_ICPR(i) = 0xFFFFFFFF;
+    }
+
     while (1) {
-        __asm__ __volatile__("nop\n");
+        system_sleep();
     }
 }
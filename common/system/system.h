@@ -2,13 +2,47 @@
 
 #include <stdint.h>
 
-#define SYSTEM_HSI_CONFIG RCC_CLOCK_HSI_24MHZ
+/* USB takes its 48 MHz clock from the PLL and needs it within 0.25%, HSI is only good for 1%,
+ * so with USB the PLL runs from the 8 MHz crystal */
+#if SYSTEM_USB_CLOCK
+#define SYSTEM_CLOCK_CONFIG rcc_hse_configs[RCC_CLOCK_HSE8_72MHZ]
+#else
+#define SYSTEM_CLOCK_CONFIG rcc_hsi_configs[RCC_CLOCK_HSI_24MHZ]
+#endif
 #define SYSTEM_SYSTICK_FREQ_HZ 1000 // Gives standard resolution of 1ms per tick
+#define SYSTEM_ALARM_MAX_US 0xFFFF  // TIM2 counts microseconds in 16 bits
+
+/* RAM usage, stack is whatever is left between static data and the top of RAM */
+struct system_memory_t
+{
+    uint32_t ram_size;
+    uint32_t static_size;   // RAM vector table, .data and .bss
+    uint32_t stack_size;
+    uint32_t stack_peak;    // Deepest stack use since reset
+};
 
 void system_init(void);
 void system_deinit(void);
 
+/* Interrupts keep working while flash is busy only with vector table and handlers in RAM.
+ * The copy stays in use until someone else sets the vector table. */
+void system_relocate_vector_table(void);
+
 uint32_t system_get_ticks(void);
+
+/* Microsecond timebase, wraps around after ~71 minutes.
+ * Must not be called with interrupts masked for longer than one tick. */
+uint32_t system_get_us(void);
 void system_delay_ms(uint32_t ms);
 
+/* Posts the timer event once the delay is over, replaces the alarm set before. Wakes the core up
+ * between SysTicks, longer delays are cut to the maximum. */
+void system_set_alarm_us(uint32_t delay_us);
+
+/* Stack peak is found by looking for the deepest overwritten paint word */
+void system_get_memory(struct system_memory_t *memory);
+
+/* Sleeps until next interrupt */
+void system_sleep(void);
+
 __attribute__((noreturn)) void system_panic(void);
@@ -0,0 +1,151 @@
+#include "system_sim.h"
+#include "scheduler.h"
+#include "system_time.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYSTEM_SIM_TICK_US (1000000 / SYSTEM_SYSTICK_FREQ_HZ)
+
+/* Simulated SysTick counts microseconds */
+#define SYSTEM_SIM_SYSTICK_RELOAD (SYSTEM_SIM_TICK_US - 1)
+
+struct system_sim_ctx_t
+{
+    uint64_t now_us;        // Doesn't wrap around, the timebase does when it's read
+    uint64_t alarm_us;
+    bool alarm_set;
+    uint32_t ticks;         // Counted by the simulated SysTick handler
+    bool systick_held;
+    bool systick_pending;
+    system_sim_idle_hook_t idle_hook;
+    uint32_t sleep_count;
+};
+
+static struct system_sim_ctx_t ctx;
+
+void system_init(void)
+{
+    memset(&ctx, 0, sizeof(ctx));
+}
+
+void system_deinit(void)
+{
+}
+
+void system_relocate_vector_table(void)
+{
+}
+
+uint32_t system_get_ticks(void)
+{
+    return ctx.ticks;
+}
+
+uint32_t system_get_us(void)
+{
+    const uint32_t counter = SYSTEM_SIM_SYSTICK_RELOAD - (uint32_t)(ctx.now_us % SYSTEM_SIM_TICK_US);
+
+    return system_time_from_systick(ctx.ticks, counter, SYSTEM_SIM_SYSTICK_RELOAD, ctx.systick_pending);
+}
+
+void system_delay_ms(uint32_t ms)
+{
+    const uint32_t start_tick = system_get_ticks();
+
+    while ((system_get_ticks() - start_tick) < ms) {
+        system_sleep();
+    }
+}
+
+void system_set_alarm_us(uint32_t delay_us)
+{
+    ctx.alarm_us = ctx.now_us + ((delay_us > 0) ? MIN(delay_us, SYSTEM_ALARM_MAX_US) : 1);
+    ctx.alarm_set = true;
+}
+
+void system_get_memory(struct system_memory_t *memory)
+{
+    memset(memory, 0, sizeof(*memory));
+}
+
+void system_sleep(void)
+{
+    uint64_t wake_us = ((ctx.now_us / SYSTEM_SIM_TICK_US) + 1) * SYSTEM_SIM_TICK_US;
+
+    if (ctx.alarm_set && (ctx.alarm_us < wake_us)) {
+        wake_us = ctx.alarm_us;
+    }
+
+    ++ctx.sleep_count;
+    if ((ctx.idle_hook != NULL) && ctx.idle_hook()) {
+        return;
+    }
+
+    system_sim_advance_us((uint32_t)(wake_us - ctx.now_us));
+}
+
+__attribute__((noreturn)) void system_panic(void)
+{
+    fprintf(stderr, "System panic at %llu us\n", (unsigned long long)ctx.now_us);
+    abort();
+}
+
+static void system_sim_systick(void)
+{
+    /* Reloads while held are lost except the last one, like with a single pending bit */
+    if (ctx.systick_held) {
+        ctx.systick_pending = true;
+        return;
+    }
+
+    ctx.systick_pending = false;
+    ++ctx.ticks;
+    scheduler_post_event(SCHEDULER_EVENT_TIMER);
+}
+
+void system_sim_advance_us(uint32_t us)
+{
+    const uint64_t end = ctx.now_us + us;
+
+    /* Every SysTick and alarm passed on the way posts its event */
+    while (true) {
+        uint64_t next_us = ((ctx.now_us / SYSTEM_SIM_TICK_US) + 1) * SYSTEM_SIM_TICK_US;
+        if (ctx.alarm_set && (ctx.alarm_us < next_us)) {
+            next_us = ctx.alarm_us;
+        }
+        if (next_us > end) {
+            break;
+        }
+
+        ctx.now_us = next_us;
+        if (ctx.alarm_set && (ctx.alarm_us == next_us)) {
+            ctx.alarm_set = false;
+            scheduler_post_event(SCHEDULER_EVENT_TIMER);
+        }
+        if ((next_us % SYSTEM_SIM_TICK_US) == 0) {
+            system_sim_systick();
+        }
+    }
+
+    ctx.now_us = end;
+}
+
+void system_sim_hold_systick(bool hold)
+{
+    ctx.systick_held = hold;
+    if (!hold && ctx.systick_pending) {
+        system_sim_systick();
+    }
+}
+
+void system_sim_set_idle_hook(system_sim_idle_hook_t hook)
+{
+    ctx.idle_hook = hook;
+}
+
+uint32_t system_sim_get_sleep_count(void)
+{
+    return ctx.sleep_count;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "system.h"
+#include <stdbool.h>
+
+/* Host backend with simulated time, which moves only when the code sleeps or the test advances it.
+ * Sleeping skips to the next SysTick or alarm, which post the timer event like their interrupts do. */
+void system_sim_advance_us(uint32_t us);
+
+/* Holds the SysTick handler back like masked interrupts do, the reload stays pending until released */
+void system_sim_hold_systick(bool hold);
+
+/* Called each time the code goes to sleep, before the time moves on. The other end of a simulated
+ * link runs from here, it returns true when it has posted an event and the sleep is cut short. */
+typedef bool (*system_sim_idle_hook_t)(void);
+void system_sim_set_idle_hook(system_sim_idle_hook_t hook);
+
+/* Sleep calls since init, tells the test whether the code waited or spun */
+uint32_t system_sim_get_sleep_count(void);
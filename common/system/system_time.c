@@ -0,0 +1,14 @@
+#include "system_time.h"
+#include "system.h"
+
+uint32_t system_time_from_systick(uint32_t ticks, uint32_t counter, uint32_t reload, bool reload_pending)
+{
+    const uint32_t tick_us = 1000000 / SYSTEM_SYSTICK_FREQ_HZ;
+
+    if (reload_pending) {
+        ++ticks;
+    }
+
+    /* SysTick counts down from reload value */
+    return (ticks * tick_us) + (((reload - counter) * tick_us) / (reload + 1));
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Converts SysTick state to microseconds. Counter reloads before the handler increments ticks,
+ * a pending SysTick interrupt means the reload has happened and the tick is not counted yet. */
+uint32_t system_time_from_systick(uint32_t ticks, uint32_t counter, uint32_t reload, bool reload_pending);
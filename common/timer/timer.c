@@ -3,6 +3,92 @@
 #include <errno.h>
 #include <stddef.h>
 
+struct timer_wheel_ctx_t
+{
+    struct timer_event_t *slots[TIMER_WHEEL_SLOTS];
+    uint32_t current_tick;
+    uint32_t last_us;
+    uint32_t alarm_tick;    // Tick the alarm has been set for
+    bool alarm_set;
+    bool initialized;
+};
+
+static struct timer_wheel_ctx_t wheel;
+
+static void timer_wheel_init(void)
+{
+    if (!wheel.initialized) {
+        wheel.last_us = system_get_us();
+        wheel.current_tick = 0;
+        wheel.initialized = true;
+    }
+}
+
+static void timer_wheel_insert(struct timer_event_t *event)
+{
+    struct timer_event_t **slot = &wheel.slots[event->expiry_tick % TIMER_WHEEL_SLOTS];
+
+    event->next = *slot;
+    *slot = event;
+    event->active = true;
+}
+
+static void timer_wheel_remove(struct timer_event_t *event)
+{
+    struct timer_event_t **node = &wheel.slots[event->expiry_tick % TIMER_WHEEL_SLOTS];
+
+    while (*node != NULL) {
+        if (*node == event) {
+            *node = event->next;
+            break;
+        }
+        node = &(*node)->next;
+    }
+
+    event->next = NULL;
+    event->active = false;
+}
+
+static void timer_wheel_set_alarm(uint32_t tick)
+{
+    /* Wheel may be behind, the task catches up when the alarm comes */
+    const uint32_t due_us = wheel.last_us + ((tick - wheel.current_tick) * TIMER_WHEEL_TICK_US);
+    const int32_t delay_us = (int32_t)(due_us - system_get_us());
+
+    wheel.alarm_tick = tick;
+    wheel.alarm_set = true;
+    system_set_alarm_us((delay_us > 0) ? (uint32_t)delay_us : 0);
+}
+
+static void timer_wheel_set_next_alarm(void)
+{
+    /* Closest expiry is looked for one turn ahead, timers due in later turns get the wheel checked
+     * after a turn. Without any timers SysTick is enough. */
+    bool pending = false;
+
+    for (uint32_t ahead = 1; ahead <= TIMER_WHEEL_SLOTS; ++ahead) {
+        const uint32_t tick = wheel.current_tick + ahead;
+
+        for (const struct timer_event_t *event = wheel.slots[tick % TIMER_WHEEL_SLOTS]; event != NULL; event = event->next) {
+            if (event->expiry_tick == tick) {
+                timer_wheel_set_alarm(tick);
+                return;
+            }
+            pending = true;
+        }
+    }
+
+    if (pending) {
+        timer_wheel_set_alarm(wheel.current_tick + TIMER_WHEEL_SLOTS);
+    }
+}
+
+static uint32_t timer_us_to_ticks(uint32_t us)
+{
+    /* Round up, so that the timer never fires early */
+    return (us + TIMER_WHEEL_TICK_US - 1) / TIMER_WHEEL_TICK_US;
+}
+
 int timer_init(struct timer_t *timer, uint32_t timeout)
 {
     if (timer == NULL) {
@@ -43,3 +129,104 @@ int timer_reset(struct timer_t *timer)
 
     return timer_init(timer, timer->timeout);
 }
+
+int timer_event_start(struct timer_event_t *event, uint32_t timeout_us, uint32_t period_us, timer_callback_t callback, void *arg)
+{
+    if ((event == NULL) || (callback == NULL)) {
+        return -EINVAL;
+    }
+
+    timer_wheel_init();
+
+    if (event->active) {
+        timer_wheel_remove(event);
+    }
+
+    /* Counted from the last processed tick, the task may not have caught up with the time yet.
+     * Current tick has already been processed, so expire at the next one at least. */
+    const uint32_t timeout_ticks = timer_us_to_ticks((system_get_us() - wheel.last_us) + timeout_us);
+    event->expiry_tick = wheel.current_tick + ((timeout_ticks > 0) ? timeout_ticks : 1);
+    event->period_ticks = timer_us_to_ticks(period_us);
+    event->callback = callback;
+    event->arg = arg;
+
+    timer_wheel_insert(event);
+
+    /* Stopped timers leave their alarm behind, it just makes the task run for nothing */
+    if (!wheel.alarm_set || ((int32_t)(event->expiry_tick - wheel.alarm_tick) < 0)) {
+        timer_wheel_set_alarm(event->expiry_tick);
+    }
+
+    return 0;
+}
+
+int timer_event_stop(struct timer_event_t *event)
+{
+    if (event == NULL) {
+        return -EINVAL;
+    }
+
+    if (event->active) {
+        timer_wheel_remove(event);
+    }
+
+    return 0;
+}
+
+bool timer_event_is_active(const struct timer_event_t *event)
+{
+    if (event == NULL) {
+        return false;
+    }
+
+    return event->active;
+}
+
+void timer_wheel_task(void)
+{
+    timer_wheel_init();
+
+    /* Work on differences, this way the wheel is not affected by timebase wraparound */
+    const uint32_t now = system_get_us();
+    uint32_t ticks_elapsed = (now - wheel.last_us) / TIMER_WHEEL_TICK_US;
+    wheel.last_us += ticks_elapsed * TIMER_WHEEL_TICK_US;
+
+    while (ticks_elapsed > 0) {
+        ++wheel.current_tick;
+        --ticks_elapsed;
+
+        /* Unlink all expired timers first, callbacks are free to restart them */
+        struct timer_event_t *expired = NULL;
+        struct timer_event_t **node = &wheel.slots[wheel.current_tick % TIMER_WHEEL_SLOTS];
+
+        while (*node != NULL) {
+            struct timer_event_t *event = *node;
+            if (event->expiry_tick == wheel.current_tick) {
+                *node = event->next;
+                event->next = expired;
+                expired = event;
+            }
+            else {
+                node = &event->next; // Due in one of the next wheel turns
+            }
+        }
+
+        while (expired != NULL) {
+            struct timer_event_t *event = expired;
+            expired = event->next;
+
+            event->next = NULL;
+            event->active = false;
+
+            if (event->period_ticks > 0) {
+                event->expiry_tick += event->period_ticks;
+                timer_wheel_insert(event);
+            }
+
+            event->callback(event->arg);
+        }
+    }
+
+    wheel.alarm_set = false;
+    timer_wheel_set_next_alarm();
+}
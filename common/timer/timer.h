@@ -3,6 +3,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* Callback timers are kept in a hashed timer wheel, which makes starting, stopping and expiring
+ * them O(1) on average. The wheel is advanced by timer_wheel_task(), callbacks are called from it.
+ * The system alarm is set for the closest expiry, so the task gets its timer event on the wheel tick
+ * instead of the next SysTick. */
+#define TIMER_WHEEL_TICK_US 250
+#define TIMER_WHEEL_SLOTS 32 // Has to be a power of 2
+
+typedef void (*timer_callback_t)(void *arg);
+
 struct timer_t
 {
     uint32_t start_time;
@@ -14,3 +23,20 @@ int timer_init(struct timer_t *timer, uint32_t timeout);
 
 bool timer_has_elapsed(struct timer_t *timer);
 int timer_reset(struct timer_t *timer);
+
+struct timer_event_t
+{
+    struct timer_event_t *next;
+    uint32_t expiry_tick;
+    uint32_t period_ticks;
+    timer_callback_t callback;
+    void *arg;
+    bool active;
+};
+
+/* Period set to 0 makes the timer one-shot */
+int timer_event_start(struct timer_event_t *event, uint32_t timeout_us, uint32_t period_us, timer_callback_t callback, void *arg);
+int timer_event_stop(struct timer_event_t *event);
+bool timer_event_is_active(const struct timer_event_t *event);
+
+void timer_wheel_task(void);
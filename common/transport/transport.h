@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Byte stream the packets travel over, comm doesn't care what's underneath */
+struct transport_stats_t
+{
+    uint32_t rx_bytes;
+    uint32_t overruns;
+    uint32_t ring_full_drops;
+};
+
+struct transport_t
+{
+    uint32_t bit_rate;      // Raw line rate, reported to the host
+
+    void (*init)(void);
+    void (*deinit)(void);
+
+    /* Blocks until the data is handed over to the hardware */
+    void (*write)(const void *data, size_t size);
+
+    /* Takes up to size bytes of what has been received, never blocks */
+    size_t (*read)(void *data, size_t size);
+    bool (*data_available)(void);
+
+    /* Blocks until everything written has left the device */
+    void (*flush)(void);
+
+    void (*get_stats)(struct transport_stats_t *stats);
+    void (*reset_stats)(void);
+};
@@ -0,0 +1,88 @@
+#include "transport_sim.h"
+#include <ring_buffer.h>
+#include <scheduler.h>
+#include <string.h>
+
+struct transport_sim_ctx_t
+{
+    struct ring_buffer_t rx_buf;
+    uint8_t rx_buf_data[TRANSPORT_SIM_BUFFER_SIZE];
+    struct ring_buffer_t tx_buf;
+    uint8_t tx_buf_data[TRANSPORT_SIM_BUFFER_SIZE];
+    struct transport_stats_t stats;
+};
+
+static struct transport_sim_ctx_t ctx;
+
+static void transport_sim_init(void)
+{
+    ring_buffer_init(&ctx.rx_buf, ctx.rx_buf_data, sizeof(ctx.rx_buf_data));
+    ring_buffer_init(&ctx.tx_buf, ctx.tx_buf_data, sizeof(ctx.tx_buf_data));
+    memset(&ctx.stats, 0, sizeof(ctx.stats));
+}
+
+static void transport_sim_deinit(void)
+{
+}
+
+static void transport_sim_write(const void *data, size_t size)
+{
+    /* Whatever the test doesn't collect in time is lost, like on a real line */
+    (void)ring_buffer_write(&ctx.tx_buf, data, size);
+}
+
+static size_t transport_sim_read(void *data, size_t size)
+{
+    return ring_buffer_read(&ctx.rx_buf, data, size);
+}
+
+static bool transport_sim_data_available(void)
+{
+    return !ring_buffer_is_empty(&ctx.rx_buf);
+}
+
+static void transport_sim_flush(void)
+{
+}
+
+static void transport_sim_get_stats(struct transport_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    *stats = ctx.stats;
+}
+
+static void transport_sim_reset_stats(void)
+{
+    memset(&ctx.stats, 0, sizeof(ctx.stats));
+}
+
+const struct transport_t transport_sim = {
+    .bit_rate = TRANSPORT_SIM_BIT_RATE,
+    .init = transport_sim_init,
+    .deinit = transport_sim_deinit,
+    .write = transport_sim_write,
+    .read = transport_sim_read,
+    .data_available = transport_sim_data_available,
+    .flush = transport_sim_flush,
+    .get_stats = transport_sim_get_stats,
+    .reset_stats = transport_sim_reset_stats,
+};
+
+size_t transport_sim_push_rx(const void *data, size_t size)
+{
+    const size_t pushed = ring_buffer_write(&ctx.rx_buf, data, size);
+
+    ctx.stats.rx_bytes += size;
+    ctx.stats.ring_full_drops += size - pushed;
+    scheduler_post_event(SCHEDULER_EVENT_RX);
+
+    return pushed;
+}
+
+size_t transport_sim_pop_tx(void *data, size_t size)
+{
+    return ring_buffer_read(&ctx.tx_buf, data, size);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "transport.h"
+
+/* In-process backend for host builds, the test plays the other side of the link */
+#define TRANSPORT_SIM_BUFFER_SIZE 1024
+
+/* Reported like a UART would, the host scales its statistics by it */
+#define TRANSPORT_SIM_BIT_RATE 115200
+
+extern const struct transport_t transport_sim;
+
+/* Bytes sent by the simulated host, returns how many fit into the Rx buffer */
+size_t transport_sim_push_rx(const void *data, size_t size);
+
+/* Bytes sent by the device */
+size_t transport_sim_pop_tx(void *data, size_t size);
@@ -1,5 +1,8 @@
 #include "uart.h"
 #include <ring_buffer.h>
+#include <scheduler.h>
+#include <utils.h>
+#include <string.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/usart.h>
@@ -17,23 +20,72 @@
 #define UART_BAUD_RATE 115200
 #define UART_DATA_BITS 8
 
-#define UART_RX_BUFFER_SIZE 64
+#if UART_HW_FLOW_CONTROL
+#define UART_CTS_PIN GPIO_USART1_CTS
+#define UART_RTS_PIN GPIO_USART1_RTS
+
+/* RTS is driven from the Rx buffer fill level, hardware RTS only accounts for the data register.
+ * The headroom covers the bytes adapters still send after RTS goes high. */
+#define UART_RTS_HIGH_WATERMARK (UART_RX_BUFFER_SIZE - 16)
+#define UART_RTS_LOW_WATERMARK (UART_RX_BUFFER_SIZE / 4)
+#endif
 
 struct uart_ctx_t
 {
     struct ring_buffer_t rx_buf;
     uint8_t rx_buf_data[UART_RX_BUFFER_SIZE];
+    struct ring_buffer_t *tx_buf;
+    struct transport_stats_t stats;
 };
 
 static struct uart_ctx_t ctx;
 
-void usart1_isr(void)
+/* Reception runs from RAM and uses registers directly, libopencm3 code stays in flash */
+#if UART_HW_FLOW_CONTROL
+static inline __attribute__((always_inline)) void uart_rts_update(void)
 {
-    const bool is_overrun = usart_get_flag(UART_PERIPH, USART_FLAG_ORE);
-    const bool data_received = usart_get_flag(UART_PERIPH, USART_FLAG_RXNE);
+    const size_t count = ring_buffer_get_count(&ctx.rx_buf);
+
+    /* RTS is active low */
+    if (count >= UART_RTS_HIGH_WATERMARK) {
+        GPIO_BSRR(UART_PORT) = UART_RTS_PIN;
+    } else if (count <= UART_RTS_LOW_WATERMARK) {
+        GPIO_BRR(UART_PORT) = UART_RTS_PIN;
+    }
+}
+#else
+static inline void uart_rts_update(void) {}
+#endif
+
+RAMFUNC_HANDLER void usart1_isr(void)
+{
+    const uint32_t status = USART_SR(UART_PERIPH);
+    const bool is_overrun = (status & USART_SR_ORE) != 0;
+    const bool data_received = (status & USART_SR_RXNE) != 0;
+
+    if (is_overrun) {
+        ++ctx.stats.overruns;
+    }
 
     if (data_received || is_overrun) {
-        (void)ring_buffer_write_byte(&ctx.rx_buf, usart_recv(UART_PERIPH)); // Just ignore any errors as there's no way to recover
+        /* There's no way to recover from errors, just count them */
+        if (ring_buffer_write_byte(&ctx.rx_buf, USART_DR(UART_PERIPH) & 0xFF) != 0) {
+            ++ctx.stats.ring_full_drops;
+        }
+        ++ctx.stats.rx_bytes;
+        uart_rts_update();
+        scheduler_post_event(SCHEDULER_EVENT_RX);
+    }
+
+    /* Tx interrupt is enabled only while there's something to send in background */
+    if (((USART_CR1(UART_PERIPH) & USART_CR1_TXEIE) != 0) && ((status & USART_SR_TXE) != 0)) {
+        uint8_t data;
+
+        if (ring_buffer_read_byte(ctx.tx_buf, &data) == 0) {
+            USART_DR(UART_PERIPH) = data;
+        } else {
+            USART_CR1(UART_PERIPH) &= ~USART_CR1_TXEIE;
+        }
     }
 }
 
@@ -46,12 +98,22 @@ void uart_init(void)
     rcc_periph_clock_enable(UART_PORT_RCC);
     gpio_set_mode(UART_PORT, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, UART_TX_PIN);
     gpio_set_mode(UART_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, UART_RX_PIN);
+#if UART_HW_FLOW_CONTROL
+    gpio_clear(UART_PORT, UART_RTS_PIN);
+    gpio_set_mode(UART_PORT, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, UART_RTS_PIN);
+    gpio_set_mode(UART_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, UART_CTS_PIN);
+#endif
 
     /* Enable clock for USART1 */
     rcc_periph_clock_enable(UART_PERIPH_RCC);
 
     /* Configure transmission parameters */
+#if UART_HW_FLOW_CONTROL
+    /* Only CTS is handled by hardware, RTS is a GPIO */
+    usart_set_flow_control(UART_PERIPH, USART_FLOWCONTROL_CTS);
+#else
     usart_set_flow_control(UART_PERIPH, USART_FLOWCONTROL_NONE);
+#endif
     usart_set_databits(UART_PERIPH, UART_DATA_BITS);
     usart_set_stopbits(UART_PERIPH, USART_STOPBITS_1);
     usart_set_parity(UART_PERIPH, USART_PARITY_NONE);
@@ -73,8 +135,9 @@ void uart_deinit(void)
     /* Disable USART */
     usart_disable(UART_PERIPH);
 
-    /* Disable Rx interupt */
+    /* Disable Rx and Tx interrupts */
     usart_disable_rx_interrupt(UART_PERIPH);
+    usart_disable_tx_interrupt(UART_PERIPH);
     nvic_disable_irq(UART_PERIPH_IRQ);
 
     /* Disable UART clock */
@@ -83,6 +146,10 @@ void uart_deinit(void)
     /* Set UART pins to inputs and disable GPIO clock */
     gpio_set_mode(UART_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, UART_TX_PIN);
     gpio_set_mode(UART_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, UART_RX_PIN);
+#if UART_HW_FLOW_CONTROL
+    gpio_set_mode(UART_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, UART_RTS_PIN);
+    gpio_set_mode(UART_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, UART_CTS_PIN);
+#endif
     rcc_periph_clock_disable(UART_PORT_RCC);
 }
 
@@ -104,9 +171,22 @@ void uart_write_byte(uint8_t data)
     usart_send_blocking(USART1, data);
 }
 
+void uart_write_async(struct ring_buffer_t *buf)
+{
+    if (buf == NULL) {
+        return;
+    }
+
+    ctx.tx_buf = buf;
+    usart_enable_tx_interrupt(UART_PERIPH);
+}
+
 size_t uart_read(void *data, size_t size)
 {
-    return ring_buffer_read(&ctx.rx_buf, data, size);
+    const size_t bytes_read = ring_buffer_read(&ctx.rx_buf, data, size);
+    uart_rts_update();
+
+    return bytes_read;
 }
 
 uint8_t uart_read_byte(void)
@@ -114,6 +194,7 @@ uint8_t uart_read_byte(void)
     uint8_t data;
 
     ring_buffer_read(&ctx.rx_buf, &data, sizeof(data));
+    uart_rts_update();
 
     return data;
 }
@@ -122,3 +203,38 @@ bool uart_data_available(void)
 {
     return !ring_buffer_is_empty(&ctx.rx_buf);
 }
+
+void uart_flush(void)
+{
+    while ((USART_CR1(UART_PERIPH) & USART_CR1_TXEIE) != 0) {
+    }
+
+    while ((USART_SR(UART_PERIPH) & USART_SR_TC) == 0) {
+    }
+}
+
+void uart_get_stats(struct transport_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    *stats = ctx.stats;
+}
+
+void uart_reset_stats(void)
+{
+    memset(&ctx.stats, 0, sizeof(ctx.stats));
+}
+
+const struct transport_t uart_transport = {
+    .bit_rate = UART_BAUD_RATE,
+    .init = uart_init,
+    .deinit = uart_deinit,
+    .write = uart_write,
+    .read = uart_read,
+    .data_available = uart_data_available,
+    .flush = uart_flush,
+    .get_stats = uart_get_stats,
+    .reset_stats = uart_reset_stats,
+};
@@ -3,6 +3,13 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <transport.h>
+#include <ring_buffer.h>
+
+/* Reception runs from RAM, the buffer has to hold what arrives during a page erase */
+#define UART_RX_BUFFER_SIZE 256
+
+extern const struct transport_t uart_transport;
 
 void uart_init(void);
 void uart_deinit(void);
@@ -10,7 +17,17 @@ void uart_deinit(void);
 void uart_write(const void *data, size_t size);
 void uart_write_byte(uint8_t data);
 
+/* Sends the buffer's contents from Tx interrupt, more data can be added to it meanwhile.
+ * Blocking writes must not be used until it's drained. */
+void uart_write_async(struct ring_buffer_t *buf);
+
 size_t uart_read(void *data, size_t size);
 uint8_t uart_read_byte(void);
 
 bool uart_data_available(void);
+
+/* Waits for the last byte to be shifted out */
+void uart_flush(void);
+
+void uart_get_stats(struct transport_stats_t *stats);
+void uart_reset_stats(void);
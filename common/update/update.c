@@ -3,24 +3,69 @@
 #include <comm.h>
 #include <timer.h>
 #include <flash.h>
+#include <boot.h>
 #include <system.h>
+#include <scheduler.h>
 #include <keys.h>
 #include <firmware_info.h>
+#include <utils.h>
 #include <aes.h>
+#include <rto.h>
 #include <string.h>
+#include <errno.h>
+#if UPDATE_STAGING
+#include <staging.h>
+#endif
 
 #define UPDATE_SYNC_SEQUENCE 0x33303146
 #define UPDATE_SYNC_SEQUENCE_SIZE 4
 
 #define UPDATE_TIMEOUT_MS 2000
 
+/* Lost data is requested again after the estimated round trip timeout, backed off on each expiry.
+ * Session fails once the host hasn't answered that many times in a row. */
+#define UPDATE_RTO_INITIAL_MS 1000
+#define UPDATE_RTO_MIN_MS 50
+#define UPDATE_RTO_MAX_RETRIES 6
+
+/* Host that asked the firmware for update mode is already sending sync, it just needs to notice the reset */
+#define UPDATE_REQUESTED_LISTEN_MS 10000
+
+/* How long the session is kept open after the update for host's requests */
+#define UPDATE_LINGER_MS 250
+
+/* Paged responses carry page number before the data */
+#define UPDATE_PAGE_DATA_SIZE (COMM_CTRL_PACKET_MAX_DATA_SIZE - 1)
+
+/* Single round trip handshake, the whole request is sent as pages back to back */
+#define UPDATE_HANDSHAKE_VERSION 2
+#define UPDATE_SESSION_FLAG_FORCE (1 << 0)      // Update even if the same image is installed
+#define UPDATE_ENCRYPTION_AES128_CBC (1 << 0)
+
+/* Receive -> decrypt -> program pipeline depth, has to be a power of 2 */
+#define UPDATE_PIPELINE_DEPTH 2
+
+/* Packets the host may send without waiting for acknowledge. Without flow control all
+ * of them have to fit into comm buffer, with it RTS or USB NAK holds the excess back. */
+#if UART_HW_FLOW_CONTROL || TRANSPORT_USB
+#define UPDATE_MAX_CREDITS 32
+#else
+#define UPDATE_MAX_CREDITS COMM_PACKET_BUFFER_COUNT
+
+/* Nothing is read from UART buffer during page erase, it has to hold all packets in flight */
+_Static_assert(UPDATE_MAX_CREDITS * COMM_FRAME_MAX_SIZE < UART_RX_BUFFER_SIZE, "UART buffer can't hold all credits");
+#endif
+
 enum update_state_t
 {
     UPDATE_WAIT_FOR_SYNC,
     UPDATE_WAIT_FOR_REQUEST,
+#if UPDATE_LEGACY_HANDSHAKE
     UPDATE_GET_FW_SIZE,
     UPDATE_GET_AES_IV,
+#endif
     UPDATE_GET_FW,
+    UPDATE_LINGER,
     UPDATE_DONE
 };
 
@@ -30,22 +75,111 @@ union update_sync_seq_t
     uint8_t raw[UPDATE_SYNC_SEQUENCE_SIZE];
 };
 
+/* Per session link statistics, sent to the host on request */
+struct update_stats_t
+{
+    uint32_t rx_bytes;
+    uint32_t rx_overruns;
+    uint32_t rx_ring_full_drops;
+    uint32_t crc_failures;
+    uint32_t retx_sent;
+    uint32_t retx_received;
+    uint32_t timeouts;
+    uint32_t bytes_programmed;
+    uint32_t framing_errors;
+    uint32_t fec_corrections;
+} __attribute__((packed));
+
+/* Installed image description, sent to the host on request */
+struct update_info_t
+{
+    uint8_t aes_iv[FW_AES128_IV_SIZE];
+    uint32_t version;
+    uint32_t device_id;
+    uint32_t length;
+    uint8_t valid;
+    uint8_t digest[BOOT_IMAGE_DIGEST_SIZE];
+    struct boot_verify_times_t verify_times;
+} __attribute__((packed));
+
+/* Everything the host needs to agree on before the transfer, IV is the start of the image */
+struct update_session_request_t
+{
+    uint8_t version;
+    uint8_t device_id;
+    uint8_t credits;        // Packets the host wants to keep in flight
+    uint8_t options;        // Link options, same as in update request
+    uint8_t flags;
+    uint32_t file_size;     // Signed file size, IV included
+    uint8_t aes_iv[FW_AES128_IV_SIZE];
+} __attribute__((packed));
+
+#define UPDATE_SESSION_REQUEST_PAGES \
+    ((sizeof(struct update_session_request_t) + UPDATE_PAGE_DATA_SIZE - 1) / UPDATE_PAGE_DATA_SIZE)
+
+/* Answer to session request, sent in a single acknowledge */
+struct update_session_caps_t
+{
+    uint8_t version;
+    uint8_t credits;
+    uint8_t options;
+    uint8_t max_frame_size;
+    uint32_t bit_rate;
+    uint8_t compression;    // No compression supported yet
+    uint8_t encryption;
+    uint32_t free_flash;    // Firmware slot size
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct update_session_caps_t) <= COMM_CTRL_PACKET_MAX_DATA_SIZE, "Capabilities don't fit into acknowledge");
+
+struct update_pipeline_t
+{
+    struct comm_packet_t slots[UPDATE_PIPELINE_DEPTH];
+    uint8_t received;
+    uint8_t decrypted;
+    uint8_t programmed;
+};
+
+/* Each acknowledge gives the host one credit back */
+struct update_credits_t
+{
+    uint8_t granted;
+    uint8_t options;    // Link options agreed with the host
+};
+
 struct update_ctx_t
 {
     enum update_state_t state;
-    struct timer_t timer;
+    enum update_mode_t mode;
+    struct timer_event_t timeout;
     struct comm_packet_t packet;
     union update_sync_seq_t sync_seq;
     uint32_t firmware_size;
     uint32_t bytes_received;
+    uint32_t bytes_programmed;
+    struct update_pipeline_t pipeline;
+    bool store_busy;        // Next packet waits for the storage
+    struct flash_erase_plan_t erase_plan;
+    struct update_credits_t credits;
+    bool rewind_requested;
+    struct update_info_t info;
+    bool info_ready;
+    struct update_session_request_t session_request;
+    uint8_t session_pages;  // Bit per received request page
+    uint32_t timeouts;
+    struct rto_t rto;
+    uint32_t rtt_start;     // When the answer being timed was sent
+    bool rtt_pending;
+    uint8_t retries;
     struct AES_ctx aes;
 };
 
 static struct update_ctx_t ctx;
 
-static bool update_is_update_request_packet(const struct comm_packet_t *packet)
+#if UPDATE_LEGACY_HANDSHAKE
+static bool update_parse_fw_size_packet(const struct comm_packet_t *packet, uint32_t *fw_size)
 {
-    if (comm_get_packet_length(packet) != COMM_REQUEST_PACKET_SIZE) {
+    if (comm_get_packet_length(packet) != COMM_FW_SIZE_PACKET_SIZE) {
         return false;
     }
 
@@ -53,16 +187,22 @@ static bool update_is_update_request_packet(const struct comm_packet_t *packet)
         return false;
     }
 
-    if (packet->payload[0] != COMM_PACKET_OP_UPDATE_REQUEST) {
+    if (packet->payload[0] != COMM_PACKET_OP_FW_SIZE_REQUEST) {
+        return false;
+    }
+
+    *fw_size = *(uint32_t *)&packet->payload[1]; // Firmware size is coded on 4 bytes
+    if (*fw_size > FLASH_MAIN_APP_MAX_SIZE) {
         return false;
     }
 
     return true;
 }
+#endif
 
-static bool update_parse_fw_size_packet(const struct comm_packet_t *packet, uint32_t *fw_size)
+static bool update_is_ctrl_packet(const struct comm_packet_t *packet, enum comm_packet_op_t op, uint8_t length)
 {
-    if (comm_get_packet_length(packet) != COMM_FW_SIZE_PACKET_SIZE) {
+    if (comm_get_packet_length(packet) != length) {
         return false;
     }
 
@@ -70,87 +210,563 @@ static bool update_parse_fw_size_packet(const struct comm_packet_t *packet, uint
         return false;
     }
 
-    if (packet->payload[0] != COMM_PACKET_OP_FW_SIZE_REQUEST) {
+    if (packet->payload[0] != op) {
         return false;
     }
 
-    *fw_size = *(uint32_t *)&packet->payload[1]; // Firmware size is coded on 4 bytes
-    if (*fw_size > FLASH_MAIN_APP_MAX_SIZE) {
+    return true;
+}
+
+static uint8_t update_grant_credits(uint8_t requested)
+{
+    const uint8_t granted = MIN(requested, UPDATE_MAX_CREDITS);
+
+    return (granted == 0) ? 1 : granted;
+}
+
+#if UPDATE_LEGACY_HANDSHAKE
+static bool update_parse_update_request_packet(const struct comm_packet_t *packet, struct update_credits_t *credits)
+{
+    credits->granted = 1;
+    credits->options = 0;
+
+    /* Hosts that don't ask for credits wait for acknowledge after each packet */
+    if (update_is_ctrl_packet(packet, COMM_PACKET_OP_UPDATE_REQUEST, COMM_REQUEST_PACKET_SIZE)) {
+        return true;
+    }
+
+    if (!update_is_ctrl_packet(packet, COMM_PACKET_OP_UPDATE_REQUEST, COMM_CREDITS_PACKET_SIZE) &&
+        !update_is_ctrl_packet(packet, COMM_PACKET_OP_UPDATE_REQUEST, COMM_OPTIONS_PACKET_SIZE)) {
         return false;
     }
 
+    credits->granted = update_grant_credits(packet->payload[1]);
+
+    /* Unknown options are refused silently, the host sees what was agreed in the acknowledge */
+    if (comm_get_packet_length(packet) == COMM_OPTIONS_PACKET_SIZE) {
+        credits->options = packet->payload[2] & COMM_OPTION_FEC;
+    }
     return true;
 }
+#endif
+
+static void update_send_page(enum comm_packet_op_t op, uint8_t page, const void *data, size_t size)
+{
+    uint8_t payload[COMM_CTRL_PACKET_MAX_DATA_SIZE];
+    const size_t offset = page * UPDATE_PAGE_DATA_SIZE;
+    const size_t page_size = (offset < size) ? MIN(size - offset, UPDATE_PAGE_DATA_SIZE) : 0;
+
+    /* Page past the end of data is sent back empty */
+    payload[0] = page;
+    memcpy(&payload[1], (const uint8_t *)data + offset, page_size);
+
+    comm_create_ctrl_packet(&ctx.packet, op, payload, page_size + 1);
+    comm_write(&ctx.packet);
+}
+
+static void update_send_echo(const struct comm_packet_t *packet)
+{
+    uint8_t payload[COMM_CTRL_PACKET_MAX_DATA_SIZE];
+    const uint32_t timestamp = system_get_us();
+    const uint8_t packet_length = comm_get_packet_length(packet);
+    const size_t request_size = (packet_length > 1) ? (size_t)(packet_length - 1) : 0;
+    const size_t data_size = MIN(request_size, sizeof(payload) - sizeof(timestamp));
+
+    /* Timestamp goes first, followed by as much of the request data as fits */
+    memcpy(&payload[0], &timestamp, sizeof(timestamp));
+    memcpy(&payload[sizeof(timestamp)], &packet->payload[1], data_size);
+
+    comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_ECHO, payload, sizeof(timestamp) + data_size);
+    comm_write(&ctx.packet);
+}
+
+static void update_collect_stats(struct update_stats_t *stats)
+{
+    struct transport_stats_t transport_stats;
+    struct comm_stats_t comm_stats;
+
+    comm_get_transport()->get_stats(&transport_stats);
+    comm_get_stats(&comm_stats);
+
+    stats->rx_bytes = transport_stats.rx_bytes;
+    stats->rx_overruns = transport_stats.overruns;
+    stats->rx_ring_full_drops = transport_stats.ring_full_drops;
+    stats->crc_failures = comm_stats.crc_failures;
+    stats->retx_sent = comm_stats.retx_sent;
+    stats->retx_received = comm_stats.retx_received;
+    stats->timeouts = ctx.timeouts;
+    stats->bytes_programmed = ctx.bytes_programmed;
+    stats->framing_errors = comm_stats.framing_errors;
+    stats->fec_corrections = comm_stats.fec_corrections;
+}
+
+static void update_reset_stats(void)
+{
+    comm_get_transport()->reset_stats();
+    comm_reset_stats();
+    ctx.timeouts = 0;
+}
+
+static void update_collect_info(void)
+{
+    struct fw_header_t header;
+    struct boot_verify_times_t verify_times;
+
+    /* Signature verification takes a while, do it once per session */
+    if (ctx.info_ready) {
+        return;
+    }
+
+    flash_read(FLASH_MAIN_APP_START, &header, sizeof(header));
+    memcpy(ctx.info.aes_iv, header.aes_iv, sizeof(ctx.info.aes_iv));
+    ctx.info.version = header.version;
+    ctx.info.device_id = header.device_id;
+    ctx.info.length = header.length;
+    ctx.info.valid = boot_verify_image_digest(ctx.info.digest, &verify_times);
+    ctx.info.verify_times = verify_times;
+
+    ctx.info_ready = true;
+}
+
+/* Handles requests that can be served outside of the transfer itself */
+static bool update_handle_service_request(const struct comm_packet_t *packet)
+{
+    if (update_is_ctrl_packet(packet, COMM_PACKET_OP_STATS_REQUEST, COMM_PAGE_REQUEST_PACKET_SIZE)) {
+        struct update_stats_t stats;
+        update_collect_stats(&stats);
+        update_send_page(COMM_PACKET_OP_STATS_REQUEST, packet->payload[1], &stats, sizeof(stats));
+        return true;
+    }
+
+    /* Echo carries any amount of data */
+    if ((comm_get_packet_type(packet) == COMM_PACKET_CTRL) && (packet->payload[0] == COMM_PACKET_OP_ECHO)) {
+        update_send_echo(packet);
+        return true;
+    }
+
+    if (update_is_ctrl_packet(packet, COMM_PACKET_OP_MEMORY_REQUEST, COMM_PAGE_REQUEST_PACKET_SIZE)) {
+        struct system_memory_t memory;
+        system_get_memory(&memory);
+        update_send_page(COMM_PACKET_OP_MEMORY_REQUEST, packet->payload[1], &memory, sizeof(memory));
+        return true;
+    }
+
+    if (update_is_ctrl_packet(packet, COMM_PACKET_OP_INFO_REQUEST, COMM_PAGE_REQUEST_PACKET_SIZE)) {
+        update_collect_info();
+        update_send_page(COMM_PACKET_OP_INFO_REQUEST, packet->payload[1], &ctx.info, sizeof(ctx.info));
+        return true;
+    }
+
+    return false;
+}
 
-static void update_handle_failure(void)
+static void update_handle_failure(enum comm_nack_reason_t reason)
 {
-    comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_NACK, NULL, 0); // TODO add failure reason in payload
+    const uint8_t payload = reason;
+
+    /* Lock flash back, it's harmless if programming has not been started yet */
+    flash_batch_end();
+
+    comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_NACK, &payload, sizeof(payload));
     comm_write(&ctx.packet);
 
     ctx.state = UPDATE_DONE;
 }
 
+static void update_rtt_start(void)
+{
+    ctx.rtt_start = system_get_us();
+    ctx.rtt_pending = true;
+}
+
+static void update_rtt_stop(void)
+{
+    if (ctx.rtt_pending) {
+        rto_sample(&ctx.rto, system_get_us() - ctx.rtt_start);
+        ctx.rtt_pending = false;
+    }
+}
+
+static bool update_pipeline_is_full(void)
+{
+    return ((uint8_t)(ctx.pipeline.received - ctx.pipeline.programmed) >= UPDATE_PIPELINE_DEPTH);
+}
+
+static void update_send_rewind(void)
+{
+    /* Round trip of a repeated rewind is ambiguous, only the first one is timed */
+    if (ctx.rewind_requested) {
+        ctx.rtt_pending = false;
+    } else {
+        update_rtt_start();
+    }
+
+    /* Host resumes from the offset with all the credits, data sent before it gets dropped */
+    comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_REWIND, &ctx.bytes_received, sizeof(ctx.bytes_received));
+    comm_write(&ctx.packet);
+
+    /* Further halt means the rewind itself got corrupted, it is requested again then */
+    comm_resume_rx();
+    ctx.rewind_requested = true;
+}
+
+static void update_restart_timeout(void);
+
+static void update_handle_retx_timeout(void)
+{
+    /* Nothing is missing, packets are waiting in the buffer or the host for free pipeline slots */
+    if ((ctx.bytes_received >= ctx.firmware_size) || update_pipeline_is_full() ||
+        comm_packets_available() || comm_data_available()) {
+        update_restart_timeout();
+        return;
+    }
+
+    ++ctx.timeouts;
+    if (++ctx.retries > UPDATE_RTO_MAX_RETRIES) {
+        update_handle_failure(COMM_NACK_TIMEOUT);
+        return;
+    }
+
+    /* Data or acknowledge got lost, the host resumes from the last received offset */
+    rto_backoff(&ctx.rto);
+    update_send_rewind();
+    update_restart_timeout();
+}
+
+static void update_handle_timeout(void *arg)
+{
+    (void)arg;
+
+    if (ctx.state == UPDATE_GET_FW) {
+        update_handle_retx_timeout();
+        return;
+    }
+
+    /* No host during the listen window or after the update is not a failure, just boot */
+    if ((ctx.state == UPDATE_WAIT_FOR_SYNC) || (ctx.state == UPDATE_LINGER)) {
+        ctx.state = UPDATE_DONE;
+        return;
+    }
+
+    ++ctx.timeouts;
+    update_handle_failure(COMM_NACK_TIMEOUT);
+}
+
+static uint32_t update_get_listen_ms(void)
+{
+    switch (ctx.mode) {
+        case UPDATE_MODE_LISTEN:
+            return UPDATE_LISTEN_MS;
+
+        case UPDATE_MODE_REQUESTED:
+            return UPDATE_REQUESTED_LISTEN_MS;
+
+        default:
+            return 0;
+    }
+}
+
+static void update_restart_timeout(void)
+{
+    uint32_t timeout_us = UPDATE_TIMEOUT_MS * 1000;
+
+    if (ctx.state == UPDATE_GET_FW) {
+        timeout_us = rto_get_timeout(&ctx.rto);
+    } else if (ctx.state == UPDATE_LINGER) {
+        timeout_us = UPDATE_LINGER_MS * 1000;
+    } else if (ctx.state == UPDATE_WAIT_FOR_SYNC) {
+        /* Recovery waits for the host for as long as it takes */
+        if (ctx.mode == UPDATE_MODE_RECOVERY) {
+            return;
+        }
+        timeout_us = update_get_listen_ms() * 1000;
+    }
+
+    timer_event_start(&ctx.timeout, timeout_us, 0, update_handle_timeout, NULL);
+}
+
 static void update_wait_for_sync(void)
 {
-    if (uart_data_available()) {
+    while (comm_data_available() && (ctx.state == UPDATE_WAIT_FOR_SYNC)) {
         memmove(&ctx.sync_seq.raw[0], &ctx.sync_seq.raw[1], UPDATE_SYNC_SEQUENCE_SIZE - 1);
-        ctx.sync_seq.raw[UPDATE_SYNC_SEQUENCE_SIZE - 1] = uart_read_byte();
+        (void)comm_read_raw(&ctx.sync_seq.raw[UPDATE_SYNC_SEQUENCE_SIZE - 1], 1);
 
         if (ctx.sync_seq.value == UPDATE_SYNC_SEQUENCE) {
             const uint8_t device_id = FW_DEVICE_ID;
             comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_SYNCED, &device_id, sizeof(device_id));
             comm_write(&ctx.packet);
 
-            timer_reset(&ctx.timer);
+            update_reset_stats();
+            update_restart_timeout();
             ctx.state = UPDATE_WAIT_FOR_REQUEST;
         }
     }
+}
 
-    if (timer_has_elapsed(&ctx.timer)) {
-        ctx.state = UPDATE_DONE;
+/* Image goes either straight into the firmware slot, or into the staging area. The staged image
+ * is installed by the bootloader once the session is over, the installed one stays intact until then. */
+#if UPDATE_STAGING
+static int update_store_begin(void)
+{
+    return staging_begin(ctx.firmware_size);
+}
+
+static int update_store_write(const void *data, uint8_t size)
+{
+    return staging_write(data, size);
+}
+
+static int update_store_ahead(void)
+{
+    /* Nothing to erase, the time goes to starting the next program step of the buffered data */
+    staging_poll();
+    return 0;
+}
+
+static bool update_store_is_due(void)
+{
+    /* Storage is polled on each timer tick, the core sleeps while it programs or erases */
+    return false;
+}
+
+static int update_store_finish(void)
+{
+    return staging_commit();
+}
+#else
+static int update_store_begin(void)
+{
+    /* Keep flash unlocked for the whole transfer, installed image is gone from now on */
+    flash_batch_begin();
+    ctx.info_ready = false;
+
+    /* Erase flash as late as possible, this way we can rollback from any previous step.
+     * Pages are erased one by one ahead of the data. */
+    flash_erase_plan_init(&ctx.erase_plan, FLASH_MAIN_APP_START, ctx.firmware_size);
+    return 0;
+}
+
+static int update_store_write(const void *data, uint8_t size)
+{
+    const size_t write_addr = FLASH_MAIN_APP_START + ctx.bytes_programmed;
+
+    /* Normally the page has been erased ahead already, this only catches up */
+    if (flash_erase_plan_prepare(&ctx.erase_plan, write_addr + size) != 0) {
+        return -EIO;
+    }
+
+    return flash_batch_write(write_addr, data, size);
+}
+
+static int update_store_ahead(void)
+{
+    return flash_erase_plan_ahead(&ctx.erase_plan, FLASH_MAIN_APP_START + ctx.bytes_received);
+}
+
+static bool update_store_is_due(void)
+{
+    return flash_erase_plan_is_due(&ctx.erase_plan, FLASH_MAIN_APP_START + ctx.bytes_received);
+}
+
+static int update_store_finish(void)
+{
+    flash_batch_end();
+    return 0;
+}
+#endif
+
+static int update_start_transfer(const uint8_t *iv, uint8_t size)
+{
+    if (update_store_begin() != 0) {
+        return -EIO;
+    }
+
+    /* Image starts with an IV for AES */
+    AES_init_ctx_iv(&ctx.aes, aes_key, iv);
+
+    /* It's not really needed, but store it anyway */
+    if (update_store_write(iv, size) != 0) {
+        return -EIO;
+    }
+
+    ctx.bytes_received += size;
+    ctx.bytes_programmed += size;
+
+    return 0;
+}
+
+static bool update_image_is_installed(const struct update_session_request_t *request)
+{
+    struct fw_header_t header;
+
+    /* IV is random for each signing, together with the size it identifies the signed file */
+    flash_read(FLASH_MAIN_APP_START, &header, sizeof(header));
+    if (memcmp(header.aes_iv, request->aes_iv, FW_AES128_IV_SIZE) != 0) {
+        return false;
+    }
+
+    /* Signed file holds IV, encrypted rest of the header and code, PKCS7 always adds padding */
+    const uint32_t encrypted_size = ((sizeof(header) - FW_AES128_IV_SIZE + header.length) / AES_BLOCKLEN + 1) * AES_BLOCKLEN;
+    if (request->file_size != (FW_AES128_IV_SIZE + encrypted_size)) {
+        return false;
+    }
+
+    /* Signature is checked only when the host is about to send the same image */
+    update_collect_info();
+
+    return ctx.info.valid;
+}
+
+static void update_send_session_ack(void)
+{
+    const struct update_session_caps_t caps = {
+        .version = UPDATE_HANDSHAKE_VERSION,
+        .credits = ctx.credits.granted,
+        .options = ctx.credits.options,
+        .max_frame_size = COMM_FRAME_MAX_SIZE,
+        .bit_rate = comm_get_transport()->bit_rate,
+        .compression = 0,
+        .encryption = UPDATE_ENCRYPTION_AES128_CBC,
+        .free_flash = FLASH_MAIN_APP_MAX_SIZE,
+    };
+
+    comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_ACK, &caps, sizeof(caps));
+    comm_write(&ctx.packet);
+}
+
+static void update_start_session(void)
+{
+    const struct update_session_request_t *request = &ctx.session_request;
+
+    if ((request->version != UPDATE_HANDSHAKE_VERSION) || (request->file_size <= FW_AES128_IV_SIZE)) {
+        update_handle_failure(COMM_NACK_INVALID_REQUEST);
+        return;
+    }
+
+    if (request->device_id != FW_DEVICE_ID) {
+        update_handle_failure(COMM_NACK_WRONG_DEVICE);
+        return;
+    }
+
+    if (request->file_size > FLASH_MAIN_APP_MAX_SIZE) {
+        update_handle_failure(COMM_NACK_IMAGE_TOO_LARGE);
+        return;
+    }
+
+    /* Device boots the installed image right away, there's nothing to do */
+    if (((request->flags & UPDATE_SESSION_FLAG_FORCE) == 0) && update_image_is_installed(request)) {
+        update_handle_failure(COMM_NACK_UP_TO_DATE);
+        return;
+    }
+
+    ctx.credits.granted = update_grant_credits(request->credits);
+    ctx.credits.options = request->options & COMM_OPTION_FEC;
+    ctx.firmware_size = request->file_size;
+
+    if (update_start_transfer(request->aes_iv, FW_AES128_IV_SIZE) != 0) {
+        update_handle_failure(COMM_NACK_FLASH_ERROR);
+        return;
+    }
+
+    /* Acknowledge goes without parity, the host switches FEC on once it sees it */
+    update_send_session_ack();
+    comm_set_fec((ctx.credits.options & COMM_OPTION_FEC) != 0);
+    comm_set_streaming(true);
+
+    /* First data packet follows the acknowledge, it's the first round trip sample */
+    update_rtt_start();
+    ctx.state = UPDATE_GET_FW;
+    update_restart_timeout();
+}
+
+static bool update_is_session_request(const struct comm_packet_t *packet)
+{
+    return (comm_get_packet_type(packet) == COMM_PACKET_CTRL) && (packet->payload[0] == COMM_PACKET_OP_SESSION_REQUEST);
+}
+
+static void update_handle_session_page(const struct comm_packet_t *packet)
+{
+    const uint8_t page = packet->payload[1];
+    const size_t offset = page * UPDATE_PAGE_DATA_SIZE;
+
+    if ((comm_get_packet_length(packet) < COMM_PAGE_REQUEST_PACKET_SIZE) || (page >= UPDATE_SESSION_REQUEST_PAGES)) {
+        update_handle_failure(COMM_NACK_INVALID_REQUEST);
+        return;
+    }
+
+    const size_t page_size = MIN(sizeof(ctx.session_request) - offset, UPDATE_PAGE_DATA_SIZE);
+    if (comm_get_packet_length(packet) != (COMM_PAGE_REQUEST_PACKET_SIZE + page_size)) {
+        update_handle_failure(COMM_NACK_INVALID_REQUEST);
+        return;
+    }
+
+    /* Pages may come repeated, the host sends the whole request again when there's no answer */
+    memcpy((uint8_t *)&ctx.session_request + offset, &packet->payload[COMM_PAGE_REQUEST_PACKET_SIZE], page_size);
+    ctx.session_pages |= (1 << page);
+
+    if (ctx.session_pages == ((1 << UPDATE_SESSION_REQUEST_PAGES) - 1)) {
+        update_start_session();
     }
 }
 
 static void update_wait_for_request(void)
 {
     if (comm_packets_available()) {
-        comm_read(&ctx.packet); 
-        if (!update_is_update_request_packet(&ctx.packet)) {
-            update_handle_failure();
+        comm_read(&ctx.packet);
+        if (update_handle_service_request(&ctx.packet)) {
+            update_restart_timeout();
             return;
         }
-        
-        comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_ACK, NULL, 0);
+
+        if (update_is_ctrl_packet(&ctx.packet, COMM_PACKET_OP_SESSION_END, COMM_REQUEST_PACKET_SIZE)) {
+            ctx.state = UPDATE_DONE;
+            return;
+        }
+
+        if (update_is_session_request(&ctx.packet)) {
+            update_restart_timeout();
+            update_handle_session_page(&ctx.packet);
+            return;
+        }
+
+#if UPDATE_LEGACY_HANDSHAKE
+        if (!update_parse_update_request_packet(&ctx.packet, &ctx.credits)) {
+            update_handle_failure(COMM_NACK_UNEXPECTED_PACKET);
+            return;
+        }
+
+        /* Tell the host how many credits it got and which options apply, older hosts just ignore it.
+         * Acknowledge itself goes without parity, the host switches FEC on once it sees it. */
+        const uint8_t ack[] = { ctx.credits.granted, ctx.credits.options };
+        comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_ACK, ack, (ctx.credits.options != 0) ? 2 : 1);
         comm_write(&ctx.packet);
+        comm_set_fec((ctx.credits.options & COMM_OPTION_FEC) != 0);
 
-        timer_reset(&ctx.timer);
+        update_restart_timeout();
         ctx.state = UPDATE_GET_FW_SIZE;
-    }
-
-    if (timer_has_elapsed(&ctx.timer)) {
-        update_handle_failure();
+#else
+        /* Step by step handshake of older updaters is left out of the slot */
+        update_handle_failure(COMM_NACK_UNEXPECTED_PACKET);
+#endif
     }
 }
 
+#if UPDATE_LEGACY_HANDSHAKE
 static void update_get_fw_size(void)
 {
     if (comm_packets_available()) {
         comm_read(&ctx.packet);
         if (!update_parse_fw_size_packet(&ctx.packet, &ctx.firmware_size)) {
-            update_handle_failure();
+            update_handle_failure(COMM_NACK_INVALID_REQUEST);
             return;
         }
 
         comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_ACK, NULL, 0);
         comm_write(&ctx.packet);
 
-        timer_reset(&ctx.timer);
+        update_restart_timeout();
         ctx.state = UPDATE_GET_AES_IV;
     }
-
-    if (timer_has_elapsed(&ctx.timer)) {
-        update_handle_failure();
-    }
 }
 
 static void update_get_aes_iv(void)
@@ -158,93 +774,284 @@ static void update_get_aes_iv(void)
     if (comm_packets_available()) {
         comm_read(&ctx.packet);
         if (comm_get_packet_type(&ctx.packet) != COMM_PACKET_DATA) {
-            update_handle_failure();
+            update_handle_failure(COMM_NACK_UNEXPECTED_PACKET);
             return;
         }
 
-        /* Erase flash as late as possible, this way we can rollback from any previous step */
-        flash_erase_main_app();
-
         /* First firmware packet is an IV for AES */
-        AES_init_ctx_iv(&ctx.aes, aes_key, ctx.packet.payload);
-
-        /* It's not really needed, but write it to flash anyway */
-        const uint8_t packet_length = comm_get_packet_length(&ctx.packet);
-        flash_write(FLASH_MAIN_APP_START + ctx.bytes_received, ctx.packet.payload, packet_length);
+        if (update_start_transfer(ctx.packet.payload, comm_get_packet_length(&ctx.packet)) != 0) {
+            update_handle_failure(COMM_NACK_FLASH_ERROR);
+            return;
+        }
 
         comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_ACK, NULL, 0);
         comm_write(&ctx.packet);
 
-        ctx.bytes_received += packet_length;
+        /* IV is always acknowledged on its own, credits apply to the firmware data.
+         * Data is recovered by rewinding to an offset even when waiting for each acknowledge,
+         * unlike retransmission it can't duplicate a packet when one frame breaks into two. */
+        comm_set_streaming(true);
+        update_rtt_start();
         ctx.state = UPDATE_GET_FW;
+        update_restart_timeout();
+    }
+}
+#endif
+
+static void update_handle_rewind(const struct comm_packet_t *packet)
+{
+    /* Host announces where the data that follows starts, correct it if it's wrong */
+    const uint32_t offset = *(uint32_t *)&packet->payload[1];
+    if (offset != ctx.bytes_received) {
+        update_send_rewind();
+        return;
     }
-    // TODO timeout
+
+    update_rtt_stop();
+    ctx.rewind_requested = false;
+}
+
+static void update_receive_stage(void)
+{
+    /* Back-pressure, leave the packet in comm buffer and hold the ACK until a slot is free */
+    if (update_pipeline_is_full() || (ctx.bytes_received >= ctx.firmware_size)) {
+        return;
+    }
+
+    if (!comm_packets_available()) {
+        /* Everything received before the corrupted packet has been taken, ask the host to go back */
+        if (comm_is_rx_halted()) {
+            update_send_rewind();
+        }
+        return;
+    }
+
+    struct comm_packet_t *slot = &ctx.pipeline.slots[ctx.pipeline.received % UPDATE_PIPELINE_DEPTH];
+
+    comm_read(slot);
+    if (update_is_ctrl_packet(slot, COMM_PACKET_OP_REWIND, COMM_REWIND_PACKET_SIZE)) {
+        update_handle_rewind(slot);
+        return;
+    }
+
+    /* Host didn't get the answer to its session request and sent it again */
+    if (update_is_session_request(slot)) {
+        if ((ctx.bytes_received == FW_AES128_IV_SIZE) && (slot->payload[1] == (UPDATE_SESSION_REQUEST_PAGES - 1))) {
+            update_send_session_ack();
+        }
+        return;
+    }
+
+    if (comm_get_packet_type(slot) != COMM_PACKET_DATA) {
+        update_handle_failure(COMM_NACK_UNEXPECTED_PACKET);
+        return;
+    }
+
+    /* Data sent before the host got the rewind request */
+    if (ctx.rewind_requested) {
+        return;
+    }
+
+    ctx.bytes_received += comm_get_packet_length(slot);
+    ++ctx.pipeline.received;
+
+    update_rtt_stop();
+    ctx.retries = 0;
+    update_restart_timeout();
+
+    /* Acknowledge right away, so that the host sends the next packet while this one is processed.
+     * The last packet is confirmed with FW_UPDATE_DONE once everything has been programmed. */
+    if (ctx.bytes_received < ctx.firmware_size) {
+        comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_ACK, NULL, 0);
+        comm_write(&ctx.packet);
+    }
+}
+
+static void update_decrypt_stage(void)
+{
+    if (ctx.pipeline.decrypted == ctx.pipeline.received) {
+        return;
+    }
+
+    struct comm_packet_t *slot = &ctx.pipeline.slots[ctx.pipeline.decrypted % UPDATE_PIPELINE_DEPTH];
+
+    AES_CBC_decrypt_buffer(&ctx.aes, slot->payload, comm_get_packet_length(slot));
+    ++ctx.pipeline.decrypted;
+}
+
+static void update_program_stage(void)
+{
+    if (ctx.pipeline.programmed == ctx.pipeline.decrypted) {
+        /* Everything has been received and programmed */
+        if ((ctx.bytes_received >= ctx.firmware_size) && (ctx.pipeline.programmed == ctx.pipeline.received)) {
+            if (update_store_finish() != 0) {
+                update_handle_failure(COMM_NACK_FLASH_ERROR);
+                return;
+            }
+
+            comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_FW_UPDATE_DONE, NULL, 0);
+            comm_write(&ctx.packet);
+
+            /* Give the host a chance to collect statistics */
+            comm_set_streaming(false);
+            ctx.state = UPDATE_LINGER;
+            update_restart_timeout();
+            return;
+        }
+
+        /* Nothing to program, use the time to erase the next page. UART keeps receiving
+         * from RAM meanwhile, the buffer holds everything the host may have in flight.
+         * USB just NAKs the host until the erase is done. */
+        if (update_store_ahead() != 0) {
+            update_handle_failure(COMM_NACK_FLASH_ERROR);
+        }
+        return;
+    }
+
+    const struct comm_packet_t *slot = &ctx.pipeline.slots[ctx.pipeline.programmed % UPDATE_PIPELINE_DEPTH];
+    const uint8_t packet_length = comm_get_packet_length(slot);
+
+    /* Staging storage may be still busy with previous data, the packet waits in its slot */
+    const int result = update_store_write(slot->payload, packet_length);
+    ctx.store_busy = (result == -EBUSY);
+    if (ctx.store_busy) {
+        return;
+    }
+    if (result != 0) {
+        update_handle_failure(COMM_NACK_FLASH_ERROR);
+        return;
+    }
+
+    ctx.bytes_programmed += packet_length;
+    ++ctx.pipeline.programmed;
 }
 
 static void update_get_fw(void)
+{
+    /* Stages run back to front, each packet advances one stage per pass,
+     * with the communication handled in between */
+    update_program_stage();
+    if (ctx.state != UPDATE_GET_FW) {
+        return;
+    }
+
+    update_decrypt_stage();
+    update_receive_stage();
+}
+
+static void update_linger(void)
 {
     if (comm_packets_available()) {
         comm_read(&ctx.packet);
-        if (comm_get_packet_type(&ctx.packet) != COMM_PACKET_DATA) {
-            update_handle_failure();
+        if (update_is_ctrl_packet(&ctx.packet, COMM_PACKET_OP_SESSION_END, COMM_REQUEST_PACKET_SIZE)) {
+            ctx.state = UPDATE_DONE;
             return;
         }
 
-        const uint8_t packet_length = comm_get_packet_length(&ctx.packet);
+        /* Anything else is ignored, the image is complete already */
+        if (update_handle_service_request(&ctx.packet)) {
+            update_restart_timeout();
+        }
+    }
+}
 
-        AES_CBC_decrypt_buffer(&ctx.aes, ctx.packet.payload, packet_length);
-        flash_write(FLASH_MAIN_APP_START + ctx.bytes_received, ctx.packet.payload, packet_length);
+static bool update_has_pending_work(void)
+{
+    if (ctx.state == UPDATE_DONE) {
+        return false;
+    }
 
-        ctx.bytes_received += packet_length;
-        if (ctx.bytes_received < ctx.firmware_size) {
-            comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_ACK, NULL, 0);
-            comm_write(&ctx.packet);
+    if (ctx.state == UPDATE_GET_FW) {
+        if (update_store_is_due()) {
+            return true;
         }
-        else {
-            comm_create_ctrl_packet(&ctx.packet, COMM_PACKET_OP_FW_UPDATE_DONE, NULL, 0);
-            comm_write(&ctx.packet);
 
-            ctx.state = UPDATE_DONE;
+        /* Nothing can move until the storage takes the next packet, it's tried again on the next tick */
+        if (ctx.store_busy && update_pipeline_is_full() && (ctx.pipeline.decrypted == ctx.pipeline.received)) {
+            return false;
         }
     }
-    // TODO timeout
+
+    return comm_packets_available() || comm_data_available() || (ctx.pipeline.decrypted != ctx.pipeline.received) ||
+           ((ctx.pipeline.programmed != ctx.pipeline.decrypted) && !ctx.store_busy);
 }
 
-void update_run(void)
+static void update_comm_task(void)
 {
-    timer_init(&ctx.timer, UPDATE_TIMEOUT_MS);
+    /* Prevent communication handler consuming received bytes while waiting for sync */
+    if (ctx.state != UPDATE_WAIT_FOR_SYNC) {
+        comm_task();
+    }
+}
 
-    ctx.state = UPDATE_WAIT_FOR_SYNC;
+static void update_task(void)
+{
+    switch (ctx.state) {
+        case UPDATE_WAIT_FOR_SYNC:
+            update_wait_for_sync();
+            break;
 
-    while (ctx.state != UPDATE_DONE) {
-        switch (ctx.state) {
-            case UPDATE_WAIT_FOR_SYNC:
-                update_wait_for_sync();
-                break;
+        case UPDATE_WAIT_FOR_REQUEST:
+            update_wait_for_request();
+            break;
 
-            case UPDATE_WAIT_FOR_REQUEST:
-                update_wait_for_request();
-                break;
+#if UPDATE_LEGACY_HANDSHAKE
+        case UPDATE_GET_FW_SIZE:
+            update_get_fw_size();
+            break;
 
-            case UPDATE_GET_FW_SIZE:
-                update_get_fw_size();
-                break;
+        case UPDATE_GET_AES_IV:
+            update_get_aes_iv();
+            break;
+#endif
 
-            case UPDATE_GET_AES_IV:
-                update_get_aes_iv();
-                break;
+        case UPDATE_GET_FW:
+            update_get_fw();
+            break;
 
-            case UPDATE_GET_FW:
-                update_get_fw();
-                break;
+        case UPDATE_LINGER:
+            update_linger();
+            break;
 
-            default:
-                break;
-        }
+        default:
+            break;
+    }
 
-        /* Prevent communication handler consuming UART bytes while waiting for sync */
-        if (ctx.state != UPDATE_WAIT_FOR_SYNC) {
-            comm_task();
-        }
+    /* Keep going without waiting for another event while there are packets to process */
+    if (update_has_pending_work()) {
+        scheduler_post_event(SCHEDULER_EVENT_FLASH_READY);
+    }
+}
+
+void update_run(enum update_mode_t mode)
+{
+    /* Fast boot, nobody asked for update mode */
+    if ((mode == UPDATE_MODE_LISTEN) && (UPDATE_LISTEN_MS == 0)) {
+        return;
+    }
+
+    /* Previous run may have failed half way through */
+    memset(&ctx, 0, sizeof(ctx));
+    comm_set_streaming(false);
+    comm_set_fec(false);
+
+    /* Host keeps streaming while flash is erased or programmed */
+    system_relocate_vector_table();
+
+    ctx.mode = mode;
+    ctx.state = UPDATE_WAIT_FOR_SYNC;
+    rto_init(&ctx.rto, UPDATE_RTO_INITIAL_MS * 1000, UPDATE_RTO_MIN_MS * 1000, UPDATE_TIMEOUT_MS * 1000);
+    update_restart_timeout();
+
+    /* Communication goes first, so that received packets are handled in the same pass */
+    scheduler_add_task(timer_wheel_task, SCHEDULER_EVENT_TIMER);
+    scheduler_add_task(update_comm_task, SCHEDULER_EVENT_RX | SCHEDULER_EVENT_FLASH_READY);
+    scheduler_add_task(update_task, SCHEDULER_EVENT_RX | SCHEDULER_EVENT_TIMER | SCHEDULER_EVENT_FLASH_READY);
+
+    while (ctx.state != UPDATE_DONE) {
+        scheduler_run();
     }
+
+    timer_event_stop(&ctx.timeout);
+    scheduler_remove_tasks();
 }
@@ -1,3 +1,10 @@
 #pragma once
 
-void update_run(void);
+enum update_mode_t
+{
+    UPDATE_MODE_LISTEN,     // Waits UPDATE_LISTEN_MS for the host, returns straight away if it's 0
+    UPDATE_MODE_REQUESTED,  // Firmware asked for update mode, the host is expected shortly
+    UPDATE_MODE_RECOVERY,   // There's no valid image to boot, waits for the host indefinitely
+};
+
+void update_run(enum update_mode_t mode);
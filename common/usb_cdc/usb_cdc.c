@@ -0,0 +1,372 @@
+#include "usb_cdc.h"
+#include <ring_buffer.h>
+#include <scheduler.h>
+#include <system.h>
+#include <utils.h>
+#include <string.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/cdc.h>
+
+#define USB_CDC_IRQ NVIC_USB_LP_CAN_RX0_IRQ
+
+/* Full speed */
+#define USB_CDC_BIT_RATE 12000000
+
+/* ST's virtual COM port IDs, the host uses its stock CDC-ACM driver */
+#define USB_CDC_VID 0x0483
+#define USB_CDC_PID 0x5740
+
+#define USB_CDC_COMM_EP 0x83
+#define USB_CDC_DATA_OUT_EP 0x01
+#define USB_CDC_DATA_IN_EP 0x82
+#define USB_CDC_COMM_PACKET_SIZE 16
+
+/* D+ with the external pull-up, driven low for a while the host sees a disconnect */
+#define USB_CDC_DP_PORT GPIOA
+#define USB_CDC_DP_PIN GPIO12
+#define USB_CDC_RECONNECT_MS 10
+
+#define USB_CDC_TX_TIMEOUT_MS 100
+
+#define USB_CDC_CONTROL_BUFFER_SIZE 128
+
+/* 96-bit unique ID as hex string */
+#define USB_CDC_SERIAL_SIZE 25
+
+struct usb_cdc_ctx_t
+{
+    usbd_device *usbd_dev;
+    uint8_t control_buffer[USB_CDC_CONTROL_BUFFER_SIZE];
+    char serial[USB_CDC_SERIAL_SIZE];
+    struct ring_buffer_t rx_buf;
+    uint8_t rx_buf_data[USB_CDC_RX_BUFFER_SIZE];
+    volatile bool rx_held;
+    volatile bool configured;
+    struct transport_stats_t stats;
+};
+
+static struct usb_cdc_ctx_t ctx;
+
+static const struct usb_device_descriptor usb_cdc_device_descriptor = {
+    .bLength = USB_DT_DEVICE_SIZE,
+    .bDescriptorType = USB_DT_DEVICE,
+    .bcdUSB = 0x0200,
+    .bDeviceClass = USB_CLASS_CDC,
+    .bDeviceSubClass = 0,
+    .bDeviceProtocol = 0,
+    .bMaxPacketSize0 = 64,
+    .idVendor = USB_CDC_VID,
+    .idProduct = USB_CDC_PID,
+    .bcdDevice = 0x0200,
+    .iManufacturer = 1,
+    .iProduct = 2,
+    .iSerialNumber = 3,
+    .bNumConfigurations = 1,
+};
+
+/* Notifications are never sent, but the endpoint is required by the class */
+static const struct usb_endpoint_descriptor usb_cdc_comm_endpoints[] = {{
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = USB_CDC_COMM_EP,
+    .bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
+    .wMaxPacketSize = USB_CDC_COMM_PACKET_SIZE,
+    .bInterval = 255,
+}};
+
+static const struct usb_endpoint_descriptor usb_cdc_data_endpoints[] = {{
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = USB_CDC_DATA_OUT_EP,
+    .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+    .wMaxPacketSize = USB_CDC_PACKET_SIZE,
+    .bInterval = 1,
+}, {
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = USB_CDC_DATA_IN_EP,
+    .bmAttributes = USB_ENDPOINT_ATTR_BULK,
+    .wMaxPacketSize = USB_CDC_PACKET_SIZE,
+    .bInterval = 1,
+}};
+
+static const struct {
+    struct usb_cdc_header_descriptor header;
+    struct usb_cdc_call_management_descriptor call_mgmt;
+    struct usb_cdc_acm_descriptor acm;
+    struct usb_cdc_union_descriptor cdc_union;
+} __attribute__((packed)) usb_cdc_functional_descriptors = {
+    .header = {
+        .bFunctionLength = sizeof(struct usb_cdc_header_descriptor),
+        .bDescriptorType = CS_INTERFACE,
+        .bDescriptorSubtype = USB_CDC_TYPE_HEADER,
+        .bcdCDC = 0x0110,
+    },
+    .call_mgmt = {
+        .bFunctionLength = sizeof(struct usb_cdc_call_management_descriptor),
+        .bDescriptorType = CS_INTERFACE,
+        .bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT,
+        .bmCapabilities = 0,
+        .bDataInterface = 1,
+    },
+    .acm = {
+        .bFunctionLength = sizeof(struct usb_cdc_acm_descriptor),
+        .bDescriptorType = CS_INTERFACE,
+        .bDescriptorSubtype = USB_CDC_TYPE_ACM,
+        .bmCapabilities = 0,
+    },
+    .cdc_union = {
+        .bFunctionLength = sizeof(struct usb_cdc_union_descriptor),
+        .bDescriptorType = CS_INTERFACE,
+        .bDescriptorSubtype = USB_CDC_TYPE_UNION,
+        .bControlInterface = 0,
+        .bSubordinateInterface0 = 1,
+    },
+};
+
+static const struct usb_interface_descriptor usb_cdc_comm_interface[] = {{
+    .bLength = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = 0,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 1,
+    .bInterfaceClass = USB_CLASS_CDC,
+    .bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,
+    .bInterfaceProtocol = USB_CDC_PROTOCOL_AT,
+    .iInterface = 0,
+    .endpoint = usb_cdc_comm_endpoints,
+    .extra = &usb_cdc_functional_descriptors,
+    .extralen = sizeof(usb_cdc_functional_descriptors),
+}};
+
+static const struct usb_interface_descriptor usb_cdc_data_interface[] = {{
+    .bLength = USB_DT_INTERFACE_SIZE,
+    .bDescriptorType = USB_DT_INTERFACE,
+    .bInterfaceNumber = 1,
+    .bAlternateSetting = 0,
+    .bNumEndpoints = 2,
+    .bInterfaceClass = USB_CLASS_DATA,
+    .bInterfaceSubClass = 0,
+    .bInterfaceProtocol = 0,
+    .iInterface = 0,
+    .endpoint = usb_cdc_data_endpoints,
+}};
+
+static const struct usb_interface usb_cdc_interfaces[] = {{
+    .num_altsetting = 1,
+    .altsetting = usb_cdc_comm_interface,
+}, {
+    .num_altsetting = 1,
+    .altsetting = usb_cdc_data_interface,
+}};
+
+static const struct usb_config_descriptor usb_cdc_config_descriptor = {
+    .bLength = USB_DT_CONFIGURATION_SIZE,
+    .bDescriptorType = USB_DT_CONFIGURATION,
+    .wTotalLength = 0,
+    .bNumInterfaces = 2,
+    .bConfigurationValue = 1,
+    .iConfiguration = 0,
+    .bmAttributes = 0x80,
+    .bMaxPower = 0x32,
+    .interface = usb_cdc_interfaces,
+};
+
+/* Serial number tells the boards on a programming station apart */
+static const char *usb_cdc_strings[] = {
+    "f103_bootloader",
+    "F103 Bootloader",
+    ctx.serial,
+};
+
+static enum usbd_request_return_codes usb_cdc_control_request(usbd_device *usbd_dev, struct usb_setup_data *req,
+    uint8_t **buf, uint16_t *len, usbd_control_complete_callback *complete)
+{
+    (void)usbd_dev;
+    (void)buf;
+    (void)complete;
+
+    /* Line settings mean nothing on USB, they are accepted so that terminals are happy */
+    switch (req->bRequest) {
+        case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
+            return USBD_REQ_HANDLED;
+
+        case USB_CDC_REQ_SET_LINE_CODING:
+            if (*len < sizeof(struct usb_cdc_line_coding)) {
+                return USBD_REQ_NOTSUPP;
+            }
+            return USBD_REQ_HANDLED;
+
+        default:
+            return USBD_REQ_NOTSUPP;
+    }
+}
+
+static void usb_cdc_data_rx(usbd_device *usbd_dev, uint8_t ep)
+{
+    uint8_t data[USB_CDC_PACKET_SIZE];
+
+    /* NAK is set before the packet is taken, so that the endpoint isn't enabled in between */
+    if (ring_buffer_get_free(&ctx.rx_buf) < (2 * USB_CDC_PACKET_SIZE)) {
+        usbd_ep_nak_set(usbd_dev, ep, 1);
+        ctx.rx_held = true;
+    }
+
+    const uint16_t size = usbd_ep_read_packet(usbd_dev, ep, data, sizeof(data));
+    const size_t written = ring_buffer_write(&ctx.rx_buf, data, size);
+
+    ctx.stats.rx_bytes += size;
+    ctx.stats.ring_full_drops += size - written;
+    scheduler_post_event(SCHEDULER_EVENT_RX);
+}
+
+static void usb_cdc_set_config(usbd_device *usbd_dev, uint16_t value)
+{
+    (void)value;
+
+    usbd_ep_setup(usbd_dev, USB_CDC_DATA_OUT_EP, USB_ENDPOINT_ATTR_BULK, USB_CDC_PACKET_SIZE, usb_cdc_data_rx);
+    usbd_ep_setup(usbd_dev, USB_CDC_DATA_IN_EP, USB_ENDPOINT_ATTR_BULK, USB_CDC_PACKET_SIZE, NULL);
+    usbd_ep_setup(usbd_dev, USB_CDC_COMM_EP, USB_ENDPOINT_ATTR_INTERRUPT, USB_CDC_COMM_PACKET_SIZE, NULL);
+
+    usbd_register_control_callback(usbd_dev, USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+        USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT, usb_cdc_control_request);
+
+    ctx.configured = true;
+}
+
+static void usb_cdc_reset(void)
+{
+    ctx.configured = false;
+}
+
+void usb_lp_can_rx0_isr(void)
+{
+    usbd_poll(ctx.usbd_dev);
+}
+
+void usb_cdc_init(void)
+{
+    /* Initialize Rx ring buffer */
+    ring_buffer_init(&ctx.rx_buf, ctx.rx_buf_data, sizeof(ctx.rx_buf_data));
+    desig_get_unique_id_as_string(ctx.serial, sizeof(ctx.serial));
+
+    /* Host doesn't notice a reset on its own, the device would stay unconfigured */
+    rcc_periph_clock_enable(RCC_GPIOA);
+    gpio_clear(USB_CDC_DP_PORT, USB_CDC_DP_PIN);
+    gpio_set_mode(USB_CDC_DP_PORT, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, USB_CDC_DP_PIN);
+    system_delay_ms(USB_CDC_RECONNECT_MS);
+    gpio_set_mode(USB_CDC_DP_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, USB_CDC_DP_PIN);
+
+    /* Enable USB peripheral, usbd takes over the pins */
+    rcc_periph_clock_enable(RCC_USB);
+    ctx.usbd_dev = usbd_init(&st_usbfs_v1_usb_driver, &usb_cdc_device_descriptor, &usb_cdc_config_descriptor,
+        usb_cdc_strings, sizeof(usb_cdc_strings) / sizeof(usb_cdc_strings[0]),
+        ctx.control_buffer, sizeof(ctx.control_buffer));
+    usbd_register_set_config_callback(ctx.usbd_dev, usb_cdc_set_config);
+    usbd_register_reset_callback(ctx.usbd_dev, usb_cdc_reset);
+
+    /* Whole stack runs from the interrupt */
+    nvic_enable_irq(USB_CDC_IRQ);
+}
+
+void usb_cdc_deinit(void)
+{
+    /* Disable USB interrupt */
+    nvic_disable_irq(USB_CDC_IRQ);
+    ctx.configured = false;
+
+    /* Reset USB peripheral, so that the firmware starts from scratch, and disable its clock */
+    rcc_periph_reset_pulse(RST_USB);
+    rcc_periph_clock_disable(RCC_USB);
+}
+
+void usb_cdc_write(const void *data, size_t size)
+{
+    if (data == NULL) {
+        return;
+    }
+
+    const uint8_t *data_ptr = data;
+
+    while ((size > 0) && ctx.configured) {
+        const uint16_t chunk = MIN(size, USB_CDC_PACKET_SIZE);
+        const uint32_t start_tick = system_get_ticks();
+        uint16_t written;
+
+        /* Endpoint is busy until the host collects the previous packet */
+        do {
+            if ((system_get_ticks() - start_tick) >= USB_CDC_TX_TIMEOUT_MS) {
+                return;
+            }
+
+            nvic_disable_irq(USB_CDC_IRQ);
+            written = usbd_ep_write_packet(ctx.usbd_dev, USB_CDC_DATA_IN_EP, data_ptr, chunk);
+            nvic_enable_irq(USB_CDC_IRQ);
+        } while (written == 0);
+
+        data_ptr += chunk;
+        size -= chunk;
+    }
+}
+
+size_t usb_cdc_read(void *data, size_t size)
+{
+    const size_t bytes_read = ring_buffer_read(&ctx.rx_buf, data, size);
+
+    /* Let the host send again once a whole packet fits */
+    if (ctx.rx_held && (ring_buffer_get_free(&ctx.rx_buf) >= USB_CDC_PACKET_SIZE)) {
+        nvic_disable_irq(USB_CDC_IRQ);
+        ctx.rx_held = false;
+        usbd_ep_nak_set(ctx.usbd_dev, USB_CDC_DATA_OUT_EP, 0);
+        nvic_enable_irq(USB_CDC_IRQ);
+    }
+
+    return bytes_read;
+}
+
+bool usb_cdc_data_available(void)
+{
+    return !ring_buffer_is_empty(&ctx.rx_buf);
+}
+
+void usb_cdc_flush(void)
+{
+    const uint32_t start_tick = system_get_ticks();
+
+    while (ctx.configured && ((*USB_EP_REG(USB_CDC_DATA_IN_EP & 0x7F) & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID)) {
+        if ((system_get_ticks() - start_tick) >= USB_CDC_TX_TIMEOUT_MS) {
+            return;
+        }
+    }
+}
+
+void usb_cdc_get_stats(struct transport_stats_t *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    *stats = ctx.stats;
+}
+
+void usb_cdc_reset_stats(void)
+{
+    memset(&ctx.stats, 0, sizeof(ctx.stats));
+}
+
+const struct transport_t usb_cdc_transport = {
+    .bit_rate = USB_CDC_BIT_RATE,
+    .init = usb_cdc_init,
+    .deinit = usb_cdc_deinit,
+    .write = usb_cdc_write,
+    .read = usb_cdc_read,
+    .data_available = usb_cdc_data_available,
+    .flush = usb_cdc_flush,
+    .get_stats = usb_cdc_get_stats,
+    .reset_stats = usb_cdc_reset_stats,
+};
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <transport.h>
+
+/* Full speed bulk endpoints carry up to 64 bytes per packet */
+#define USB_CDC_PACKET_SIZE 64
+
+/* Host is held off with NAK when less than one packet fits */
+#define USB_CDC_RX_BUFFER_SIZE 512
+
+extern const struct transport_t usb_cdc_transport;
+
+/* Needs 48 MHz USB clock and running SysTick */
+void usb_cdc_init(void);
+void usb_cdc_deinit(void);
+
+/* Data is dropped when the host doesn't read it in time, e.g. with the port closed */
+void usb_cdc_write(const void *data, size_t size);
+
+size_t usb_cdc_read(void *data, size_t size);
+bool usb_cdc_data_available(void);
+
+/* Waits for the host to collect the last packet */
+void usb_cdc_flush(void);
+
+void usb_cdc_get_stats(struct transport_stats_t *stats);
+void usb_cdc_reset_stats(void);
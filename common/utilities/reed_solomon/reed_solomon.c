@@ -0,0 +1,211 @@
+#include "reed_solomon.h"
+#include <string.h>
+#include <errno.h>
+
+#define REED_SOLOMON_PRIMITIVE_POLY 0x11D
+#define REED_SOLOMON_FIELD_ORDER 255
+
+/* Polynomials are kept lowest degree first */
+#define REED_SOLOMON_POLY_SIZE (REED_SOLOMON_PARITY_SIZE + 1)
+
+struct reed_solomon_ctx_t
+{
+    uint8_t exp[2 * REED_SOLOMON_FIELD_ORDER];  // Doubled, so that log sums don't need modulo
+    uint8_t log[REED_SOLOMON_FIELD_ORDER + 1];
+    uint8_t generator[REED_SOLOMON_POLY_SIZE];
+};
+
+static struct reed_solomon_ctx_t ctx;
+
+static uint8_t reed_solomon_mul(uint8_t a, uint8_t b)
+{
+    if ((a == 0) || (b == 0)) {
+        return 0;
+    }
+
+    return ctx.exp[ctx.log[a] + ctx.log[b]];
+}
+
+static uint8_t reed_solomon_div(uint8_t a, uint8_t b)
+{
+    if (a == 0) {
+        return 0;
+    }
+
+    return ctx.exp[ctx.log[a] + REED_SOLOMON_FIELD_ORDER - ctx.log[b]];
+}
+
+static uint8_t reed_solomon_poly_eval(const uint8_t *poly, size_t size, uint8_t x)
+{
+    uint8_t value = 0;
+
+    for (size_t i = size; i > 0; --i) {
+        value = reed_solomon_mul(value, x) ^ poly[i - 1];
+    }
+
+    return value;
+}
+
+void reed_solomon_init(void)
+{
+    uint16_t value = 1;
+
+    for (size_t i = 0; i < REED_SOLOMON_FIELD_ORDER; ++i) {
+        ctx.exp[i] = value;
+        ctx.exp[i + REED_SOLOMON_FIELD_ORDER] = value;
+        ctx.log[value] = i;
+
+        value <<= 1;
+        if (value & 0x100) {
+            value ^= REED_SOLOMON_PRIMITIVE_POLY;
+        }
+    }
+
+    /* Generator is the product of (x - a^i) for each parity byte */
+    memset(ctx.generator, 0, sizeof(ctx.generator));
+    ctx.generator[0] = 1;
+    for (size_t i = 0; i < REED_SOLOMON_PARITY_SIZE; ++i) {
+        for (size_t j = i + 1; j > 0; --j) {
+            ctx.generator[j] = ctx.generator[j - 1] ^ reed_solomon_mul(ctx.generator[j], ctx.exp[i]);
+        }
+        ctx.generator[0] = reed_solomon_mul(ctx.generator[0], ctx.exp[i]);
+    }
+}
+
+int reed_solomon_encode(const void *data, size_t size, uint8_t *parity)
+{
+    const uint8_t *data_ptr = data;
+
+    if ((data == NULL) || (parity == NULL) || (size + REED_SOLOMON_PARITY_SIZE > REED_SOLOMON_MAX_SIZE)) {
+        return -EINVAL;
+    }
+
+    /* Remainder of the division by generator, first data byte is the highest coefficient */
+    memset(parity, 0, REED_SOLOMON_PARITY_SIZE);
+    for (size_t i = 0; i < size; ++i) {
+        const uint8_t feedback = data_ptr[i] ^ parity[0];
+
+        for (size_t j = 0; j < REED_SOLOMON_PARITY_SIZE - 1; ++j) {
+            parity[j] = parity[j + 1] ^ reed_solomon_mul(feedback, ctx.generator[REED_SOLOMON_PARITY_SIZE - 1 - j]);
+        }
+        parity[REED_SOLOMON_PARITY_SIZE - 1] = reed_solomon_mul(feedback, ctx.generator[0]);
+    }
+
+    return 0;
+}
+
+int reed_solomon_decode(void *codeword, size_t size)
+{
+    uint8_t *data = codeword;
+    uint8_t syndromes[REED_SOLOMON_PARITY_SIZE];
+    uint8_t locator[REED_SOLOMON_POLY_SIZE] = {1};
+    uint8_t previous[REED_SOLOMON_POLY_SIZE] = {1};
+    uint8_t evaluator[REED_SOLOMON_PARITY_SIZE] = {0};
+    uint8_t derivative[REED_SOLOMON_PARITY_SIZE] = {0};
+    uint8_t previous_discrepancy = 1;
+    size_t errors = 0;
+    size_t shift = 1;
+    bool corrupted = false;
+
+    if ((codeword == NULL) || (size <= REED_SOLOMON_PARITY_SIZE) || (size > REED_SOLOMON_MAX_SIZE)) {
+        return -EINVAL;
+    }
+
+    /* Codeword is divisible by generator, so it evaluates to zero in each of its roots */
+    for (size_t i = 0; i < REED_SOLOMON_PARITY_SIZE; ++i) {
+        uint8_t value = 0;
+        for (size_t j = 0; j < size; ++j) {
+            value = reed_solomon_mul(value, ctx.exp[i]) ^ data[j];
+        }
+        syndromes[i] = value;
+        corrupted |= (value != 0);
+    }
+
+    if (!corrupted) {
+        return 0;
+    }
+
+    /* Berlekamp-Massey finds the error locator, its roots are inverses of error positions */
+    for (size_t i = 0; i < REED_SOLOMON_PARITY_SIZE; ++i) {
+        uint8_t discrepancy = syndromes[i];
+        for (size_t j = 1; j <= errors; ++j) {
+            discrepancy ^= reed_solomon_mul(locator[j], syndromes[i - j]);
+        }
+
+        if (discrepancy == 0) {
+            ++shift;
+            continue;
+        }
+
+        uint8_t temp[REED_SOLOMON_POLY_SIZE];
+        memcpy(temp, locator, sizeof(temp));
+
+        const uint8_t scale = reed_solomon_div(discrepancy, previous_discrepancy);
+        for (size_t j = shift; j < REED_SOLOMON_POLY_SIZE; ++j) {
+            locator[j] ^= reed_solomon_mul(scale, previous[j - shift]);
+        }
+
+        if (2 * errors <= i) {
+            errors = i + 1 - errors;
+            memcpy(previous, temp, sizeof(previous));
+            previous_discrepancy = discrepancy;
+            shift = 1;
+        } else {
+            ++shift;
+        }
+    }
+
+    if (2 * errors > REED_SOLOMON_PARITY_SIZE) {
+        return -EIO;
+    }
+
+    /* Error evaluator is syndromes times locator, truncated to parity size */
+    for (size_t i = 0; i < REED_SOLOMON_PARITY_SIZE; ++i) {
+        for (size_t j = 0; j <= i; ++j) {
+            evaluator[i] ^= reed_solomon_mul(syndromes[j], locator[i - j]);
+        }
+    }
+
+    /* Formal derivative keeps odd powers only */
+    for (size_t i = 1; i < REED_SOLOMON_POLY_SIZE; i += 2) {
+        derivative[i - 1] = locator[i];
+    }
+
+    /* Chien search over all positions, Forney gives the error value at each root */
+    size_t found = 0;
+    uint8_t corrections[REED_SOLOMON_PARITY_SIZE / 2];
+    size_t positions[REED_SOLOMON_PARITY_SIZE / 2];
+    for (size_t i = 0; i < size; ++i) {
+        const size_t power = size - 1 - i;
+        const uint8_t x_inv = ctx.exp[(REED_SOLOMON_FIELD_ORDER - power) % REED_SOLOMON_FIELD_ORDER];
+
+        if (reed_solomon_poly_eval(locator, REED_SOLOMON_POLY_SIZE, x_inv) != 0) {
+            continue;
+        }
+
+        if (found >= errors) {
+            return -EIO;
+        }
+
+        const uint8_t denominator = reed_solomon_poly_eval(derivative, REED_SOLOMON_PARITY_SIZE, x_inv);
+        if (denominator == 0) {
+            return -EIO;
+        }
+
+        const uint8_t numerator = reed_solomon_poly_eval(evaluator, REED_SOLOMON_PARITY_SIZE, x_inv);
+        corrections[found] = reed_solomon_mul(ctx.exp[power], reed_solomon_div(numerator, denominator));
+        positions[found] = i;
+        ++found;
+    }
+
+    /* Locator with roots outside of the codeword means more errors than the code can handle */
+    if (found != errors) {
+        return -EIO;
+    }
+
+    for (size_t i = 0; i < found; ++i) {
+        data[positions[i]] ^= corrections[i];
+    }
+
+    return found;
+}
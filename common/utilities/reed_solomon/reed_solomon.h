@@ -0,0 +1,18 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Reed-Solomon code over GF(2^8) with 0x11D polynomial and generator roots a^0..a^(n-1),
+ * corrects up to half as many corrupted bytes as there are parity bytes */
+#define REED_SOLOMON_PARITY_SIZE 4
+#define REED_SOLOMON_MAX_SIZE 255
+
+void reed_solomon_init(void);
+
+/* Parity is computed over the data and has to be sent right after it */
+int reed_solomon_encode(const void *data, size_t size, uint8_t *parity);
+
+/* Corrects codeword (data followed by parity) in place, returns number of corrected bytes */
+int reed_solomon_decode(void *codeword, size_t size);
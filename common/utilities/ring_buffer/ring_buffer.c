@@ -32,7 +32,7 @@ size_t ring_buffer_write(struct ring_buffer_t *rb, const void *data, size_t size
     return size;
 }
 
-int ring_buffer_write_byte(struct ring_buffer_t *rb, uint8_t data)
+RAMFUNC int ring_buffer_write_byte(struct ring_buffer_t *rb, uint8_t data)
 {
     const size_t read_index = rb->read_index;
     size_t write_index = rb->write_index;
@@ -65,7 +65,7 @@ size_t ring_buffer_read(struct ring_buffer_t *rb, void *data, size_t size)
     return size;
 }
 
-int ring_buffer_read_byte(struct ring_buffer_t *rb, uint8_t *data)
+RAMFUNC int ring_buffer_read_byte(struct ring_buffer_t *rb, uint8_t *data)
 {
     if ((rb == NULL) || (data == NULL)) {
         return -EINVAL;
@@ -92,3 +92,25 @@ bool ring_buffer_is_empty(const struct ring_buffer_t *rb)
 
     return (rb->write_index == rb->read_index);
 }
+
+RAMFUNC size_t ring_buffer_get_count(const struct ring_buffer_t *rb)
+{
+    if (rb == NULL) {
+        return 0;
+    }
+
+    const size_t write_index = rb->write_index;
+    const size_t read_index = rb->read_index;
+
+    return (write_index + rb->size - read_index) % rb->size;
+}
+
+size_t ring_buffer_get_free(const struct ring_buffer_t *rb)
+{
+    if (rb == NULL) {
+        return 0;
+    }
+
+    /* One byte is always kept empty to tell full buffer from empty one */
+    return rb->size - ring_buffer_get_count(rb) - 1;
+}
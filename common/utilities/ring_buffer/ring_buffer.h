@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <utils.h>
 
 struct ring_buffer_t
 {
@@ -15,9 +16,14 @@ struct ring_buffer_t
 int ring_buffer_init(struct ring_buffer_t *rb, uint8_t *buffer, size_t size);
 
 size_t ring_buffer_write(struct ring_buffer_t *rb, const void *data, size_t size);
-int ring_buffer_write_byte(struct ring_buffer_t *rb, uint8_t data);
+/* Used from UART interrupt, so they run from RAM */
+RAMFUNC int ring_buffer_write_byte(struct ring_buffer_t *rb, uint8_t data);
 
 size_t ring_buffer_read(struct ring_buffer_t *rb, void *data, size_t size);
-int ring_buffer_read_byte(struct ring_buffer_t *rb, uint8_t *data);
+/* Used from UART interrupt for background transmission */
+RAMFUNC int ring_buffer_read_byte(struct ring_buffer_t *rb, uint8_t *data);
 
 bool ring_buffer_is_empty(const struct ring_buffer_t *rb);
+
+RAMFUNC size_t ring_buffer_get_count(const struct ring_buffer_t *rb);
+size_t ring_buffer_get_free(const struct ring_buffer_t *rb);
@@ -0,0 +1,48 @@
+#include "rto.h"
+#include <utils.h>
+
+#define RTO_VARIANCE_FACTOR 4
+
+static uint32_t rto_clamp(const struct rto_t *rto, uint32_t timeout)
+{
+    if (timeout < rto->min) {
+        return rto->min;
+    }
+
+    return MIN(timeout, rto->max);
+}
+
+void rto_init(struct rto_t *rto, uint32_t initial, uint32_t min, uint32_t max)
+{
+    rto->srtt = 0;
+    rto->rttvar = 0;
+    rto->min = min;
+    rto->max = max;
+    rto->timeout = rto_clamp(rto, initial);
+    rto->has_sample = false;
+}
+
+void rto_sample(struct rto_t *rto, uint32_t rtt)
+{
+    if (!rto->has_sample) {
+        rto->srtt = rtt;
+        rto->rttvar = rtt / 2;
+        rto->has_sample = true;
+    } else {
+        const uint32_t delta = (rto->srtt > rtt) ? (rto->srtt - rtt) : (rtt - rto->srtt);
+        rto->rttvar = rto->rttvar - rto->rttvar / 4 + delta / 4;
+        rto->srtt = rto->srtt - rto->srtt / 8 + rtt / 8;
+    }
+
+    rto->timeout = rto_clamp(rto, rto->srtt + RTO_VARIANCE_FACTOR * rto->rttvar);
+}
+
+void rto_backoff(struct rto_t *rto)
+{
+    rto->timeout = MIN((uint64_t)rto->timeout * 2, rto->max);
+}
+
+uint32_t rto_get_timeout(const struct rto_t *rto)
+{
+    return rto->timeout;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Retransmission timeout estimated from round trip samples as in RFC 6298: smoothed RTT and its
+ * variance with gains of 1/8 and 1/4, timeout is SRTT + 4 * RTTVAR. Each expiry doubles it until
+ * the next sample. Times are in microseconds. */
+struct rto_t
+{
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t timeout;
+    uint32_t min;
+    uint32_t max;
+    bool has_sample;
+};
+
+void rto_init(struct rto_t *rto, uint32_t initial, uint32_t min, uint32_t max);
+
+/* Samples of retransmitted requests are ambiguous, they must not be passed in */
+void rto_sample(struct rto_t *rto, uint32_t rtt);
+void rto_backoff(struct rto_t *rto);
+
+uint32_t rto_get_timeout(const struct rto_t *rto);
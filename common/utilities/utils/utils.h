@@ -1,9 +1,17 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
+/* Code that has to keep running while flash is erased or programmed. It's copied to RAM
+ * along with initialized data, calls between RAM and flash don't fit into a branch. */
+#define RAMFUNC __attribute__((section(".ramfunc"), noinline, long_call))
+
+/* Interrupt handlers are reached through the vector table only */
+#define RAMFUNC_HANDLER __attribute__((section(".ramfunc")))
+
 /* Generic implementation of non-reflect CRC16 */
 inline static uint16_t utils_crc16(uint16_t poly, uint16_t seed, const void *data, size_t size)
 {
@@ -0,0 +1,382 @@
+#include "w25q.h"
+#include <system.h>
+#include <utils.h>
+#include <errno.h>
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/spi.h>
+#include <libopencm3/stm32/dma.h>
+
+#define W25Q_SPI SPI1
+#define W25Q_SPI_RCC RCC_SPI1
+
+#define W25Q_PORT GPIOA
+#define W25Q_PORT_RCC RCC_GPIOA
+#define W25Q_CS_PIN GPIO_SPI1_NSS
+#define W25Q_SCK_PIN GPIO_SPI1_SCK
+#define W25Q_MISO_PIN GPIO_SPI1_MISO
+#define W25Q_MOSI_PIN GPIO_SPI1_MOSI
+
+/* SPI1 requests are fixed to these channels */
+#define W25Q_DMA DMA1
+#define W25Q_DMA_RCC RCC_DMA1
+#define W25Q_DMA_RX_CHANNEL DMA_CHANNEL2
+#define W25Q_DMA_TX_CHANNEL DMA_CHANNEL3
+#define W25Q_DMA_MAX_COUNT 0xFFFF
+
+#define W25Q_CMD_WRITE_ENABLE 0x06
+#define W25Q_CMD_READ_STATUS 0x05
+#define W25Q_CMD_READ_DATA 0x03
+#define W25Q_CMD_PAGE_PROGRAM 0x02
+#define W25Q_CMD_SECTOR_ERASE 0x20
+#define W25Q_CMD_RELEASE_POWER_DOWN 0xAB
+#define W25Q_CMD_JEDEC_ID 0x9F
+
+#define W25Q_STATUS_BUSY (1 << 0)
+
+/* Capacity is a power of 2 given in the last ID byte, from 64 KiB to 64 MiB.
+ * Larger parts need 4-byte addresses. */
+#define W25Q_CAPACITY_MIN 0x10
+#define W25Q_CAPACITY_MAX 0x18
+
+/* Sector erase takes 400ms at most, program is much shorter */
+#define W25Q_BUSY_TIMEOUT_MS 500
+
+#define W25Q_DUMMY_BYTE 0xFF
+
+enum w25q_op_t
+{
+    W25Q_OP_NONE = 0,
+    W25Q_OP_ERASE,
+    W25Q_OP_WRITE,
+    W25Q_OP_READ
+};
+
+struct w25q_ctx_t
+{
+    size_t size;
+    enum w25q_op_t op;
+    size_t addr;
+    const uint8_t *tx_data;
+    uint8_t *rx_data;
+    size_t remaining;
+    bool transfer_active;   // DMA runs with CS low
+    bool chip_busy;         // Program or erase runs inside the chip
+    uint32_t busy_start;
+    int result;
+    uint8_t tx_dummy;
+    uint8_t rx_dummy;
+};
+
+static struct w25q_ctx_t ctx;
+
+static void w25q_select(void)
+{
+    gpio_clear(W25Q_PORT, W25Q_CS_PIN);
+}
+
+static void w25q_deselect(void)
+{
+    /* Last byte has been received already, but the clock may still be running */
+    while ((SPI_SR(W25Q_SPI) & SPI_SR_BSY) != 0) {
+    }
+    gpio_set(W25Q_PORT, W25Q_CS_PIN);
+}
+
+static void w25q_send_command(uint8_t command, size_t addr, bool has_addr)
+{
+    w25q_select();
+    spi_xfer(W25Q_SPI, command);
+    if (has_addr) {
+        spi_xfer(W25Q_SPI, (addr >> 16) & 0xFF);
+        spi_xfer(W25Q_SPI, (addr >> 8) & 0xFF);
+        spi_xfer(W25Q_SPI, addr & 0xFF);
+    }
+}
+
+static void w25q_simple_command(uint8_t command)
+{
+    w25q_send_command(command, 0, false);
+    w25q_deselect();
+}
+
+static uint8_t w25q_read_status(void)
+{
+    w25q_send_command(W25Q_CMD_READ_STATUS, 0, false);
+    const uint8_t status = spi_xfer(W25Q_SPI, W25Q_DUMMY_BYTE);
+    w25q_deselect();
+
+    return status;
+}
+
+static void w25q_dma_setup(uint8_t channel, uint32_t memory, size_t size, bool increment)
+{
+    dma_channel_reset(W25Q_DMA, channel);
+    dma_set_peripheral_address(W25Q_DMA, channel, (uint32_t)&SPI_DR(W25Q_SPI));
+    dma_set_memory_address(W25Q_DMA, channel, memory);
+    dma_set_number_of_data(W25Q_DMA, channel, size);
+    dma_set_peripheral_size(W25Q_DMA, channel, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(W25Q_DMA, channel, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(W25Q_DMA, channel, DMA_CCR_PL_HIGH);
+    if (increment) {
+        dma_enable_memory_increment_mode(W25Q_DMA, channel);
+    } else {
+        dma_disable_memory_increment_mode(W25Q_DMA, channel);
+    }
+}
+
+/* Data phase after the command, Rx always runs too, its completion ends the transfer */
+static void w25q_start_transfer(const uint8_t *tx_data, uint8_t *rx_data, size_t size)
+{
+    w25q_dma_setup(W25Q_DMA_RX_CHANNEL, (uint32_t)((rx_data != NULL) ? rx_data : &ctx.rx_dummy), size, rx_data != NULL);
+    dma_set_read_from_peripheral(W25Q_DMA, W25Q_DMA_RX_CHANNEL);
+
+    w25q_dma_setup(W25Q_DMA_TX_CHANNEL, (uint32_t)((tx_data != NULL) ? tx_data : &ctx.tx_dummy), size, tx_data != NULL);
+    dma_set_read_from_memory(W25Q_DMA, W25Q_DMA_TX_CHANNEL);
+
+    dma_enable_channel(W25Q_DMA, W25Q_DMA_RX_CHANNEL);
+    dma_enable_channel(W25Q_DMA, W25Q_DMA_TX_CHANNEL);
+    spi_enable_rx_dma(W25Q_SPI);
+    spi_enable_tx_dma(W25Q_SPI);
+
+    ctx.transfer_active = true;
+}
+
+static bool w25q_is_transfer_done(void)
+{
+    return dma_get_interrupt_flag(W25Q_DMA, W25Q_DMA_RX_CHANNEL, DMA_TCIF);
+}
+
+static void w25q_end_transfer(void)
+{
+    spi_disable_tx_dma(W25Q_SPI);
+    spi_disable_rx_dma(W25Q_SPI);
+    dma_disable_channel(W25Q_DMA, W25Q_DMA_TX_CHANNEL);
+    dma_disable_channel(W25Q_DMA, W25Q_DMA_RX_CHANNEL);
+    dma_clear_interrupt_flags(W25Q_DMA, W25Q_DMA_RX_CHANNEL, DMA_TCIF);
+    dma_clear_interrupt_flags(W25Q_DMA, W25Q_DMA_TX_CHANNEL, DMA_TCIF);
+    w25q_deselect();
+
+    ctx.transfer_active = false;
+}
+
+static void w25q_start_chip_operation(void)
+{
+    ctx.chip_busy = true;
+    ctx.busy_start = system_get_ticks();
+}
+
+static void w25q_start_next_step(void)
+{
+    switch (ctx.op) {
+        case W25Q_OP_ERASE:
+            w25q_simple_command(W25Q_CMD_WRITE_ENABLE);
+            w25q_send_command(W25Q_CMD_SECTOR_ERASE, ctx.addr, true);
+            w25q_deselect();
+            w25q_start_chip_operation();
+
+            ctx.addr += W25Q_SECTOR_SIZE;
+            ctx.remaining -= W25Q_SECTOR_SIZE;
+            break;
+
+        case W25Q_OP_WRITE: {
+            /* Program wraps around within a page, so it never crosses the page boundary */
+            const size_t size = MIN(ctx.remaining, W25Q_PAGE_SIZE - (ctx.addr % W25Q_PAGE_SIZE));
+
+            w25q_simple_command(W25Q_CMD_WRITE_ENABLE);
+            w25q_send_command(W25Q_CMD_PAGE_PROGRAM, ctx.addr, true);
+            w25q_start_transfer(ctx.tx_data, NULL, size);
+            w25q_start_chip_operation();
+
+            ctx.addr += size;
+            ctx.tx_data += size;
+            ctx.remaining -= size;
+            break;
+        }
+
+        case W25Q_OP_READ: {
+            /* Reading continues across pages and sectors */
+            const size_t size = MIN(ctx.remaining, W25Q_DMA_MAX_COUNT);
+
+            w25q_send_command(W25Q_CMD_READ_DATA, ctx.addr, true);
+            w25q_start_transfer(NULL, ctx.rx_data, size);
+
+            ctx.addr += size;
+            ctx.rx_data += size;
+            ctx.remaining -= size;
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+static bool w25q_is_busy(void)
+{
+    if (ctx.transfer_active) {
+        if (!w25q_is_transfer_done()) {
+            return true;
+        }
+        w25q_end_transfer();
+    }
+
+    if (ctx.chip_busy) {
+        if ((w25q_read_status() & W25Q_STATUS_BUSY) == 0) {
+            ctx.chip_busy = false;
+        } else if ((system_get_ticks() - ctx.busy_start) > W25Q_BUSY_TIMEOUT_MS) {
+            /* Chip is gone or stuck, give the operation up */
+            ctx.chip_busy = false;
+            ctx.op = W25Q_OP_NONE;
+            ctx.result = -ETIMEDOUT;
+            return false;
+        } else {
+            return true;
+        }
+    }
+
+    if (ctx.op == W25Q_OP_NONE) {
+        return false;
+    }
+
+    if (ctx.remaining == 0) {
+        ctx.op = W25Q_OP_NONE;
+        return false;
+    }
+
+    w25q_start_next_step();
+    return true;
+}
+
+static int w25q_wait(void)
+{
+    while (w25q_is_busy()) {
+    }
+
+    const int result = ctx.result;
+    ctx.result = 0;
+
+    return result;
+}
+
+static int w25q_start(enum w25q_op_t op, size_t addr, const void *tx_data, void *rx_data, size_t size)
+{
+    if ((addr > ctx.size) || (size > (ctx.size - addr))) {
+        return -EINVAL;
+    }
+
+    const int result = w25q_wait();
+    if (result != 0) {
+        return result;
+    }
+
+    ctx.op = op;
+    ctx.addr = addr;
+    ctx.tx_data = tx_data;
+    ctx.rx_data = rx_data;
+    ctx.remaining = size;
+
+    (void)w25q_is_busy();
+    return 0;
+}
+
+static int w25q_erase(size_t addr, size_t size)
+{
+    if (((addr % W25Q_SECTOR_SIZE) != 0) || ((size % W25Q_SECTOR_SIZE) != 0)) {
+        return -EINVAL;
+    }
+
+    return w25q_start(W25Q_OP_ERASE, addr, NULL, NULL, size);
+}
+
+static int w25q_write(size_t addr, const void *data, size_t size)
+{
+    if (data == NULL) {
+        return -EINVAL;
+    }
+
+    return w25q_start(W25Q_OP_WRITE, addr, data, NULL, size);
+}
+
+static int w25q_read(size_t addr, void *data, size_t size)
+{
+    if (data == NULL) {
+        return -EINVAL;
+    }
+
+    return w25q_start(W25Q_OP_READ, addr, NULL, data, size);
+}
+
+static int w25q_init(void)
+{
+    ctx.op = W25Q_OP_NONE;
+    ctx.transfer_active = false;
+    ctx.chip_busy = false;
+    ctx.result = 0;
+    ctx.tx_dummy = W25Q_DUMMY_BYTE;
+
+    rcc_periph_clock_enable(W25Q_PORT_RCC);
+    rcc_periph_clock_enable(W25Q_SPI_RCC);
+    rcc_periph_clock_enable(W25Q_DMA_RCC);
+
+    /* CS is driven by software, it has to stay low for the whole command */
+    gpio_set(W25Q_PORT, W25Q_CS_PIN);
+    gpio_set_mode(W25Q_PORT, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, W25Q_CS_PIN);
+    gpio_set_mode(W25Q_PORT, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, W25Q_SCK_PIN | W25Q_MOSI_PIN);
+    gpio_set_mode(W25Q_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, W25Q_MISO_PIN);
+
+    /* Mode 0 at half of the core clock, well within the limit of the plain read command */
+    spi_reset(W25Q_SPI);
+    spi_init_master(W25Q_SPI, SPI_CR1_BAUDRATE_FPCLK_DIV_2, SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE,
+                    SPI_CR1_CPHA_CLK_TRANSITION_1, SPI_CR1_DFF_8BIT, SPI_CR1_MSBFIRST);
+    spi_enable_software_slave_management(W25Q_SPI);
+    spi_set_nss_high(W25Q_SPI);
+    spi_enable(W25Q_SPI);
+
+    /* Chip may have been left powered down, it needs 3us to wake up */
+    w25q_simple_command(W25Q_CMD_RELEASE_POWER_DOWN);
+    system_delay_ms(1);
+
+    w25q_send_command(W25Q_CMD_JEDEC_ID, 0, false);
+    const uint8_t manufacturer = spi_xfer(W25Q_SPI, W25Q_DUMMY_BYTE);
+    (void)spi_xfer(W25Q_SPI, W25Q_DUMMY_BYTE);
+    const uint8_t capacity = spi_xfer(W25Q_SPI, W25Q_DUMMY_BYTE);
+    w25q_deselect();
+
+    /* Floating or shorted MISO reads as all ones or zeros */
+    if ((manufacturer == 0x00) || (manufacturer == 0xFF) || (capacity < W25Q_CAPACITY_MIN) || (capacity > W25Q_CAPACITY_MAX)) {
+        ctx.size = 0;
+        return -ENODEV;
+    }
+
+    ctx.size = (size_t)1 << capacity;
+    return 0;
+}
+
+static void w25q_deinit(void)
+{
+    (void)w25q_wait();
+
+    spi_disable(W25Q_SPI);
+    rcc_periph_clock_disable(W25Q_DMA_RCC);
+    rcc_periph_clock_disable(W25Q_SPI_RCC);
+
+    gpio_set_mode(W25Q_PORT, GPIO_MODE_INPUT, GPIO_CNF_INPUT_FLOAT, W25Q_CS_PIN | W25Q_SCK_PIN | W25Q_MOSI_PIN | W25Q_MISO_PIN);
+}
+
+static size_t w25q_get_size(void)
+{
+    return ctx.size;
+}
+
+const struct storage_t w25q_storage = {
+    .erase_size = W25Q_SECTOR_SIZE,
+    .init = w25q_init,
+    .deinit = w25q_deinit,
+    .get_size = w25q_get_size,
+    .erase = w25q_erase,
+    .write = w25q_write,
+    .read = w25q_read,
+    .is_busy = w25q_is_busy,
+    .wait = w25q_wait,
+};
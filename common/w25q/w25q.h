@@ -0,0 +1,10 @@
+#pragma once
+
+#include <storage.h>
+
+/* Winbond W25Qxx-class SPI NOR flash on SPI1: SCK PA5, MISO PA6, MOSI PA7 and CS PA4.
+ * Data moves by DMA, program and erase run inside the chip, so the core stays free meanwhile. */
+#define W25Q_PAGE_SIZE 0x100
+#define W25Q_SECTOR_SIZE 0x1000
+
+extern const struct storage_t w25q_storage;
@@ -1,11 +1,20 @@
 #include <system.h>
 #include <uart.h>
 #include <timer.h>
+#include <boot_mode.h>
+#include <boot_services.h>
+#include <log.h>
 #include <string.h>
-#include <stdio.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
 
+#define LED_PERIOD_US 250000
+#define MSG_PERIOD_US 1000000
+
+/* Updater keeps sending this until the bootloader responds */
+#define UPDATE_SYNC_SEQUENCE "F103"
+#define UPDATE_SYNC_SEQUENCE_SIZE (sizeof(UPDATE_SYNC_SEQUENCE) - 1)
+
 static void led_init(void)
 {
     rcc_periph_clock_enable(RCC_GPIOC);
@@ -17,33 +26,63 @@ static void led_toggle(void)
     gpio_toggle(GPIOC, GPIO13);
 }
 
+static void led_timer_callback(void *arg)
+{
+    (void)arg;
+
+    led_toggle();
+}
+
+static void msg_timer_callback(void *arg)
+{
+    size_t *msg_counter = arg;
+
+    LOG("Hello World %u from signed binary!\n", *msg_counter);
+    ++(*msg_counter);
+}
+
+static void update_request_poll(char *sync_buffer)
+{
+    /* Hand over to the bootloader as soon as the updater shows up */
+    while (uart_data_available()) {
+        memmove(&sync_buffer[0], &sync_buffer[1], UPDATE_SYNC_SEQUENCE_SIZE - 1);
+        sync_buffer[UPDATE_SYNC_SEQUENCE_SIZE - 1] = uart_read_byte();
+
+        if (memcmp(sync_buffer, UPDATE_SYNC_SEQUENCE, UPDATE_SYNC_SEQUENCE_SIZE) == 0) {
+            boot_mode_request_update();
+        }
+    }
+}
+
 int main(void)
 {
     system_init();
     led_init();
     uart_init();
+    log_init();
 
-    struct timer_t led_timer;
-    struct timer_t uart_timer;
+    struct timer_event_t led_timer = {0};
+    struct timer_event_t msg_timer = {0};
+    size_t msg_counter = 0;
+    char sync_buffer[UPDATE_SYNC_SEQUENCE_SIZE] = {0};
 
-    timer_init(&led_timer, 250);
-    timer_init(&uart_timer, 1000);
+    /* Crypto and flash code can be borrowed from the bootloader instead of linking another copy */
+    const struct boot_services_t *services = boot_services_get(BOOT_SERVICES_VERSION);
+    if (services != NULL) {
+        LOG("Boot services available\n");
+    } else {
+        LOG("Boot services not available\n");
+    }
 
-    char msg_buffer[64];
-    size_t msg_counter = 0;
+    timer_event_start(&led_timer, LED_PERIOD_US, LED_PERIOD_US, led_timer_callback, NULL);
+    timer_event_start(&msg_timer, MSG_PERIOD_US, MSG_PERIOD_US, msg_timer_callback, &msg_counter);
 
     while (1) {
-        if (timer_has_elapsed(&led_timer)) {
-            led_toggle();
-            timer_reset(&led_timer);
-        }
+        timer_wheel_task();
+        update_request_poll(sync_buffer);
 
-        if (timer_has_elapsed(&uart_timer)) {
-            snprintf(msg_buffer, sizeof(msg_buffer), "Hello World %u from signed binary!\n", msg_counter);
-            ++msg_counter;
-            uart_write(msg_buffer, strlen(msg_buffer));
-            timer_reset(&uart_timer);
-        }
+        /* SysTick wakes the core up every tick, the wheel's alarm in between */
+        system_sleep();
     }
 }
 
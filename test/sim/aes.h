@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Stands in for tiny-AES-c in host tests. CBC chaining is real, the block cipher is just XOR with
+ * the key, so a block decrypted twice or out of order still comes out wrong. */
+#define AES_BLOCKLEN 16
+#define AES_KEYLEN 16
+
+struct AES_ctx
+{
+    uint8_t RoundKey[AES_KEYLEN];
+    uint8_t Iv[AES_BLOCKLEN];
+};
+
+void AES_init_ctx_iv(struct AES_ctx *ctx, const uint8_t *key, const uint8_t *iv);
+void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t *buf, size_t length);
+void AES_CBC_decrypt_buffer(struct AES_ctx *ctx, uint8_t *buf, size_t length);
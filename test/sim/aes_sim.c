@@ -0,0 +1,31 @@
+#include "aes.h"
+#include <string.h>
+
+void AES_init_ctx_iv(struct AES_ctx *ctx, const uint8_t *key, const uint8_t *iv)
+{
+    memcpy(ctx->RoundKey, key, AES_KEYLEN);
+    memcpy(ctx->Iv, iv, AES_BLOCKLEN);
+}
+
+void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t *buf, size_t length)
+{
+    for (size_t offset = 0; offset < length; offset += AES_BLOCKLEN) {
+        for (size_t i = 0; i < AES_BLOCKLEN; ++i) {
+            buf[offset + i] ^= ctx->Iv[i] ^ ctx->RoundKey[i];
+        }
+        memcpy(ctx->Iv, &buf[offset], AES_BLOCKLEN);
+    }
+}
+
+void AES_CBC_decrypt_buffer(struct AES_ctx *ctx, uint8_t *buf, size_t length)
+{
+    uint8_t next_iv[AES_BLOCKLEN];
+
+    for (size_t offset = 0; offset < length; offset += AES_BLOCKLEN) {
+        memcpy(next_iv, &buf[offset], AES_BLOCKLEN);
+        for (size_t i = 0; i < AES_BLOCKLEN; ++i) {
+            buf[offset + i] ^= ctx->Iv[i] ^ ctx->RoundKey[i];
+        }
+        memcpy(ctx->Iv, next_iv, AES_BLOCKLEN);
+    }
+}
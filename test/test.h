@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Stops the test at the first failed check, ctest reports the output */
+#define TEST_ASSERT(condition)                                                          \
+    do {                                                                                \
+        if (!(condition)) {                                                             \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(EXIT_FAILURE);                                                         \
+        }                                                                               \
+    } while (0)
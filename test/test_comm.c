@@ -0,0 +1,228 @@
+#include "test.h"
+#include <system_sim.h>
+#include <scheduler.h>
+#include <transport_sim.h>
+#include <comm.h>
+#include <string.h>
+
+/* Host's side of the link, written apart from comm so both don't share a mistake */
+static size_t test_encode_frame(const void *data, size_t size, uint8_t *frame)
+{
+    const uint8_t *data_ptr = data;
+    size_t code_index = 0;
+    size_t frame_size = 1;
+
+    for (size_t i = 0; i < size; ++i) {
+        if (data_ptr[i] == 0) {
+            frame[code_index] = frame_size - code_index;
+            code_index = frame_size++;
+        } else {
+            frame[frame_size++] = data_ptr[i];
+        }
+    }
+    frame[code_index] = frame_size - code_index;
+    frame[frame_size++] = 0;
+
+    return frame_size;
+}
+
+/* Returns decoded size of the next frame sent by the device, 0 if there's none */
+static size_t test_receive_frame(uint8_t *data)
+{
+    uint8_t frame[COMM_FRAME_MAX_SIZE];
+    size_t frame_size = 0;
+    size_t size = 0;
+
+    while ((frame_size < sizeof(frame)) && (transport_sim_pop_tx(&frame[frame_size], 1) == 1)) {
+        if (frame[frame_size++] == 0) {
+            break;
+        }
+    }
+    if ((frame_size == 0) || (frame[frame_size - 1] != 0)) {
+        return 0;
+    }
+
+    for (size_t i = 0; frame[i] != 0;) {
+        const size_t code = frame[i++];
+        for (size_t j = 1; j < code; ++j) {
+            data[size++] = frame[i++];
+        }
+        if ((code < 0xFF) && (frame[i] != 0)) {
+            data[size++] = 0;
+        }
+    }
+
+    return size;
+}
+
+static void test_send_packet(const struct comm_packet_t *packet)
+{
+    uint8_t frame[COMM_FRAME_MAX_SIZE];
+
+    const size_t frame_size = test_encode_frame(packet, COMM_PACKET_TOTAL_SIZE, frame);
+    TEST_ASSERT(transport_sim_push_rx(frame, frame_size) == frame_size);
+}
+
+static void test_run_pending(void)
+{
+    const uint32_t sleeps = system_sim_get_sleep_count();
+
+    /* Everything posted has been handled once the scheduler goes to sleep */
+    while (system_sim_get_sleep_count() == sleeps) {
+        scheduler_run();
+    }
+}
+
+static void test_packet_to_device(void)
+{
+    struct comm_packet_t sent;
+    struct comm_packet_t received;
+    const uint8_t echo_data[] = {0x00, 0x01, 0x00, 0xFF};
+
+    /* Zeros in the packet exercise the COBS code bytes */
+    TEST_ASSERT(comm_create_ctrl_packet(&sent, COMM_PACKET_OP_ECHO, echo_data, sizeof(echo_data)) == 0);
+    test_send_packet(&sent);
+    test_run_pending();
+
+    TEST_ASSERT(comm_packets_available());
+    comm_read(&received);
+    TEST_ASSERT(memcmp(&sent, &received, COMM_PACKET_TOTAL_SIZE) == 0);
+    TEST_ASSERT(!comm_packets_available());
+}
+
+static void test_packet_to_host(void)
+{
+    struct comm_packet_t sent;
+    struct comm_packet_t retx;
+    uint8_t data[COMM_FRAME_MAX_SIZE];
+    const uint32_t size = 0x00012000;
+
+    TEST_ASSERT(comm_create_ctrl_packet(&sent, COMM_PACKET_OP_FW_SIZE_REQUEST, &size, sizeof(size)) == 0);
+    comm_write(&sent);
+    TEST_ASSERT(test_receive_frame(data) == COMM_PACKET_TOTAL_SIZE);
+    TEST_ASSERT(memcmp(&sent, data, COMM_PACKET_TOTAL_SIZE) == 0);
+
+    /* Host asks for the last packet again, comm answers it on its own */
+    TEST_ASSERT(comm_create_ctrl_packet(&retx, COMM_PACKET_OP_RETX, NULL, 0) == 0);
+    test_send_packet(&retx);
+    test_run_pending();
+    TEST_ASSERT(!comm_packets_available());
+    TEST_ASSERT(test_receive_frame(data) == COMM_PACKET_TOTAL_SIZE);
+    TEST_ASSERT(memcmp(&sent, data, COMM_PACKET_TOTAL_SIZE) == 0);
+}
+
+static void test_fec_parity(void)
+{
+    struct comm_packet_t sent;
+    struct comm_packet_t received;
+    uint8_t data[COMM_FRAME_MAX_SIZE];
+
+    comm_set_fec(true);
+
+    /* Device's packets carry parity after the packet */
+    TEST_ASSERT(comm_create_ctrl_packet(&sent, COMM_PACKET_OP_ACK, NULL, 0) == 0);
+    comm_write(&sent);
+    TEST_ASSERT(test_receive_frame(data) == (COMM_PACKET_TOTAL_SIZE + REED_SOLOMON_PARITY_SIZE));
+    TEST_ASSERT(memcmp(&sent, data, COMM_PACKET_TOTAL_SIZE) == 0);
+
+    /* Packets without parity are still accepted */
+    test_send_packet(&sent);
+    test_run_pending();
+    TEST_ASSERT(comm_packets_available());
+    comm_read(&received);
+    TEST_ASSERT(memcmp(&sent, &received, COMM_PACKET_TOTAL_SIZE) == 0);
+
+    comm_set_fec(false);
+}
+
+/* Sends three packets with the middle frame damaged, returns how many retransmissions the device asked for */
+static size_t test_send_damaged(size_t position, bool insert, uint8_t value)
+{
+    struct comm_packet_t packets[3];
+    struct comm_packet_t received;
+    struct comm_packet_t retx;
+    uint8_t frame[COMM_FRAME_MAX_SIZE + 1];
+    uint8_t data[COMM_FRAME_MAX_SIZE];
+    size_t retx_count = 0;
+
+    for (size_t i = 0; i < 3; ++i) {
+        const uint8_t echo_data[] = {0x00, (uint8_t)i, 0x00, (uint8_t)position};
+        TEST_ASSERT(comm_create_ctrl_packet(&packets[i], COMM_PACKET_OP_ECHO, echo_data, sizeof(echo_data)) == 0);
+    }
+
+    test_send_packet(&packets[0]);
+    size_t frame_size = test_encode_frame(&packets[1], COMM_PACKET_TOTAL_SIZE, frame);
+    if (insert) {
+        memmove(&frame[position + 1], &frame[position], frame_size - position);
+        frame[position] = value;
+        ++frame_size;
+    } else {
+        memmove(&frame[position], &frame[position + 1], frame_size - position - 1);
+        --frame_size;
+    }
+    TEST_ASSERT(transport_sim_push_rx(frame, frame_size) == frame_size);
+    test_send_packet(&packets[2]);
+    test_run_pending();
+
+    /* Packets around the damaged one make it through */
+    comm_read(&received);
+    TEST_ASSERT(memcmp(&packets[0], &received, COMM_PACKET_TOTAL_SIZE) == 0);
+    comm_read(&received);
+    TEST_ASSERT(memcmp(&packets[2], &received, COMM_PACKET_TOTAL_SIZE) == 0);
+    TEST_ASSERT(!comm_packets_available());
+
+    TEST_ASSERT(comm_create_ctrl_packet(&retx, COMM_PACKET_OP_RETX, NULL, 0) == 0);
+    while (test_receive_frame(data) == COMM_PACKET_TOTAL_SIZE) {
+        TEST_ASSERT(memcmp(&retx, data, COMM_PACKET_TOTAL_SIZE) == 0);
+        ++retx_count;
+    }
+
+    return retx_count;
+}
+
+static void test_dropped_byte(void)
+{
+    struct comm_stats_t stats;
+
+    /* Delimiter is left out, without it the packet still completes on its size */
+    for (size_t position = 0; position < (COMM_PACKET_TOTAL_SIZE + 1); ++position) {
+        TEST_ASSERT(test_send_damaged(position, false, 0) == 1);
+    }
+
+    comm_get_stats(&stats);
+    TEST_ASSERT((stats.framing_errors + stats.crc_failures) == (COMM_PACKET_TOTAL_SIZE + 1));
+    comm_reset_stats();
+}
+
+static void test_inserted_byte(void)
+{
+    const uint8_t values[] = {0x01, 0x13, 0xFF};
+
+    /* Frame decodes to a whole packet early, CRC check rejects it and the rest is skipped.
+     * Byte inserted right before the delimiter comes after a complete packet, it isn't tried. */
+    for (size_t position = 0; position < (COMM_PACKET_TOTAL_SIZE + 1); ++position) {
+        for (size_t i = 0; i < sizeof(values); ++i) {
+            TEST_ASSERT(test_send_damaged(position, true, values[i]) == 1);
+        }
+    }
+
+    /* Inserted delimiter splits the frame, both halves are reported */
+    TEST_ASSERT(test_send_damaged(5, true, 0x00) == 2);
+    comm_reset_stats();
+}
+
+int main(void)
+{
+    system_init();
+    transport_sim.init();
+    comm_init(&transport_sim);
+    TEST_ASSERT(scheduler_add_task(comm_task, SCHEDULER_EVENT_RX) == 0);
+
+    test_packet_to_device();
+    test_packet_to_host();
+    test_fec_parity();
+    test_dropped_byte();
+    test_inserted_byte();
+
+    return EXIT_SUCCESS;
+}
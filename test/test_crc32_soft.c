@@ -0,0 +1,57 @@
+#include "test.h"
+#include <crc32.h>
+#include <string.h>
+
+/* Expected values are computed by crc32_stm32() in signer.py, which fills in the image header */
+struct test_vector_t
+{
+    const char *data;
+    size_t size;
+    uint32_t crc;
+};
+
+static const struct test_vector_t vectors[] = {
+    {"", 0, 0xFFFFFFFF},
+    {"\x00\x00\x00\x00", 4, 0xC704DD7B},
+    {"\x12\x34\x56\x78", 4, 0xAD37D056},
+    {"123456789", 9, 0xD9020D98},   // Trailing partial word is padded
+};
+
+#define TEST_PATTERN_SIZE 1027
+#define TEST_PATTERN_CRC 0x279A5E07 // Bytes counting up from 0, wrapping around
+
+static void test_vectors(void)
+{
+    for (size_t i = 0; i < (sizeof(vectors) / sizeof(vectors[0])); ++i) {
+        TEST_ASSERT(crc32_compute(vectors[i].data, vectors[i].size) == vectors[i].crc);
+    }
+}
+
+static void test_pattern_in_parts(void)
+{
+    uint8_t pattern[TEST_PATTERN_SIZE];
+
+    for (size_t i = 0; i < sizeof(pattern); ++i) {
+        pattern[i] = (uint8_t)i;
+    }
+    TEST_ASSERT(crc32_compute(pattern, sizeof(pattern)) == TEST_PATTERN_CRC);
+
+    /* Staging writes whole buffers and the rest at the end */
+    crc32_reset();
+    crc32_write(pattern, 512);
+    crc32_write(&pattern[512], 4);
+    crc32_write(&pattern[516], sizeof(pattern) - 516);
+    TEST_ASSERT(crc32_read() == TEST_PATTERN_CRC);
+}
+
+int main(void)
+{
+    crc32_init();
+
+    test_vectors();
+    test_pattern_in_parts();
+
+    crc32_deinit();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,354 @@
+#include "test_host.h"
+#include "test.h"
+#include <system_sim.h>
+#include <transport_sim.h>
+#include <flash_sim.h>
+#include <crc32.h>
+#include <keys.h>
+#include <aes.h>
+#include <update.h>
+#include <utils.h>
+#include <string.h>
+
+#define TEST_HOST_HANDSHAKE_VERSION 2
+#define TEST_HOST_PAGE_DATA_SIZE (COMM_CTRL_PACKET_MAX_DATA_SIZE - 1)
+
+/* Device's packets wait here until the latency has passed */
+#define TEST_HOST_QUEUE_SIZE 32
+
+static const uint8_t test_host_sync[] = {0x46, 0x31, 0x30, 0x33};
+
+struct test_host_queue_t
+{
+    struct comm_packet_t packets[TEST_HOST_QUEUE_SIZE];
+    uint32_t times_us[TEST_HOST_QUEUE_SIZE];
+    size_t head;
+    size_t count;
+    bool pushed;        // Something has been sent to the device since the last sleep
+    uint32_t programmed_base;
+    uint32_t programmed[TEST_HOST_MAX_EVENTS];
+    size_t written;
+};
+
+struct test_host_t test_host;
+static struct test_host_queue_t queue;
+static struct transport_t test_host_transport;
+
+/* Device writes each frame at once, how far the programming got is noted right then */
+static void test_host_write(const void *data, size_t size)
+{
+    if (queue.written < TEST_HOST_MAX_EVENTS) {
+        queue.programmed[queue.written++] = flash_sim_get_programmed_bytes() - queue.programmed_base;
+    }
+    transport_sim.write(data, size);
+}
+
+static size_t test_host_encode_frame(const void *data, size_t size, uint8_t *frame)
+{
+    const uint8_t *data_ptr = data;
+    size_t code_index = 0;
+    size_t frame_size = 1;
+
+    for (size_t i = 0; i < size; ++i) {
+        if (data_ptr[i] == 0) {
+            frame[code_index] = frame_size - code_index;
+            code_index = frame_size++;
+        } else {
+            frame[frame_size++] = data_ptr[i];
+        }
+    }
+    frame[code_index] = frame_size - code_index;
+    frame[frame_size++] = 0;
+
+    return frame_size;
+}
+
+/* Returns false if the device hasn't sent a whole frame */
+static bool test_host_receive_packet(struct comm_packet_t *packet)
+{
+    uint8_t frame[COMM_FRAME_MAX_SIZE];
+    uint8_t *data = (uint8_t *)packet;
+    size_t frame_size = 0;
+    size_t size = 0;
+
+    while ((frame_size < sizeof(frame)) && (transport_sim_pop_tx(&frame[frame_size], 1) == 1)) {
+        if (frame[frame_size++] == 0) {
+            break;
+        }
+    }
+    if (frame_size == 0) {
+        return false;
+    }
+    TEST_ASSERT(frame[frame_size - 1] == 0);
+
+    for (size_t i = 0; frame[i] != 0;) {
+        const size_t code = frame[i++];
+        for (size_t j = 1; j < code; ++j) {
+            TEST_ASSERT(size < COMM_PACKET_TOTAL_SIZE);
+            data[size++] = frame[i++];
+        }
+        if ((code < 0xFF) && (frame[i] != 0)) {
+            TEST_ASSERT(size < COMM_PACKET_TOTAL_SIZE);
+            data[size++] = 0;
+        }
+    }
+
+    /* Device's packets have to be intact, the link itself never damages them */
+    TEST_ASSERT(size == COMM_PACKET_TOTAL_SIZE);
+    TEST_ASSERT(packet->crc.value == comm_compute_crc(packet));
+
+    return true;
+}
+
+static void test_host_send_packet(const struct comm_packet_t *packet, bool damage)
+{
+    uint8_t frame[COMM_FRAME_MAX_SIZE];
+    size_t frame_size = test_host_encode_frame(packet, COMM_PACKET_TOTAL_SIZE, frame);
+
+    /* Byte lost in the middle of the frame */
+    if (damage) {
+        memmove(&frame[5], &frame[6], frame_size - 6);
+        --frame_size;
+    }
+
+    TEST_ASSERT(transport_sim_push_rx(frame, frame_size) == frame_size);
+    queue.pushed = true;
+}
+
+static void test_host_send_ctrl(enum comm_packet_op_t op, const void *data, size_t size)
+{
+    struct comm_packet_t packet;
+
+    TEST_ASSERT(comm_create_ctrl_packet(&packet, op, data, size) == 0);
+    test_host_send_packet(&packet, false);
+}
+
+static void test_host_send_data(void)
+{
+    while (test_host.session_acked && !test_host.done && (test_host.in_flight < test_host.caps.credits) &&
+           (test_host.offset < test_host.file_size)) {
+        struct comm_packet_t packet;
+        const uint8_t size = MIN(test_host.file_size - test_host.offset, COMM_PACKET_PAYLOAD_SIZE);
+
+        memset(&packet, 0, sizeof(packet));
+        comm_set_packet_type(&packet, COMM_PACKET_DATA);
+        comm_set_packet_length(&packet, size);
+        memcpy(packet.payload, &test_host.file[test_host.offset], size);
+        packet.crc.value = comm_compute_crc(&packet);
+
+        if (test_host.offset == test_host.drop_offset) {
+            test_host.drop_offset = 0;
+        } else {
+            test_host_send_packet(&packet, test_host.offset == test_host.damage_offset);
+            if (test_host.offset == test_host.damage_offset) {
+                test_host.damage_offset = 0;
+            }
+        }
+
+        test_host.offset += size;
+        ++test_host.in_flight;
+    }
+}
+
+static void test_host_handle_packet(const struct comm_packet_t *packet, const struct test_host_event_t *event)
+{
+    switch (event->op) {
+        case COMM_PACKET_OP_ACK:
+            if (!test_host.session_acked) {
+                TEST_ASSERT(event->length == (1 + sizeof(test_host.caps)));
+                memcpy(&test_host.caps, &packet->payload[1], sizeof(test_host.caps));
+                test_host.session_acked = true;
+            } else if (test_host.in_flight > 0) {
+                --test_host.in_flight;
+            }
+            break;
+
+        case COMM_PACKET_OP_REWIND:
+            /* Everything before the offset has been taken, the rest is sent again */
+            test_host.offset = event->value;
+            test_host.in_flight = 0;
+            test_host_send_ctrl(COMM_PACKET_OP_REWIND, &event->value, sizeof(event->value));
+            break;
+
+        case COMM_PACKET_OP_FW_UPDATE_DONE:
+            test_host.done = true;
+            test_host_send_ctrl(COMM_PACKET_OP_SESSION_END, NULL, 0);
+            break;
+
+        default:
+            break;
+    }
+
+    test_host_send_data();
+}
+
+static void test_host_record(const struct comm_packet_t *packet, struct test_host_event_t *event)
+{
+    memset(event, 0, sizeof(*event));
+    event->op = packet->payload[0];
+    event->length = comm_get_packet_length(packet);
+    event->time_us = system_get_us();
+    event->programmed = queue.programmed[test_host.event_count];
+
+    if (event->op == COMM_PACKET_OP_ACK) {
+        ++test_host.acks;
+    } else if (event->op == COMM_PACKET_OP_REWIND) {
+        memcpy(&event->value, &packet->payload[1], sizeof(event->value));
+        ++test_host.rewinds;
+    } else if (event->op == COMM_PACKET_OP_NACK) {
+        event->value = packet->payload[1];
+        test_host.nacked = true;
+        test_host.nack_reason = packet->payload[1];
+    }
+
+    TEST_ASSERT(test_host.event_count < TEST_HOST_MAX_EVENTS);
+    test_host.events[test_host.event_count++] = *event;
+}
+
+static bool test_host_run(void)
+{
+    struct comm_packet_t packet;
+
+    queue.pushed = false;
+
+    /* Everything the device has sent arrives now, the answers go out once the latency has passed */
+    while (test_host_receive_packet(&packet)) {
+        struct test_host_event_t event;
+        test_host_record(&packet, &event);
+        if (test_host.on_packet != NULL) {
+            test_host.on_packet(&event);
+        }
+
+        if (!test_host.silent) {
+            TEST_ASSERT(queue.count < TEST_HOST_QUEUE_SIZE);
+            const size_t index = (queue.head + queue.count++) % TEST_HOST_QUEUE_SIZE;
+            queue.packets[index] = packet;
+            queue.times_us[index] = event.time_us;
+        }
+    }
+
+    while ((queue.count > 0) && ((system_get_us() - queue.times_us[queue.head]) >= test_host.latency_us)) {
+        struct test_host_event_t event;
+        const struct comm_packet_t *queued = &queue.packets[queue.head];
+
+        /* Event is already recorded, it's only decoded again */
+        event.op = queued->payload[0];
+        event.length = comm_get_packet_length(queued);
+        memcpy(&event.value, &queued->payload[1], sizeof(event.value));
+        test_host_handle_packet(queued, &event);
+
+        queue.head = (queue.head + 1) % TEST_HOST_QUEUE_SIZE;
+        --queue.count;
+    }
+
+    return queue.pushed;
+}
+
+void test_host_build_image(size_t code_size, uint8_t seed)
+{
+    struct fw_header_t header;
+    struct AES_ctx aes;
+    uint8_t *code = &test_host.image[sizeof(header)];
+
+    TEST_ASSERT(code_size <= FW_CODE_MAX_SIZE);
+    for (size_t i = 0; i < code_size; ++i) {
+        code[i] = (uint8_t)((i * 13) + seed);
+    }
+
+    memset(&header, 0xFF, sizeof(header));
+    for (size_t i = 0; i < FW_AES128_IV_SIZE; ++i) {
+        header.aes_iv[i] = (uint8_t)(seed + i);
+    }
+    header.version = seed;
+    header.device_id = FW_DEVICE_ID;
+    header.length = code_size;
+    memset(header.ecdsa_signature, 0, sizeof(header.ecdsa_signature));
+    header.crc32 = crc32_compute(code, code_size);
+    memcpy(test_host.image, &header, sizeof(header));
+
+    /* Everything after the IV is encrypted, PKCS7 always adds padding */
+    const size_t plain_size = sizeof(header) - FW_AES128_IV_SIZE + code_size;
+    const size_t encrypted_size = ((plain_size / AES_BLOCKLEN) + 1) * AES_BLOCKLEN;
+    const uint8_t padding = encrypted_size - plain_size;
+    TEST_ASSERT((FW_AES128_IV_SIZE + encrypted_size) <= sizeof(test_host.image));
+    memset(&test_host.image[FW_AES128_IV_SIZE + plain_size], padding, padding);
+
+    test_host.file_size = FW_AES128_IV_SIZE + encrypted_size;
+    memcpy(test_host.file, test_host.image, test_host.file_size);
+    AES_init_ctx_iv(&aes, aes_key, header.aes_iv);
+    AES_CBC_encrypt_buffer(&aes, &test_host.file[FW_AES128_IV_SIZE], encrypted_size);
+
+    memset(&test_host.request, 0, sizeof(test_host.request));
+    test_host.request.version = TEST_HOST_HANDSHAKE_VERSION;
+    test_host.request.device_id = FW_DEVICE_ID;
+    test_host.request.credits = TEST_HOST_DEFAULT_CREDITS;
+    test_host.request.file_size = test_host.file_size;
+    memcpy(test_host.request.aes_iv, header.aes_iv, FW_AES128_IV_SIZE);
+}
+
+void test_host_start(void)
+{
+    const uint8_t *request = (const uint8_t *)&test_host.request;
+    const uint8_t delimiter = 0;
+
+    /* Device's writes go through the host first, otherwise it's the simulated link as is */
+    test_host_transport = transport_sim;
+    test_host_transport.write = test_host_write;
+    transport_sim.init();
+    comm_init(&test_host_transport);
+    memset(&queue, 0, sizeof(queue));
+    queue.programmed_base = flash_sim_get_programmed_bytes();
+
+    test_host.latency_us = 0;
+    test_host.silent = false;
+    test_host.damage_offset = 0;
+    test_host.drop_offset = 0;
+    test_host.on_packet = NULL;
+    test_host.session_acked = false;
+    test_host.offset = FW_AES128_IV_SIZE;
+    test_host.in_flight = 0;
+    test_host.acks = 0;
+    test_host.rewinds = 0;
+    test_host.done = false;
+    test_host.nacked = false;
+    test_host.event_count = 0;
+
+    /* Empty frame flushes the sync sequence on device's side, the request follows right away */
+    TEST_ASSERT(transport_sim_push_rx(test_host_sync, sizeof(test_host_sync)) == sizeof(test_host_sync));
+    TEST_ASSERT(transport_sim_push_rx(&delimiter, sizeof(delimiter)) == sizeof(delimiter));
+    for (size_t offset = 0; offset < sizeof(test_host.request); offset += TEST_HOST_PAGE_DATA_SIZE) {
+        uint8_t page[COMM_CTRL_PACKET_MAX_DATA_SIZE];
+        const size_t size = MIN(sizeof(test_host.request) - offset, TEST_HOST_PAGE_DATA_SIZE);
+
+        page[0] = offset / TEST_HOST_PAGE_DATA_SIZE;
+        memcpy(&page[1], &request[offset], size);
+        test_host_send_ctrl(COMM_PACKET_OP_SESSION_REQUEST, page, size + 1);
+    }
+
+    system_sim_set_idle_hook(test_host_run);
+}
+
+void test_host_run_session(void)
+{
+    update_run(UPDATE_MODE_REQUESTED);
+
+    /* Device doesn't listen anymore */
+    test_host.silent = true;
+    (void)test_host_run();
+    system_sim_set_idle_hook(NULL);
+}
+
+bool test_host_image_is_programmed(size_t size)
+{
+    uint8_t programmed[COMM_PACKET_PAYLOAD_SIZE];
+
+    for (size_t offset = 0; offset < size; offset += sizeof(programmed)) {
+        const size_t chunk = MIN(size - offset, sizeof(programmed));
+        flash_read(FLASH_MAIN_APP_START + offset, programmed, chunk);
+        if (memcmp(programmed, &test_host.image[offset], chunk) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <comm.h>
+#include <flash.h>
+#include <firmware_info.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* Simulated update script on the other end of transport_sim. It runs whenever the device goes to sleep
+ * and, like the real one, keeps as many data packets in flight as the device gave it credits for. */
+#define TEST_HOST_DEFAULT_CREDITS 8
+#define TEST_HOST_MAX_EVENTS 256
+
+/* Written apart from the device's definitions, so both don't share a mistake */
+struct test_session_request_t
+{
+    uint8_t version;
+    uint8_t device_id;
+    uint8_t credits;
+    uint8_t options;
+    uint8_t flags;
+    uint32_t file_size;
+    uint8_t aes_iv[FW_AES128_IV_SIZE];
+} __attribute__((packed));
+
+struct test_session_caps_t
+{
+    uint8_t version;
+    uint8_t credits;
+    uint8_t options;
+    uint8_t max_frame_size;
+    uint32_t bit_rate;
+    uint8_t compression;
+    uint8_t encryption;
+    uint32_t free_flash;
+} __attribute__((packed));
+
+/* Packet received from the device */
+struct test_host_event_t
+{
+    uint8_t op;
+    uint8_t length;         // Payload length, operation code included
+    uint32_t time_us;
+    uint32_t value;         // Offset of a rewind, reason of a NACK
+    uint32_t programmed;    // Bytes the device had programmed in this session when it sent the packet
+};
+
+struct test_host_t
+{
+    /* Set by the test, the request is filled in for the built image */
+    struct test_session_request_t request;
+    uint32_t latency_us;    // Device's packets are answered this much later
+    bool silent;            // Device's packets are recorded, but not answered
+    uint32_t damage_offset; // Data packet at this file offset loses a byte of its frame once, 0 for none
+    uint32_t drop_offset;   // Data packet at this file offset is not sent once, 0 for none
+    void (*on_packet)(const struct test_host_event_t *event);
+
+    /* Signed file and what the device is expected to program from it */
+    uint8_t file[FLASH_MAIN_APP_MAX_SIZE];
+    uint8_t image[FLASH_MAIN_APP_MAX_SIZE];
+    uint32_t file_size;
+
+    /* Session progress */
+    bool session_acked;
+    struct test_session_caps_t caps;
+    uint32_t offset;
+    uint32_t in_flight;
+    uint32_t acks;
+    uint32_t rewinds;
+    bool done;
+    bool nacked;
+    uint8_t nack_reason;
+    struct test_host_event_t events[TEST_HOST_MAX_EVENTS];
+    size_t event_count;
+};
+
+extern struct test_host_t test_host;
+
+/* Makes an image with a valid header and given code size, encrypts it into the file and fills in the request */
+void test_host_build_image(size_t code_size, uint8_t seed);
+
+/* Resets the link and sends the sync sequence with the session request right behind it */
+void test_host_start(void);
+
+/* Runs the device's update mode until it ends, what it sent right before is collected then too */
+void test_host_run_session(void);
+
+/* Checks the device's flash against the first size bytes of the expected image */
+bool test_host_image_is_programmed(size_t size);
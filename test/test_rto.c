@@ -0,0 +1,147 @@
+#include "test.h"
+#include "test_host.h"
+#include <system_sim.h>
+#include <crc32.h>
+#include <rto.h>
+
+/* Same as in update.c */
+#define TEST_RTO_MAX_US 2000000
+#define TEST_RTO_MAX_RETRIES 6
+
+#define TEST_CODE_SIZE 1000
+#define TEST_LATENCY_US 20000
+
+/* Timeouts expire on the timer wheel tick, on top of that the host answers on the next wake-up */
+#define TEST_TOLERANCE_US 1000
+
+static bool test_is_near(uint32_t value, uint32_t expected)
+{
+    return (value + TEST_TOLERANCE_US >= expected) && (value <= expected + TEST_TOLERANCE_US);
+}
+
+static uint32_t test_get_gap(uint8_t op_from, size_t nth_from, uint8_t op_to, size_t nth_to)
+{
+    const struct test_host_event_t *from = NULL;
+    const struct test_host_event_t *to = NULL;
+
+    for (size_t i = 0; i < test_host.event_count; ++i) {
+        if ((test_host.events[i].op == op_from) && (nth_from-- == 0)) {
+            from = &test_host.events[i];
+        }
+        if ((test_host.events[i].op == op_to) && (nth_to-- == 0)) {
+            to = &test_host.events[i];
+        }
+    }
+    TEST_ASSERT((from != NULL) && (to != NULL));
+
+    return to->time_us - from->time_us;
+}
+
+static uint32_t test_get_rewind_gap(size_t nth)
+{
+    return test_get_gap(COMM_PACKET_OP_REWIND, nth, COMM_PACKET_OP_REWIND, nth + 1);
+}
+
+static void test_estimator(void)
+{
+    struct rto_t rto;
+
+    rto_init(&rto, 1000000, 50000, TEST_RTO_MAX_US);
+    TEST_ASSERT(rto_get_timeout(&rto) == 1000000);
+
+    /* First sample sets the variance to half of it */
+    rto_sample(&rto, 20000);
+    TEST_ASSERT(rto_get_timeout(&rto) == 60000);
+
+    /* Steady round trip shrinks the variance, the minimum holds the timeout back */
+    for (size_t i = 0; i < 32; ++i) {
+        rto_sample(&rto, 20000);
+    }
+    TEST_ASSERT(rto_get_timeout(&rto) == 50000);
+
+    rto_backoff(&rto);
+    TEST_ASSERT(rto_get_timeout(&rto) == 100000);
+    for (size_t i = 0; i < 8; ++i) {
+        rto_backoff(&rto);
+    }
+    TEST_ASSERT(rto_get_timeout(&rto) == TEST_RTO_MAX_US);
+}
+
+static void test_start_session(void)
+{
+    test_host_build_image(TEST_CODE_SIZE, 1);
+    test_host_start();
+    test_host.latency_us = TEST_LATENCY_US;
+
+    /* Nothing follows the last packet, the device has to time out */
+    test_host.drop_offset = test_host.file_size - COMM_PACKET_PAYLOAD_SIZE;
+}
+
+static void test_silent_after_rewind(const struct test_host_event_t *event)
+{
+    if (event->op == COMM_PACKET_OP_REWIND) {
+        test_host.silent = true;
+    }
+}
+
+static void test_backoff(void)
+{
+    test_start_session();
+    test_host.on_packet = test_silent_after_rewind;
+
+    test_host_run_session();
+
+    /* Host is gone, the device gives up after its retries */
+    TEST_ASSERT(test_host.rewinds == TEST_RTO_MAX_RETRIES);
+    TEST_ASSERT(test_host.nacked && (test_host.nack_reason == COMM_NACK_TIMEOUT));
+
+    /* Each rewind doubles the timeout until it hits the maximum */
+    for (size_t i = 1; i < (TEST_RTO_MAX_RETRIES - 1); ++i) {
+        TEST_ASSERT(test_is_near(test_get_rewind_gap(i), 2 * test_get_rewind_gap(i - 1)));
+    }
+    TEST_ASSERT(test_get_rewind_gap(TEST_RTO_MAX_RETRIES - 2) < TEST_RTO_MAX_US);
+    TEST_ASSERT(test_is_near(test_get_gap(COMM_PACKET_OP_REWIND, TEST_RTO_MAX_RETRIES - 1, COMM_PACKET_OP_NACK, 0),
+                             TEST_RTO_MAX_US));
+}
+
+static void test_answer_repeated_rewind(const struct test_host_event_t *event)
+{
+    if (event->op != COMM_PACKET_OP_REWIND) {
+        return;
+    }
+
+    /* First of each pair goes unanswered, the packet sent after the second one is lost once more */
+    test_host.silent = ((test_host.rewinds % 2) != 0);
+    if (test_host.rewinds == 2) {
+        test_host.drop_offset = event->value;
+    }
+}
+
+static void test_karn(void)
+{
+    test_start_session();
+    test_host.on_packet = test_answer_repeated_rewind;
+
+    test_host_run_session();
+
+    TEST_ASSERT(test_host.done && !test_host.nacked);
+    TEST_ASSERT(test_host.rewinds == 4);
+    TEST_ASSERT(test_host_image_is_programmed(test_host.file_size));
+
+    /* Answer to the second rewind can't tell which of the two it answers, it's not taken as
+     * a round trip sample. The backed off timeout stays and keeps doubling. */
+    TEST_ASSERT(test_is_near(test_get_rewind_gap(1), 2 * test_get_rewind_gap(0)));
+    TEST_ASSERT(test_is_near(test_get_rewind_gap(2), 2 * test_get_rewind_gap(1)));
+}
+
+int main(void)
+{
+    system_init();
+    crc32_init();
+
+    test_estimator();
+    test_backoff();
+    test_karn();
+
+    return EXIT_SUCCESS;
+}
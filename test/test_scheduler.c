@@ -0,0 +1,70 @@
+#include "test.h"
+#include <system_sim.h>
+#include <scheduler.h>
+
+struct test_ctx_t
+{
+    uint32_t order[4];
+    uint32_t runs;
+};
+
+static struct test_ctx_t ctx;
+
+static void test_rx_task(void)
+{
+    ctx.order[ctx.runs++] = SCHEDULER_EVENT_RX;
+}
+
+static void test_timer_task(void)
+{
+    ctx.order[ctx.runs++] = SCHEDULER_EVENT_TIMER;
+}
+
+static void test_task_dispatch(void)
+{
+    system_init();
+    scheduler_remove_tasks();
+    ctx.runs = 0;
+    TEST_ASSERT(scheduler_add_task(test_timer_task, SCHEDULER_EVENT_TIMER) == 0);
+    TEST_ASSERT(scheduler_add_task(test_rx_task, SCHEDULER_EVENT_RX | SCHEDULER_EVENT_FLASH_READY) == 0);
+
+    /* Tasks waiting for the posted events run once, in the order they have been added */
+    scheduler_post_event(SCHEDULER_EVENT_RX);
+    scheduler_post_event(SCHEDULER_EVENT_TIMER);
+    scheduler_post_event(SCHEDULER_EVENT_RX);
+    scheduler_run();
+    TEST_ASSERT(ctx.runs == 2);
+    TEST_ASSERT(ctx.order[0] == SCHEDULER_EVENT_TIMER);
+    TEST_ASSERT(ctx.order[1] == SCHEDULER_EVENT_RX);
+
+    /* Events are consumed, the core sleeps until SysTick wakes the timer task */
+    scheduler_run();
+    TEST_ASSERT(ctx.runs == 2);
+    TEST_ASSERT(system_sim_get_sleep_count() == 1);
+    TEST_ASSERT(system_get_us() == 1000);
+    scheduler_run();
+    TEST_ASSERT(ctx.runs == 3);
+    TEST_ASSERT(ctx.order[2] == SCHEDULER_EVENT_TIMER);
+
+    TEST_ASSERT(scheduler_add_task(NULL, SCHEDULER_EVENT_RX) != 0);
+}
+
+static void test_delay_sleeps(void)
+{
+    system_init();
+
+    /* Partial tick at the start counts as one, like on the target */
+    system_sim_advance_us(300);
+    system_delay_ms(5);
+    TEST_ASSERT(system_get_ticks() == 5);
+    TEST_ASSERT(system_get_us() == 5000);
+    TEST_ASSERT(system_sim_get_sleep_count() == 5);
+}
+
+int main(void)
+{
+    test_task_dispatch();
+    test_delay_sleeps();
+
+    return EXIT_SUCCESS;
+}
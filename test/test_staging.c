@@ -0,0 +1,148 @@
+#include "test.h"
+#include <system_sim.h>
+#include <flash_sim.h>
+#include <storage_sim.h>
+#include <staging.h>
+#include <utils.h>
+#include <string.h>
+#include <errno.h>
+
+/* Created in the working directory, erased at the start of each run */
+#define TEST_STORAGE_PATH "test_staging.bin"
+
+/* Not a multiple of anything, so the last buffer and the last word are partial */
+#define TEST_IMAGE_SIZE 5003
+
+/* Packets carry this much data, like during an update */
+#define TEST_CHUNK_SIZE 16
+
+static uint8_t test_image[TEST_IMAGE_SIZE];
+static uint8_t test_readback[TEST_IMAGE_SIZE];
+
+static void test_fill(uint8_t *data, size_t size, uint8_t seed)
+{
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = (uint8_t)((i * 7) + seed);
+    }
+}
+
+static void test_reboot(void)
+{
+    staging_deinit();
+    TEST_ASSERT(staging_init(&storage_sim) == 0);
+}
+
+static void test_download(size_t size)
+{
+    TEST_ASSERT(staging_begin(TEST_IMAGE_SIZE) == 0);
+
+    for (size_t offset = 0; offset < size; offset += TEST_CHUNK_SIZE) {
+        const size_t chunk = MIN(TEST_CHUNK_SIZE, size - offset);
+        int result;
+
+        /* Storage may still be writing the other buffer */
+        while ((result = staging_write(&test_image[offset], chunk)) == -EBUSY) {
+            staging_poll();
+        }
+        TEST_ASSERT(result == 0);
+    }
+}
+
+static bool test_installed_is(const uint8_t *image)
+{
+    flash_read(FLASH_MAIN_APP_START, test_readback, TEST_IMAGE_SIZE);
+    return memcmp(test_readback, image, TEST_IMAGE_SIZE) == 0;
+}
+
+static void test_install(void)
+{
+    uint8_t installed[TEST_IMAGE_SIZE];
+
+    /* Some older image is installed */
+    test_fill(installed, sizeof(installed), 0x5A);
+    TEST_ASSERT(flash_write(FLASH_MAIN_APP_START, installed, sizeof(installed)) == 0);
+
+    /* Nothing staged, nothing to do */
+    TEST_ASSERT(staging_install() == 0);
+    TEST_ASSERT(test_installed_is(installed));
+
+    /* Installed image stays intact until the staged one is complete and the device restarts */
+    test_fill(test_image, sizeof(test_image), 0x11);
+    test_download(TEST_IMAGE_SIZE);
+    TEST_ASSERT(staging_commit() == 0);
+    TEST_ASSERT(test_installed_is(installed));
+
+    test_reboot();
+    TEST_ASSERT(staging_install() == 0);
+    TEST_ASSERT(test_installed_is(test_image));
+
+    /* Mark is cleared, the next start doesn't install it again */
+    const uint32_t erase_count = flash_sim_get_erase_count();
+    test_reboot();
+    TEST_ASSERT(staging_install() == 0);
+    TEST_ASSERT(flash_sim_get_erase_count() == erase_count);
+}
+
+static void test_interrupted_download(void)
+{
+    uint8_t installed[TEST_IMAGE_SIZE];
+
+    memcpy(installed, test_image, sizeof(installed));
+    test_fill(test_image, sizeof(test_image), 0x22);
+
+    /* Without commit the image is never marked complete */
+    test_download(TEST_IMAGE_SIZE / 2);
+    test_reboot();
+    TEST_ASSERT(staging_install() == 0);
+    TEST_ASSERT(test_installed_is(installed));
+
+    /* Image shorter than announced can't be committed */
+    test_download(TEST_IMAGE_SIZE / 2);
+    TEST_ASSERT(staging_commit() != 0);
+    test_reboot();
+    TEST_ASSERT(staging_install() == 0);
+    TEST_ASSERT(test_installed_is(installed));
+}
+
+static void test_corrupted_image(void)
+{
+    const uint8_t corruption = 0x00;
+    uint8_t installed[TEST_IMAGE_SIZE];
+
+    flash_read(FLASH_MAIN_APP_START, installed, sizeof(installed));
+    test_fill(test_image, sizeof(test_image), 0x33);
+    test_download(TEST_IMAGE_SIZE);
+    TEST_ASSERT(staging_commit() == 0);
+
+    /* Staged copy gets damaged after commit, it's refused and discarded */
+    TEST_ASSERT(storage_sim.write(storage_sim.erase_size + 100, &corruption, sizeof(corruption)) == 0);
+    TEST_ASSERT(storage_sim.wait() == 0);
+    test_reboot();
+    TEST_ASSERT(staging_install() == -EIO);
+    TEST_ASSERT(test_installed_is(installed));
+    TEST_ASSERT(staging_install() == 0);
+}
+
+static void test_invalid_size(void)
+{
+    TEST_ASSERT(staging_begin(0) == -EINVAL);
+    TEST_ASSERT(staging_begin(FLASH_MAIN_APP_MAX_SIZE + 1) == -EINVAL);
+}
+
+int main(void)
+{
+    system_init();
+    (void)remove(TEST_STORAGE_PATH);
+    storage_sim_set_path(TEST_STORAGE_PATH);
+    TEST_ASSERT(staging_init(&storage_sim) == 0);
+
+    test_install();
+    test_interrupted_download();
+    test_corrupted_image();
+    test_invalid_size();
+
+    staging_deinit();
+    (void)remove(TEST_STORAGE_PATH);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#include "test.h"
+#include <system_sim.h>
+#include <scheduler.h>
+#include <timer.h>
+
+struct test_ctx_t
+{
+    uint32_t calls;
+    uint32_t last_call_us;
+};
+
+static void test_callback(void *arg)
+{
+    struct test_ctx_t *ctx = arg;
+
+    ++ctx->calls;
+    ctx->last_call_us = system_get_us();
+}
+
+/* Events due at the end are handled too */
+static void test_run_until(uint32_t end_us)
+{
+    while ((int32_t)(system_get_us() - end_us) <= 0) {
+        scheduler_run();
+    }
+}
+
+static void test_sub_ms_timeout(void)
+{
+    struct timer_event_t event = {0};
+    struct test_ctx_t ctx = {0};
+
+    /* Rounded up to the next wheel tick, and called right on it instead of on the next SysTick */
+    TEST_ASSERT(timer_event_start(&event, 300, 0, test_callback, &ctx) == 0);
+    test_run_until(2000);
+    TEST_ASSERT(ctx.calls == 1);
+    TEST_ASSERT(ctx.last_call_us == 500);
+    TEST_ASSERT(!timer_event_is_active(&event));
+}
+
+static void test_periodic(void)
+{
+    struct timer_event_t event = {0};
+    struct test_ctx_t ctx = {0};
+    const uint32_t start_us = system_get_us();
+
+    TEST_ASSERT(timer_event_start(&event, TIMER_WHEEL_TICK_US, TIMER_WHEEL_TICK_US, test_callback, &ctx) == 0);
+    test_run_until(start_us + 10000);
+    TEST_ASSERT(ctx.calls == (10000 / TIMER_WHEEL_TICK_US));
+    TEST_ASSERT(ctx.last_call_us == (start_us + 10000));
+
+    TEST_ASSERT(timer_event_stop(&event) == 0);
+    test_run_until(start_us + 12000);
+    TEST_ASSERT(ctx.calls == (10000 / TIMER_WHEEL_TICK_US));
+}
+
+static void test_beyond_wheel_turn(void)
+{
+    struct timer_event_t event = {0};
+    struct test_ctx_t ctx = {0};
+    const uint32_t timeout_us = 3 * TIMER_WHEEL_SLOTS * TIMER_WHEEL_TICK_US + 750;
+    const uint32_t start_us = system_get_us();
+
+    /* Goes around the wheel a few times before its slot matches */
+    TEST_ASSERT(timer_event_start(&event, timeout_us, 0, test_callback, &ctx) == 0);
+    test_run_until(start_us + timeout_us + 5000);
+    TEST_ASSERT(ctx.calls == 1);
+    TEST_ASSERT(ctx.last_call_us == (start_us + timeout_us));
+}
+
+static void test_reload_pending(void)
+{
+    const uint32_t tick_us = 1000000 / SYSTEM_SYSTICK_FREQ_HZ;
+    const uint32_t start_us = system_get_us();
+    const uint32_t start_ticks = system_get_ticks();
+    const uint32_t step_us = tick_us - (start_us % tick_us) + 10;
+
+    /* Counter has reloaded but the handler hasn't counted the tick yet, time must not go back */
+    system_sim_hold_systick(true);
+    system_sim_advance_us(step_us);
+    TEST_ASSERT(system_get_ticks() == start_ticks);
+    TEST_ASSERT(system_get_us() == (start_us + step_us));
+
+    system_sim_hold_systick(false);
+    TEST_ASSERT(system_get_ticks() == (start_ticks + 1));
+    TEST_ASSERT(system_get_us() == (start_us + step_us));
+}
+
+int main(void)
+{
+    system_init();
+    TEST_ASSERT(scheduler_add_task(timer_wheel_task, SCHEDULER_EVENT_TIMER) == 0);
+
+    test_sub_ms_timeout();
+    test_periodic();
+    test_beyond_wheel_turn();
+    test_reload_pending();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,202 @@
+#include "test.h"
+#include "test_host.h"
+#include <system_sim.h>
+#include <crc32.h>
+#include <transport_sim.h>
+#include <aes.h>
+#include <string.h>
+
+/* Same as in update.c, each acknowledged packet is at most this many packets ahead of flash */
+#define TEST_PIPELINE_DEPTH 2
+
+#define TEST_CODE_SIZE 3000
+
+/* Session request flag and encryption bit, as in update.c */
+#define TEST_SESSION_FLAG_FORCE (1 << 0)
+#define TEST_ENCRYPTION_AES128_CBC (1 << 0)
+
+_Static_assert(sizeof(struct test_session_request_t) == 25, "Session request layout changed");
+_Static_assert(sizeof(struct test_session_caps_t) == 14, "Session capabilities layout changed");
+
+/* Most packets acknowledged but not programmed yet seen by the host */
+static uint32_t test_pipeline_fill;
+
+static size_t test_get_data_packets(void)
+{
+    return (test_host.file_size - FW_AES128_IV_SIZE) / COMM_PACKET_PAYLOAD_SIZE;
+}
+
+static const struct test_host_event_t *test_find_event(uint8_t op, size_t nth)
+{
+    for (size_t i = 0; i < test_host.event_count; ++i) {
+        if ((test_host.events[i].op == op) && (nth-- == 0)) {
+            return &test_host.events[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void test_check_pipeline(const struct test_host_event_t *event)
+{
+    /* First acknowledge answers the session request */
+    if ((event->op == COMM_PACKET_OP_ACK) && (test_host.acks > 1)) {
+        const uint32_t received = FW_AES128_IV_SIZE + ((test_host.acks - 1) * COMM_PACKET_PAYLOAD_SIZE);
+
+        /* Packet is acknowledged before it's programmed, but the pipeline doesn't hold more than its depth */
+        TEST_ASSERT(event->programmed < received);
+        const uint32_t fill = (received - event->programmed) / COMM_PACKET_PAYLOAD_SIZE;
+        TEST_ASSERT(fill <= TEST_PIPELINE_DEPTH);
+        if (fill > test_pipeline_fill) {
+            test_pipeline_fill = fill;
+        }
+    }
+
+    /* Update is done only once everything is in flash */
+    if (event->op == COMM_PACKET_OP_FW_UPDATE_DONE) {
+        TEST_ASSERT(event->programmed == test_host.file_size);
+    }
+}
+
+/* Session is refused right after the request, nothing gets erased or programmed */
+static void test_refused_session(enum comm_nack_reason_t reason)
+{
+    test_host_start();
+
+    test_host_run_session();
+
+    TEST_ASSERT(!test_host.session_acked);
+    TEST_ASSERT(test_host.nacked && (test_host.nack_reason == reason));
+
+    const struct test_host_event_t *nack = &test_host.events[test_host.event_count - 1];
+    TEST_ASSERT(nack->op == COMM_PACKET_OP_NACK);
+    TEST_ASSERT(nack->programmed == 0);
+}
+
+static void test_session_request(void)
+{
+    test_host_build_image(TEST_CODE_SIZE, 4);
+    test_host.request.version = 1;
+    test_refused_session(COMM_NACK_INVALID_REQUEST);
+
+    test_host_build_image(TEST_CODE_SIZE, 4);
+    test_host.request.file_size = FW_AES128_IV_SIZE;
+    test_refused_session(COMM_NACK_INVALID_REQUEST);
+
+    test_host_build_image(TEST_CODE_SIZE, 4);
+    test_host.request.device_id = FW_DEVICE_ID + 1;
+    test_refused_session(COMM_NACK_WRONG_DEVICE);
+
+    test_host_build_image(TEST_CODE_SIZE, 4);
+    test_host.request.file_size = FLASH_MAIN_APP_MAX_SIZE + AES_BLOCKLEN;
+    test_refused_session(COMM_NACK_IMAGE_TOO_LARGE);
+}
+
+static void test_session_caps(void)
+{
+    const struct test_host_event_t *ack = test_find_event(COMM_PACKET_OP_ACK, 0);
+
+    /* Capabilities fill the whole acknowledge, right after the operation code */
+    TEST_ASSERT(ack != NULL);
+    TEST_ASSERT(ack->length == (1 + sizeof(struct test_session_caps_t)));
+
+    TEST_ASSERT(test_host.caps.version == test_host.request.version);
+    TEST_ASSERT(test_host.caps.credits == TEST_HOST_DEFAULT_CREDITS);
+    TEST_ASSERT(test_host.caps.options == 0);
+    TEST_ASSERT(test_host.caps.max_frame_size == COMM_FRAME_MAX_SIZE);
+    TEST_ASSERT(test_host.caps.bit_rate == TRANSPORT_SIM_BIT_RATE);
+    TEST_ASSERT(test_host.caps.compression == 0);
+    TEST_ASSERT(test_host.caps.encryption == TEST_ENCRYPTION_AES128_CBC);
+    TEST_ASSERT(test_host.caps.free_flash == FLASH_MAIN_APP_MAX_SIZE);
+}
+
+static void test_up_to_date(void)
+{
+    /* Same signed file as the installed one */
+    test_host_build_image(TEST_CODE_SIZE, 3);
+    test_refused_session(COMM_NACK_UP_TO_DATE);
+
+    /* Forced update goes ahead anyway */
+    test_host_build_image(TEST_CODE_SIZE, 3);
+    test_host.request.flags = TEST_SESSION_FLAG_FORCE;
+    test_host_start();
+
+    test_host_run_session();
+
+    TEST_ASSERT(test_host.done && !test_host.nacked);
+    TEST_ASSERT(test_host_image_is_programmed(test_host.file_size));
+}
+
+static void test_transfer(void)
+{
+    test_host_build_image(TEST_CODE_SIZE, 1);
+    test_host_start();
+    test_host.on_packet = test_check_pipeline;
+    test_pipeline_fill = 0;
+
+    test_host_run_session();
+
+    TEST_ASSERT(test_host.done && !test_host.nacked);
+    TEST_ASSERT(test_host.rewinds == 0);
+    test_session_caps();
+
+    /* Each data packet but the last one is acknowledged, the last one with update done */
+    TEST_ASSERT(test_host.acks == test_get_data_packets());
+
+    /* Host sends a burst of credits at once, the pipeline fills up to its depth then */
+    TEST_ASSERT(test_pipeline_fill == TEST_PIPELINE_DEPTH);
+    TEST_ASSERT(test_host_image_is_programmed(test_host.file_size));
+}
+
+static void test_damaged_frame(void)
+{
+    const uint32_t damage_offset = FW_AES128_IV_SIZE + (50 * COMM_PACKET_PAYLOAD_SIZE);
+
+    test_host_build_image(TEST_CODE_SIZE, 2);
+    test_host_start();
+    test_host.damage_offset = damage_offset;
+
+    test_host_run_session();
+
+    /* Everything before the damaged packet has been taken, the host goes back right to it */
+    const struct test_host_event_t *rewind = test_find_event(COMM_PACKET_OP_REWIND, 0);
+    TEST_ASSERT(rewind != NULL);
+    TEST_ASSERT(rewind->value == damage_offset);
+
+    TEST_ASSERT(test_host.done && !test_host.nacked);
+    TEST_ASSERT(test_host_image_is_programmed(test_host.file_size));
+}
+
+static void test_dropped_frame(void)
+{
+    test_host_build_image(TEST_CODE_SIZE, 3);
+    test_host_start();
+
+    /* Nothing follows the last packet, only the timeout can tell it's missing */
+    const uint32_t drop_offset = test_host.file_size - COMM_PACKET_PAYLOAD_SIZE;
+    test_host.drop_offset = drop_offset;
+
+    test_host_run_session();
+
+    const struct test_host_event_t *rewind = test_find_event(COMM_PACKET_OP_REWIND, 0);
+    TEST_ASSERT(rewind != NULL);
+    TEST_ASSERT(rewind->value == drop_offset);
+    TEST_ASSERT(test_host.rewinds == 1);
+
+    TEST_ASSERT(test_host.done && !test_host.nacked);
+    TEST_ASSERT(test_host_image_is_programmed(test_host.file_size));
+}
+
+int main(void)
+{
+    system_init();
+    crc32_init();
+
+    test_session_request();
+    test_transfer();
+    test_damaged_frame();
+    test_dropped_frame();
+    test_up_to_date();
+
+    return EXIT_SUCCESS;
+}
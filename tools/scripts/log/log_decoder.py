@@ -0,0 +1,169 @@
+import argparse
+import re
+import serial
+import struct
+
+# C conversions the device's 32-bit arguments are formatted with, length modifiers are dropped
+CONVERSION_PATTERN = re.compile(r'%([-+ #0]*)(\d*)(?:\.(\d+))?(?:hh|h|ll|l|z|j|t)?([diuxXoc%])')
+
+
+class LogDecoder:
+    # Records are COBS encoded and terminated with zero: string ID followed by 32-bit arguments
+    FRAME_DELIMITER = b'\x00'
+    ID_SIZE = 2
+    ARG_SIZE = 4
+
+    # Sent in place of the records that didn't fit into device's buffer
+    ID_DROPPED = 0xFFFF
+
+    STRINGS_SECTION = '.logstr'
+
+    BAUDRATE = 115200
+    POLL_TIMEOUT = 0.1
+
+
+    def __init__(self, elf_path: str):
+        self.strings = self.load_strings(elf_path)
+        self.rx_buffer = bytes()
+        self.synced = False
+
+
+    @staticmethod
+    def load_strings(elf_path: str) -> dict[int, str]:
+        with open(elf_path, 'rb') as f:
+            elf = f.read()
+
+        if elf[:4] != b'\x7fELF':
+            raise ValueError(f'{elf_path} is not an ELF file')
+
+        # Only section headers are needed, 32 and 64-bit layouts differ in field sizes
+        is_64bit = elf[4] == 2
+        endian = '<' if elf[5] == 1 else '>'
+        if is_64bit:
+            section_offset, = struct.unpack_from(endian + 'Q', elf, 0x28)
+            entry_size, count, names_index = struct.unpack_from(endian + 'HHH', elf, 0x3A)
+            header_format = endian + 'IIQQQQ'
+        else:
+            section_offset, = struct.unpack_from(endian + 'I', elf, 0x20)
+            entry_size, count, names_index = struct.unpack_from(endian + 'HHH', elf, 0x2E)
+            header_format = endian + 'IIIIII'
+
+        # Name, type, flags, address, file offset and size of each section
+        sections = [struct.unpack_from(header_format, elf, section_offset + i * entry_size) for i in range(count)]
+        names_offset = sections[names_index][4]
+
+        for name_offset, _, _, address, offset, size in sections:
+            name_start = names_offset + name_offset
+            name = elf[name_start:elf.index(b'\x00', name_start)].decode()
+            if name != LogDecoder.STRINGS_SECTION:
+                continue
+
+            # Device sends string's address in the section as its 16-bit ID
+            strings = {}
+            data = elf[offset:offset + size]
+            start = 0
+            while start < len(data):
+                end = data.index(b'\x00', start)
+                strings[(address + start) & 0xFFFF] = data[start:end].decode(errors='replace')
+                start = end + 1
+                # Strings may be aligned, padding zeros are skipped
+                while start < len(data) and data[start] == 0:
+                    start += 1
+            return strings
+
+        raise ValueError(f'{elf_path} has no {LogDecoder.STRINGS_SECTION} section')
+
+
+    @staticmethod
+    def cobs_decode(data: bytes) -> bytes | None:
+        decoded = bytearray()
+        index = 0
+        while index < len(data):
+            code = data[index]
+            block = data[index + 1 : index + code]
+            if code == 0 or len(block) != code - 1:
+                return None
+            decoded += block
+            index += code
+            if code != 0xFF and index < len(data):
+                decoded += b'\x00'
+        return bytes(decoded)
+
+
+    @staticmethod
+    def format(fmt: str, args: list[int]) -> str:
+        remaining = iter(args)
+
+        def convert(match: re.Match) -> str:
+            flags, width, precision, conversion = match.groups()
+            if conversion == '%':
+                return '%'
+
+            value = next(remaining, 0)
+            if conversion in 'di':
+                value = value - (1 << 32) if value & 0x80000000 else value
+            elif conversion == 'c':
+                value = value & 0xFF
+            conversion = 'd' if conversion in 'diu' else conversion
+            precision = f'.{precision}' if precision else ''
+            return f'%{flags}{width}{precision}{conversion}' % value
+
+        return CONVERSION_PATTERN.sub(convert, fmt)
+
+
+    def decode_record(self, frame: bytes) -> str | None:
+        record = self.cobs_decode(frame)
+        if record is None or len(record) < self.ID_SIZE or (len(record) - self.ID_SIZE) % self.ARG_SIZE != 0:
+            return None
+
+        string_id = int.from_bytes(record[:self.ID_SIZE], 'little')
+        args = [int.from_bytes(record[i:i + self.ARG_SIZE], 'little') for i in range(self.ID_SIZE, len(record), self.ARG_SIZE)]
+
+        if string_id == self.ID_DROPPED:
+            return f'<{args[0] if args else 0} records dropped>\n'
+        if string_id not in self.strings:
+            return f'<unknown string 0x{string_id:04X}, ELF doesn\'t match the firmware?>\n'
+        return self.format(self.strings[string_id], args)
+
+
+    def feed(self, data: bytes) -> list[str]:
+        self.rx_buffer += data
+        messages = []
+        while self.FRAME_DELIMITER in self.rx_buffer:
+            frame, _, self.rx_buffer = self.rx_buffer.partition(self.FRAME_DELIMITER)
+            # Whatever preceded the first delimiter may be a partial record
+            if not self.synced:
+                self.synced = True
+                continue
+            if len(frame) == 0:
+                continue
+            message = self.decode_record(frame)
+            messages.append('<malformed record>\n' if message is None else message)
+        return messages
+
+
+    def run(self, port_path: str, baudrate: int) -> None:
+        port = serial.Serial(port_path, baudrate=baudrate, timeout=self.POLL_TIMEOUT)
+        try:
+            while True:
+                data = port.read(max(1, port.in_waiting))
+                for message in self.feed(data):
+                    print(message, end='', flush=True)
+        except KeyboardInterrupt:
+            pass
+        finally:
+            port.close()
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser()
+    parser.add_argument('elf_path', help='path to firmware ELF the format strings are taken from', type=str)
+    parser.add_argument('port_path', help='path to device serial port', type=str)
+    parser.add_argument('--baudrate', help='UART baud rate', type=int, default=LogDecoder.BAUDRATE)
+    args = parser.parse_args()
+
+    LogDecoder(args.elf_path).run(args.port_path, args.baudrate)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,144 @@
+import argparse
+import os
+import re
+
+# Sections placed in given memory region are summed up per module
+MEMORY_CONFIG_START = 'Memory Configuration'
+MEMORY_MAP_START = 'Linker script and memory map'
+
+REGION_PATTERN = re.compile(r'^(\S+)\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)')
+OUTPUT_SECTION_PATTERN = re.compile(r'^(\S+)\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)(?:\s+load address 0x([0-9a-fA-F]+))?')
+INPUT_SECTION_PATTERN = re.compile(r'^ (\S+)\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S.*)$')
+WRAPPED_NAME_PATTERN = re.compile(r'^ (\S+)$')
+WRAPPED_SECTION_PATTERN = re.compile(r'^\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S.*)$')
+ARCHIVE_PATTERN = re.compile(r'([^/\\]+)\.a\(.*\)$')
+
+
+def parse_regions(lines: list[str]) -> dict[str, tuple[int, int]]:
+    regions = {}
+    inside = False
+
+    for line in lines:
+        if line.startswith(MEMORY_CONFIG_START):
+            inside = True
+            continue
+        if line.startswith(MEMORY_MAP_START):
+            break
+        if not inside:
+            continue
+
+        match = REGION_PATTERN.match(line)
+        if match and match.group(1) != '*default*':
+            regions[match.group(1)] = (int(match.group(2), 16), int(match.group(3), 16))
+
+    return regions
+
+
+def parse_sections(lines: list[str]) -> list[tuple[str, int, int, int, str]]:
+    sections = []
+    inside = False
+    wrapped_name = None
+    load_offset = 0
+
+    for line in lines:
+        if line.startswith(MEMORY_MAP_START):
+            inside = True
+            continue
+        if not inside:
+            continue
+
+        # Long section names are followed by address, size and object on the next line
+        if wrapped_name is not None:
+            match = WRAPPED_SECTION_PATTERN.match(line)
+            if match:
+                add_section(sections, wrapped_name, int(match.group(1), 16), load_offset, int(match.group(2), 16), match.group(3))
+            wrapped_name = None
+            continue
+
+        # Initialized data is placed in RAM, but its initial values are loaded from flash
+        match = OUTPUT_SECTION_PATTERN.match(line)
+        if match:
+            load_offset = int(match.group(4), 16) - int(match.group(2), 16) if match.group(4) else 0
+            continue
+
+        match = INPUT_SECTION_PATTERN.match(line)
+        if match:
+            add_section(sections, match.group(1), int(match.group(2), 16), load_offset, int(match.group(3), 16), match.group(4))
+            continue
+
+        match = WRAPPED_NAME_PATTERN.match(line)
+        if match and not match.group(1).startswith('*'):
+            wrapped_name = match.group(1)
+
+    return sections
+
+
+def add_section(sections: list, name: str, address: int, load_offset: int, size: int, object_path: str) -> None:
+    # Fill and data statements like BYTE(0xFF) used for padding don't belong to any object
+    if name.startswith('*') or object_path.startswith('0x'):
+        return
+    sections.append((name, address, address + load_offset, size, object_path))
+
+
+def get_module_name(object_path: str) -> str:
+    # Libraries are reported as a whole, sources by the directory they live in
+    match = ARCHIVE_PATTERN.search(object_path)
+    if match:
+        return match.group(1)
+    return os.path.basename(os.path.dirname(object_path.replace('\\', '/'))) or object_path
+
+
+def report(map_path: str, region_name: str, page_size: int | None) -> bool:
+    with open(map_path, 'r') as f:
+        lines = f.read().splitlines()
+
+    regions = parse_regions(lines)
+    if region_name not in regions:
+        print(f'Memory region {region_name} not found in {map_path}!')
+        return False
+    origin, length = regions[region_name]
+
+    modules = {}
+    end = origin
+    for name, address, load_address, size, object_path in parse_sections(lines):
+        if size == 0:
+            continue
+        if not (origin <= address < origin + length):
+            address = load_address
+        if not (origin <= address < origin + length):
+            continue
+        end = max(end, address + size)
+        module = modules.setdefault(get_module_name(object_path), {})
+        module[name] = module.get(name, 0) + size
+
+    used = sum(sum(module.values()) for module in modules.values())
+
+    print(f'{region_name} usage by module, {map_path}:')
+    for module_name, module in sorted(modules.items(), key=lambda item: sum(item[1].values()), reverse=True):
+        print(f'  {module_name}: {sum(module.values())}B')
+        for name, size in sorted(module.items(), key=lambda item: item[1], reverse=True):
+            print(f'    {name}: {size}B')
+
+    # Whatever static data leaves free in RAM is the stack
+    print(f'  Total: {used}B of {length}B, {length - used}B left')
+
+    # Slot boundaries have to be aligned to erasable pages, alignment gaps count too
+    if page_size is not None:
+        pages = (end - origin + page_size - 1) // page_size
+        print(f'  Smallest page aligned size: {pages * page_size}B, {pages} pages of {page_size}B')
+    return True
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser()
+    parser.add_argument('map_path', help='path to map file generated by the linker', type=str)
+    parser.add_argument('--region', help='memory region to report, as named in the linker script', type=str, default='RAM')
+    parser.add_argument('--page-size', help='flash page size, prints the smallest slot that fits the region contents', type=int)
+    args = parser.parse_args()
+
+    if not report(args.map_path, args.region, args.page_size):
+        exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -2,9 +2,15 @@ from cryptography.hazmat.primitives.asymmetric import ec
 from cryptography.hazmat.primitives import serialization
 import argparse
 
+# Curves supported by the bootloader, selected at build time with ECDSA_CURVE
+CURVES = {
+    'secp256k1': ec.SECP256K1,
+    'secp256r1': ec.SECP256R1
+}
 
-def generate_keys(output_path: str, file_prefix: str) -> None:
-    private_key = ec.generate_private_key(ec.SECP256K1())
+
+def generate_keys(output_path: str, file_prefix: str, curve: str) -> None:
+    private_key = ec.generate_private_key(CURVES[curve]())
     public_key = private_key.public_key()
 
     with open(f'{output_path}/{file_prefix}_private.pem', 'wb') as f:
@@ -27,9 +33,10 @@ def main() -> None:
     parser = argparse.ArgumentParser()
     parser.add_argument('path', help='path to directory where key files will be saved', type=str)
     parser.add_argument('prefix', help='output filenames prefix: <prefix>_private.pem, <prefix>_public.pem', type=str)
+    parser.add_argument('--curve', help='elliptic curve, has to match ECDSA_CURVE the bootloader was built with', choices=CURVES.keys(), default='secp256k1')
     args = parser.parse_args()
 
-    generate_keys(args.path, args.prefix)
+    generate_keys(args.path, args.prefix, args.curve)
 
     print('Keys created!')
 
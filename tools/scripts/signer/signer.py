@@ -13,11 +13,33 @@ AES_BLOCK_SIZE = AES_BLOCK_SIZE_BITS // 8
 
 # FW header has to be multiple of 128 due to SCB->VTOR bits [6:0] being unused
 HEADER_SIZE = 128
-HEADER_PADDING_SIZE = 36
+HEADER_PADDING_SIZE = 32
 HEADER_PADDING_BYTE = b'\xFF'
 
+# Same CRC-32 as the STM32 CRC unit, computed over little-endian words
+CRC32_POLY = 0x04C11DB7
+CRC32_INIT = 0xFFFFFFFF
+CRC32_PAD_BYTE = b'\xFF'
 
-def sign(firmware_path: str, signed_firmware_path: str, aes_key_path: str, private_key_path: str, version: int, device_id: int) -> None:
+
+def crc32_stm32(data: bytes) -> int:
+    # Trailing partial word is padded, like the bootloader does
+    data += CRC32_PAD_BYTE * (-len(data) % 4)
+    crc = CRC32_INIT
+
+    for i in range(0, len(data), 4):
+        crc ^= int.from_bytes(data[i:i + 4], 'little')
+
+        for _ in range(32):
+            if crc & 0x80000000:
+                crc = ((crc << 1) ^ CRC32_POLY) & 0xFFFFFFFF
+            else:
+                crc = (crc << 1) & 0xFFFFFFFF
+
+    return crc
+
+
+def sign(firmware_path: str, signed_firmware_path: str, aes_key_path: str, private_key_path: str, version: int, device_id: int, curve: str) -> bool:
     # Read firmware data and remove header placeholder
     with open(firmware_path, 'rb') as f:
         firmware_data = f.read()
@@ -26,6 +48,12 @@ def sign(firmware_path: str, signed_firmware_path: str, aes_key_path: str, priva
     # Compute SHA256 of firmware data and sign it with ECDSA
     with open(private_key_path, 'rb') as f:
         key = serialization.load_pem_private_key(f.read(), password=None)
+
+    # Bootloader can verify only signatures made on the curve it was built for
+    if key.curve.name != curve:
+        print(f'Key uses {key.curve.name} curve, but {curve} was expected!')
+        return False
+
     signature = key.sign(firmware_data, ec.ECDSA(hashes.SHA256()))
 
     # Convert signature from DER format to raw bytes
@@ -36,8 +64,9 @@ def sign(firmware_path: str, signed_firmware_path: str, aes_key_path: str, priva
     version_data = version.to_bytes(4, 'little')
     id_data = device_id.to_bytes(4, 'little')
     size_data = len(firmware_data).to_bytes(4, 'little')
+    crc_data = crc32_stm32(firmware_data).to_bytes(4, 'little')
     padding_data = HEADER_PADDING_BYTE * HEADER_PADDING_SIZE
-    firmware_data = version_data + id_data + size_data + signature + padding_data + firmware_data
+    firmware_data = version_data + id_data + size_data + signature + crc_data + padding_data + firmware_data
 
     # Pad for AES128
     padder = padding.PKCS7(AES_BLOCK_SIZE_BITS).padder()
@@ -48,7 +77,7 @@ def sign(firmware_path: str, signed_firmware_path: str, aes_key_path: str, priva
         aes_key = f.read()
     if len(aes_key) != AES_BLOCK_SIZE:
         print('Invalid AES128 key size!')
-        return
+        return False
 
     # Generate IV and encrypt the firmware
     iv = secrets.token_bytes(AES_BLOCK_SIZE)
@@ -60,6 +89,8 @@ def sign(firmware_path: str, signed_firmware_path: str, aes_key_path: str, priva
     with open(signed_firmware_path, 'wb') as f:
         f.write(iv + encrypted_firmware_data)
 
+    return True
+
 
 def verify(signed_firmware_path: str, aes_key_path: str, public_key_path: str):
     # Read encrypted firmware data
@@ -98,12 +129,18 @@ def verify(signed_firmware_path: str, aes_key_path: str, public_key_path: str):
     signature = firmware_data[:SIGNATURE_SIZE]
     firmware_data = firmware_data[SIGNATURE_SIZE:]
 
-    # Skip header padding
-    firmware_data = firmware_data[HEADER_PADDING_SIZE:]
+    # Get CRC from data and skip header padding
+    crc = int.from_bytes(firmware_data[:4], 'little')
+    firmware_data = firmware_data[4 + HEADER_PADDING_SIZE:]
 
     # Remove AES padding
     firmware_data = firmware_data[:size]
 
+    if crc32_stm32(firmware_data) == crc:
+        print(f'CRC-32 valid: 0x{crc:08X}')
+    else:
+        print('CRC-32 invalid!')
+
     # Get public ECDSA key and verify signature
     with open(public_key_path, 'rb') as f:
         key = serialization.load_pem_public_key(f.read())
@@ -128,6 +165,7 @@ def main() -> None:
     parser.add_argument('public_key_path', help='path to public ECDSA key in PEM format to use to verify the signature', type=str)
     parser.add_argument('version', help='firmware version number', type=int)
     parser.add_argument('device_id', help='ID of the device this firmware is for', type=str)
+    parser.add_argument('--curve', help='elliptic curve the bootloader was built with (ECDSA_CURVE)', choices=['secp256k1', 'secp256r1'], default='secp256k1')
     args = parser.parse_args()
 
     if args.device_id.startswith('0x'):
@@ -136,7 +174,9 @@ def main() -> None:
         device_id = int(args.device_id)
 
     print('Signing...')
-    sign(args.firmware_path, args.output_path, args.aes_key_path, args.private_key_path, args.version, device_id)
+    if not sign(args.firmware_path, args.output_path, args.aes_key_path, args.private_key_path, args.version, device_id, args.curve):
+        print('Signing failed!')
+        return
     print('Firmware signed! Performing verification...')
     verify(args.output_path, args.aes_key_path, args.public_key_path)
 
@@ -0,0 +1,58 @@
+import struct
+import time
+from enum import IntEnum
+
+class Capture:
+    # Binary session log: header, then records of kind, microseconds since start, data length and data
+    class Kind(IntEnum):
+        TX = 0
+        RX = 1
+        STATE = 2   # Updater's state machine entered the state named by the data
+
+    MAGIC = b'UCAP'
+    VERSION = 1
+
+    # Magic, version, framed flag, line rate in B/s, wall clock time of the start
+    HEADER_FORMAT = '<4sBBId'
+    RECORD_FORMAT = '<BIH'
+
+
+    def __init__(self, path: str, framed: bool, line_rate: int):
+        self.file = open(path, 'wb')
+        self.start = time.perf_counter_ns()
+        self.file.write(struct.pack(self.HEADER_FORMAT, self.MAGIC, self.VERSION, framed, line_rate, time.time()))
+
+
+    def record(self, kind: Kind, data: bytes) -> None:
+        timestamp = (time.perf_counter_ns() - self.start) // 1000
+        self.file.write(struct.pack(self.RECORD_FORMAT, kind, timestamp & 0xFFFFFFFF, len(data)) + data)
+
+
+    def close(self) -> None:
+        self.file.close()
+
+
+    @staticmethod
+    def load(path: str) -> tuple[dict, list]:
+        # Returns header fields and a list of (kind, seconds since start, data)
+        with open(path, 'rb') as f:
+            log = f.read()
+
+        magic, version, framed, line_rate, start_time = struct.unpack_from(Capture.HEADER_FORMAT, log)
+        if magic != Capture.MAGIC or version != Capture.VERSION:
+            raise ValueError(f'{path} is not a session capture')
+        header = {'framed': bool(framed), 'line_rate': line_rate, 'start_time': start_time}
+
+        records = []
+        offset = struct.calcsize(Capture.HEADER_FORMAT)
+        record_size = struct.calcsize(Capture.RECORD_FORMAT)
+        # Record cut short by an interrupted session is dropped
+        while offset + record_size <= len(log):
+            kind, timestamp, length = struct.unpack_from(Capture.RECORD_FORMAT, log, offset)
+            offset += record_size
+            if offset + length > len(log):
+                break
+            records.append((Capture.Kind(kind), timestamp / 1e6, log[offset:offset + length]))
+            offset += length
+
+        return header, records
@@ -0,0 +1,151 @@
+import os
+import time
+import math
+import statistics
+from packet import Packet
+from typing import Callable
+
+class LinkTest:
+    # Echo response holds device's microsecond timestamp followed by the request data
+    TIMESTAMP_SIZE = 4
+    DATA_SIZE = Packet.PAYLOAD_SIZE - 1 - TIMESTAMP_SIZE
+
+    ECHO_TIMEOUT = 0.5
+
+    BURST_SIZE = 64
+    BURST_TIMEOUT = 2.0
+
+
+    def __init__(self, send_packet: Callable[[Packet], None], count: int, line_rate: int, frame_size: int):
+        self.send_packet = send_packet
+        self.count = count
+        self.line_rate = line_rate
+        self.frame_size = frame_size
+        self.seq = 0
+        self.sent = 0
+        self.pending = {}
+        self.rtts = []
+        self.device_times = []
+        self.lost = 0
+        self.corrupted = 0
+        self.in_burst = False
+        self.burst_start = 0.0
+        self.burst_end = 0.0
+        self.burst_received = 0
+
+
+    def send_echo(self) -> None:
+        # Sequence number lets the responses be matched even when several are in flight
+        data = self.seq.to_bytes(2, 'little') + os.urandom(self.DATA_SIZE - 2)
+        self.pending[self.seq] = (time.monotonic(), data)
+        self.send_packet(Packet(Packet.Operation.ECHO.value + data, Packet.Type.CONTROL))
+        self.seq = (self.seq + 1) & 0xFFFF
+        self.sent += 1
+
+
+    def handle_echo(self, packet: Packet) -> None:
+        now = time.monotonic()
+        payload = packet.get_payload()[1:]
+        device_time = int.from_bytes(payload[:self.TIMESTAMP_SIZE], 'little')
+        data = payload[self.TIMESTAMP_SIZE:]
+
+        # Duplicates come from retransmission requests
+        seq = int.from_bytes(data[:2], 'little')
+        if seq not in self.pending:
+            return
+
+        send_time, sent_data = self.pending.pop(seq)
+        if data != sent_data:
+            self.corrupted += 1
+            return
+
+        if self.in_burst:
+            self.burst_received += 1
+            self.burst_end = now
+        else:
+            self.rtts.append(now - send_time)
+        self.device_times.append((now, device_time))
+
+
+    def poll(self, packets: list) -> bool:
+        for packet in packets:
+            if packet.is_operation(Packet.Operation.ECHO):
+                self.handle_echo(packet)
+        packets.clear()
+
+        now = time.monotonic()
+
+        # Round trip time is measured with one echo in flight at a time
+        if not self.in_burst:
+            if len(self.pending) > 0:
+                send_time, _ = next(iter(self.pending.values()))
+                if now - send_time < self.ECHO_TIMEOUT:
+                    return False
+                self.lost += len(self.pending)
+                self.pending.clear()
+
+            if self.sent < self.count:
+                self.send_echo()
+                return False
+
+            # Then the whole burst goes out back to back to find the sustainable rate
+            self.in_burst = True
+            self.burst_start = time.monotonic()
+            self.burst_end = self.burst_start
+            for _ in range(self.BURST_SIZE):
+                self.send_echo()
+            return False
+
+        if len(self.pending) > 0 and now - self.burst_start < self.BURST_TIMEOUT:
+            return False
+
+        self.lost += len(self.pending)
+        self.pending.clear()
+        return True
+
+
+    def get_rtt_percentile(self, fraction: float) -> float:
+        rtts = sorted(self.rtts)
+        return rtts[min(len(rtts) - 1, math.ceil(fraction * len(rtts)) - 1)]
+
+
+    def get_recommended_credits(self, max_credits: int) -> int:
+        if len(self.rtts) == 0:
+            return 1
+
+        # Enough packets in flight to cover the round trip, bandwidth-delay product
+        frame_time = self.frame_size / self.line_rate
+        return max(1, min(max_credits, math.ceil(self.get_rtt_percentile(0.95) / frame_time)))
+
+
+    def print_summary(self, errors: int, max_credits: int) -> None:
+        print('\nLink test:')
+
+        if len(self.rtts) > 0:
+            print(f'  RTT: min {1000 * min(self.rtts):.2f}ms, median {1000 * statistics.median(self.rtts):.2f}ms, '
+                  f'p95 {1000 * self.get_rtt_percentile(0.95):.2f}ms, max {1000 * max(self.rtts):.2f}ms')
+
+        duration = self.burst_end - self.burst_start
+        if duration > 0:
+            rate = self.burst_received / duration
+            max_rate = self.line_rate / self.frame_size
+            print(f'  Burst: {self.burst_received}/{self.BURST_SIZE} echoes, {rate:.0f} packets/s, '
+                  f'{100 * rate / max_rate:.1f}% of {max_rate:.0f} packets/s line rate')
+
+        # Every error is assumed to be a single bit error within a frame
+        errors += self.lost + self.corrupted
+        frames = self.sent + len(self.rtts) + self.burst_received
+        bits = frames * self.frame_size * 8
+        if errors > 0:
+            print(f'  Errors: {errors} in {frames} frames, BER ~{errors / bits:.1e}')
+        elif bits > 0:
+            print(f'  Errors: none in {frames} frames, BER < {3 / bits:.1e} (95% confidence)')
+
+        # Device's timestamps show how fast it handled the burst, regardless of host's latency
+        burst_times = self.device_times[-self.burst_received:] if self.burst_received > 1 else []
+        if len(burst_times) > 1:
+            device_duration = ((burst_times[-1][1] - burst_times[0][1]) & 0xFFFFFFFF) / 1e6
+            if device_duration > 0:
+                print(f'  Device side burst rate: {(len(burst_times) - 1) / device_duration:.0f} packets/s')
+
+        print(f'  Recommended credits: {self.get_recommended_credits(max_credits)}')
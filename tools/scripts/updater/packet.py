@@ -1,4 +1,6 @@
 from enum import Enum, IntEnum
+from typing import Callable
+import binascii
 
 class Packet:
     class Type(IntEnum):
@@ -7,12 +9,19 @@ class Packet:
 
     class Operation(Enum):
         FW_UPDATE_DONE = b'\x04'
+        INFO_REQUEST = b'\x05'
         ACK = b'\x06'
+        ECHO = b'\x07'
+        REWIND = b'\x08'
         UPDATE_REQUEST = b'\x11'
         FW_SIZE_REQUEST = b'\x12'
+        STATS_REQUEST = b'\x13'
+        MEMORY_REQUEST = b'\x14'
         NACK = b'\x15'
         SYNCED = b'\x16'
+        SESSION_END = b'\x17'
         RETX = b'\x18'
+        SESSION_REQUEST = b'\x19'
 
     LENGTH_SHIFT = 0
     LENGTH_MASK = 0x1F << LENGTH_SHIFT
@@ -27,8 +36,20 @@ class Packet:
 
     CONTROL_PACKET_LENGTH = 1
 
+    # Paged responses carry operation and page number before the data
+    PAGE_DATA_SIZE = PAYLOAD_SIZE - 2
+
     PADDING_BYTE = 0xFF
 
+    # With FEC each packet is followed by Reed-Solomon parity
+    FEC_PARITY_SIZE = 4
+    FEC_CODEWORD_SIZE = TOTAL_SIZE + FEC_PARITY_SIZE
+
+    # Packets are COBS encoded and terminated with zero, one code byte is enough for a codeword
+    FRAME_DELIMITER = 0x00
+    FRAME_SIZE = 1 + TOTAL_SIZE + 1
+    FEC_FRAME_SIZE = 1 + FEC_CODEWORD_SIZE + 1
+
 
     def __init__(self, payload: bytes = bytes(), type: Type = Type.DATA, crc: int | None = None):
         self.payload = payload
@@ -117,16 +138,67 @@ class Packet:
         return meta_byte + self.payload + crc_bytes
 
 
-    def crc16_xmodem(self, data: bytes) -> bytes:
-        crc = 0
-
-        for byte in data:
-            crc ^= (byte << 8) & 0xFFFF
-
-            for _ in range(8):
-                if crc & 0x8000:
-                    crc = ((crc << 1) ^ 0x1021) & 0xFFFF
-                else:
-                    crc = (crc << 1) & 0xFFFF
-
-        return crc
+    def get_frame(self, parity: bytes = bytes()) -> bytes:
+        return self.cobs_encode(self.get_raw() + parity) + self.FRAME_DELIMITER.to_bytes(1, 'little')
+
+
+    @staticmethod
+    def cobs_encode(data: bytes) -> bytes:
+        # Each code byte holds the distance to the next zero, which is left out
+        encoded = bytearray()
+        for block in data.split(b'\x00'):
+            while len(block) >= 0xFE:
+                encoded += b'\xFF' + block[:0xFE]
+                block = block[0xFE:]
+            encoded += (len(block) + 1).to_bytes(1, 'little') + block
+        return bytes(encoded)
+
+
+    @staticmethod
+    def cobs_decode(data: bytes) -> bytes | None:
+        decoded = bytearray()
+        index = 0
+        while index < len(data):
+            code = data[index]
+            block = data[index + 1 : index + code]
+            if code == 0 or len(block) != code - 1:
+                return None
+            decoded += block
+            index += code
+            # Full block is not followed by a zero, neither is the last one
+            if code != 0xFF and index < len(data):
+                decoded += b'\x00'
+        return bytes(decoded)
+
+
+    @staticmethod
+    def crc16_xmodem(data: bytes) -> int:
+        # CRC-16/XMODEM is CRC-CCITT with zero initial value, binascii computes it with a table in C
+        return binascii.crc_hqx(data, 0)
+
+
+    @classmethod
+    def get_frame_size(cls, framed: bool = True, fec: bool = False) -> int:
+        if not framed:
+            return cls.TOTAL_SIZE
+        return cls.FEC_FRAME_SIZE if fec else cls.FRAME_SIZE
+
+
+    @classmethod
+    def packetise(cls, data: bytes, framed: bool = True, parity: Callable[[bytes], bytes] | None = None) -> bytes:
+        # Whole data as data packets, encoded once into a buffer of equally sized frames. Each chunk's frame
+        # starts at its index times get_frame_size(), so sending is just slicing the buffer.
+        frames = bytearray()
+        for offset in range(0, len(data), cls.PAYLOAD_SIZE):
+            chunk = data[offset:offset + cls.PAYLOAD_SIZE]
+            metadata = ((cls.Type.DATA << cls.TYPE_SHIFT) & cls.TYPE_MASK) | ((len(chunk) << cls.LENGTH_SHIFT) & cls.LENGTH_MASK)
+            raw = metadata.to_bytes(1, 'little') + chunk + cls.PADDING_BYTE.to_bytes(1, 'little') * (cls.PAYLOAD_SIZE - len(chunk))
+            raw += cls.crc16_xmodem(raw).to_bytes(2, 'little')
+
+            if not framed:
+                frames += raw
+            else:
+                if parity is not None:
+                    raw += parity(raw)
+                frames += cls.cobs_encode(raw) + cls.FRAME_DELIMITER.to_bytes(1, 'little')
+        return bytes(frames)
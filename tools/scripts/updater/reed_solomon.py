@@ -0,0 +1,132 @@
+class ReedSolomon:
+    # Same code as the bootloader: GF(256) with polynomial 0x11D, generator roots a^0 to a^(parity size - 1)
+    PRIMITIVE_POLY = 0x11D
+    FIELD_ORDER = 255
+
+
+    def __init__(self, parity_size: int):
+        self.parity_size = parity_size
+        self.exp = [0] * (2 * self.FIELD_ORDER)
+        self.log = [0] * (self.FIELD_ORDER + 1)
+
+        value = 1
+        for i in range(self.FIELD_ORDER):
+            self.exp[i] = value
+            self.exp[i + self.FIELD_ORDER] = value
+            self.log[value] = i
+            value <<= 1
+            if value & 0x100:
+                value ^= self.PRIMITIVE_POLY
+
+        # Generator is the product of (x - a^i) for each parity byte, lowest degree first
+        self.generator = [1] + [0] * parity_size
+        for i in range(parity_size):
+            for j in range(i + 1, 0, -1):
+                self.generator[j] = self.generator[j - 1] ^ self.mul(self.generator[j], self.exp[i])
+            self.generator[0] = self.mul(self.generator[0], self.exp[i])
+
+
+    def mul(self, a: int, b: int) -> int:
+        if a == 0 or b == 0:
+            return 0
+        return self.exp[self.log[a] + self.log[b]]
+
+
+    def div(self, a: int, b: int) -> int:
+        if a == 0:
+            return 0
+        return self.exp[self.log[a] + self.FIELD_ORDER - self.log[b]]
+
+
+    def poly_eval(self, poly: list, x: int) -> int:
+        value = 0
+        for coefficient in reversed(poly):
+            value = self.mul(value, x) ^ coefficient
+        return value
+
+
+    def encode(self, data: bytes) -> bytes:
+        # Remainder of the division by generator, first data byte is the highest coefficient
+        parity = [0] * self.parity_size
+        for byte in data:
+            feedback = byte ^ parity[0]
+            for j in range(self.parity_size - 1):
+                parity[j] = parity[j + 1] ^ self.mul(feedback, self.generator[self.parity_size - 1 - j])
+            parity[-1] = self.mul(feedback, self.generator[0])
+        return bytes(parity)
+
+
+    def decode(self, codeword: bytes) -> tuple[bytes, int] | None:
+        # Returns corrected codeword with the number of corrected bytes, None if it can't be corrected
+        syndromes = []
+        for i in range(self.parity_size):
+            value = 0
+            for byte in codeword:
+                value = self.mul(value, self.exp[i]) ^ byte
+            syndromes.append(value)
+
+        if not any(syndromes):
+            return codeword, 0
+
+        # Berlekamp-Massey finds the error locator, its roots are inverses of error positions
+        locator = [1] + [0] * self.parity_size
+        previous = list(locator)
+        previous_discrepancy = 1
+        errors = 0
+        shift = 1
+        for i in range(self.parity_size):
+            discrepancy = syndromes[i]
+            for j in range(1, errors + 1):
+                discrepancy ^= self.mul(locator[j], syndromes[i - j])
+
+            if discrepancy == 0:
+                shift += 1
+                continue
+
+            temp = list(locator)
+            scale = self.div(discrepancy, previous_discrepancy)
+            for j in range(shift, self.parity_size + 1):
+                locator[j] ^= self.mul(scale, previous[j - shift])
+
+            if 2 * errors <= i:
+                errors = i + 1 - errors
+                previous = temp
+                previous_discrepancy = discrepancy
+                shift = 1
+            else:
+                shift += 1
+
+        if 2 * errors > self.parity_size:
+            return None
+
+        evaluator = [0] * self.parity_size
+        for i in range(self.parity_size):
+            for j in range(i + 1):
+                evaluator[i] ^= self.mul(syndromes[j], locator[i - j])
+
+        # Formal derivative keeps odd powers only
+        derivative = [0] * self.parity_size
+        for i in range(1, self.parity_size + 1, 2):
+            derivative[i - 1] = locator[i]
+
+        # Chien search over all positions, Forney gives the error value at each root
+        corrected = bytearray(codeword)
+        found = 0
+        for i in range(len(codeword)):
+            power = len(codeword) - 1 - i
+            x_inv = self.exp[(self.FIELD_ORDER - power) % self.FIELD_ORDER]
+            if self.poly_eval(locator, x_inv) != 0:
+                continue
+
+            denominator = self.poly_eval(derivative, x_inv)
+            if found >= errors or denominator == 0:
+                return None
+
+            numerator = self.poly_eval(evaluator, x_inv)
+            corrected[i] ^= self.mul(self.exp[power], self.div(numerator, denominator))
+            found += 1
+
+        # Locator with roots outside of the codeword means more errors than the code can handle
+        if found != errors:
+            return None
+        return bytes(corrected), found
@@ -0,0 +1,35 @@
+class RetransmissionTimer:
+    # Same estimator as the bootloader, RFC 6298: smoothed RTT and its variance, timeout doubles on each expiry
+    SRTT_GAIN = 1 / 8
+    RTTVAR_GAIN = 1 / 4
+    VARIANCE_FACTOR = 4
+
+
+    def __init__(self, initial: float, minimum: float, maximum: float):
+        self.minimum = minimum
+        self.maximum = maximum
+        self.srtt = None
+        self.rttvar = 0.0
+        self.timeout = self.clamp(initial)
+        self.samples = 0
+
+
+    def clamp(self, timeout: float) -> float:
+        return min(self.maximum, max(self.minimum, timeout))
+
+
+    def sample(self, rtt: float) -> None:
+        # Round trips of retransmitted packets are ambiguous, they must not be passed in
+        if self.srtt is None:
+            self.srtt = rtt
+            self.rttvar = rtt / 2
+        else:
+            self.rttvar += self.RTTVAR_GAIN * (abs(self.srtt - rtt) - self.rttvar)
+            self.srtt += self.SRTT_GAIN * (rtt - self.srtt)
+
+        self.timeout = self.clamp(self.srtt + self.VARIANCE_FACTOR * self.rttvar)
+        self.samples += 1
+
+
+    def backoff(self) -> None:
+        self.timeout = min(self.maximum, 2 * self.timeout)
@@ -0,0 +1,288 @@
+from capture import Capture
+from packet import Packet
+from reed_solomon import ReedSolomon
+import argparse
+import math
+import statistics
+
+class SessionAnalyzer:
+    # Firmware data continues after the IV, which goes with the session request
+    AES_BLOCK_SIZE = 16
+
+    GAPS_SHOWN = 10
+
+
+    def __init__(self, capture_path: str, gap_threshold: float, interval: float):
+        self.header, self.records = Capture.load(capture_path)
+        self.gap_threshold = gap_threshold
+        self.interval = interval
+        self.reed_solomon = ReedSolomon(Packet.FEC_PARITY_SIZE)
+
+        # Decoded traffic: (time, kind, phase, packet), packet is None for frames that failed to decode
+        self.packets = []
+        self.phases = []
+        self.rx_buffer = {Capture.Kind.TX: bytes(), Capture.Kind.RX: bytes()}
+        self.decode()
+
+
+    def decode(self) -> None:
+        phase = 'UNKNOWN'
+        for kind, timestamp, data in self.records:
+            if kind == Capture.Kind.STATE:
+                phase = data.decode()
+                self.phases.append((timestamp, phase))
+                continue
+
+            self.rx_buffer[kind] += data
+            for packet in self.split_packets(kind):
+                self.packets.append((timestamp, kind, phase, packet))
+
+
+    def split_packets(self, kind: Capture.Kind) -> list:
+        # Same framing rules as the updater, packets take the time of the chunk that completed them
+        packets = []
+        buffer = self.rx_buffer[kind]
+
+        if not self.header['framed']:
+            while len(buffer) >= Packet.TOTAL_SIZE:
+                packets.append(self.parse_packet(buffer[:Packet.TOTAL_SIZE]))
+                buffer = buffer[Packet.TOTAL_SIZE:]
+        else:
+            delimiter = Packet.FRAME_DELIMITER.to_bytes(1, 'little')
+            while delimiter in buffer:
+                frame, _, buffer = buffer.partition(delimiter)
+                if len(frame) > 0:
+                    packets.append(self.parse_packet(self.decode_frame(frame)))
+
+        self.rx_buffer[kind] = buffer
+        return packets
+
+
+    def decode_frame(self, frame: bytes) -> bytes | None:
+        packet_data = Packet.cobs_decode(frame)
+        if packet_data is None or len(packet_data) == Packet.TOTAL_SIZE:
+            return packet_data
+        if len(packet_data) != Packet.FEC_CODEWORD_SIZE:
+            return None
+
+        result = self.reed_solomon.decode(packet_data)
+        if result is None:
+            return packet_data[:Packet.TOTAL_SIZE]
+        return result[0][:Packet.TOTAL_SIZE]
+
+
+    @staticmethod
+    def parse_packet(packet_data: bytes | None) -> Packet | None:
+        if packet_data is None:
+            return None
+        packet = Packet()
+        packet.from_bytes(packet_data)
+        if not packet.is_valid():
+            return None
+        return packet
+
+
+    @staticmethod
+    def get_operation(packet: Packet) -> Packet.Operation | None:
+        if packet.get_type() != Packet.Type.CONTROL:
+            return None
+        try:
+            return packet.get_operation()
+        except ValueError:
+            return None
+
+
+    @staticmethod
+    def describe(kind: Capture.Kind, packet: Packet | None) -> str:
+        if packet is None:
+            return f'{kind.name} corrupted frame'
+        operation = SessionAnalyzer.get_operation(packet)
+        if operation is not None:
+            return f'{kind.name} {operation.name}'
+        if packet.get_type() == Packet.Type.DATA:
+            return f'{kind.name} DATA {packet.get_length()}B'
+        return f'{kind.name} packet of type {packet.get_type()}'
+
+
+    @staticmethod
+    def print_distribution(name: str, values: list) -> None:
+        if len(values) == 0:
+            print(f'  {name}: no samples')
+            return
+        values = sorted(values)
+        p95 = values[min(len(values) - 1, math.ceil(0.95 * len(values)) - 1)]
+        print(f'  {name}: min {1000 * values[0]:.2f}ms, median {1000 * statistics.median(values):.2f}ms, '
+              f'p95 {1000 * p95:.2f}ms, max {1000 * values[-1]:.2f}ms, {len(values)} samples')
+
+
+    def get_duration(self) -> float:
+        return self.records[-1][1] if len(self.records) > 0 else 0.0
+
+
+    def print_overview(self) -> None:
+        tx_bytes = sum(len(d) for k, _, d in self.records if k == Capture.Kind.TX)
+        rx_bytes = sum(len(d) for k, _, d in self.records if k == Capture.Kind.RX)
+        duration = self.get_duration()
+
+        print('Session:')
+        print(f'  Duration: {duration:.3f}s')
+        print(f'  Line rate: {self.header["line_rate"]}B/s, {"COBS framed" if self.header["framed"] else "unframed"}')
+        print(f'  TX: {tx_bytes}B, {len(self.packets_of(Capture.Kind.TX))} packets')
+        print(f'  RX: {rx_bytes}B, {len(self.packets_of(Capture.Kind.RX))} packets')
+
+
+    def packets_of(self, kind: Capture.Kind) -> list:
+        return [entry for entry in self.packets if entry[1] == kind]
+
+
+    def print_phases(self) -> None:
+        print('\nPhases:')
+        ends = [start for start, _ in self.phases[1:]] + [self.get_duration()]
+        for (start, phase), end in zip(self.phases, ends):
+            if phase == 'DONE':
+                continue
+            tx = sum(len(d) for k, t, d in self.records if k == Capture.Kind.TX and start <= t < end)
+            rx = sum(len(d) for k, t, d in self.records if k == Capture.Kind.RX and start <= t < end)
+            print(f'  {phase}: {1000 * start:.1f}ms + {1000 * (end - start):.1f}ms, TX {tx}B, RX {rx}B')
+
+
+    def print_gaps(self) -> None:
+        # Nothing going either way for a while, the preceding packet is usually the one being waited for
+        traffic = [(t, k, d) for k, t, d in self.records if k != Capture.Kind.STATE]
+        gaps = []
+        for (previous, kind, _), (current, _, _) in zip(traffic, traffic[1:]):
+            if current - previous >= self.gap_threshold:
+                gaps.append((current - previous, previous, kind))
+
+        print(f'\nIdle gaps over {1000 * self.gap_threshold:.0f}ms: {len(gaps)}, {sum(g[0] for g in gaps):.3f}s in total')
+        for gap, start, kind in sorted(gaps, reverse=True)[:self.GAPS_SHOWN]:
+            last = [entry for entry in self.packets if entry[0] <= start]
+            phase = last[-1][2] if len(last) > 0 else 'UNKNOWN'
+            after = self.describe(last[-1][1], last[-1][3]) if len(last) > 0 else f'{kind.name} raw data'
+            print(f'  {1000 * gap:.1f}ms at {1000 * start:.1f}ms in {phase}, after {after}')
+
+
+    def analyze_transfer(self) -> None:
+        # Follows the data the same way the updater does: offsets advance with each packet sent and jump on rewind
+        start_offset = 0
+        offset = 0
+        sent_offset = 0
+        unacked = []
+        data_rtts = []
+        echo_rtts = []
+        echoes = {}
+        progress = []
+        data_bytes = 0
+        counters = {
+            'Device rewinds': 0,
+            'Host rewinds': 0,
+            'RETX requested by host': 0,
+            'RETX requested by device': 0,
+            'TX corrupted frames': 0,
+            'RX corrupted frames': 0,
+        }
+        nacks = []
+
+        for timestamp, kind, phase, packet in self.packets:
+            if packet is None:
+                # Firmware's own output precedes the sync
+                if phase != 'SYNC':
+                    counters[f'{kind.name} corrupted frames'] += 1
+                continue
+
+            operation = self.get_operation(packet)
+            if kind == Capture.Kind.TX:
+                if packet.get_type() == Packet.Type.DATA:
+                    offset += packet.get_length()
+                    data_bytes += packet.get_length()
+                    unacked.append((offset, timestamp, offset <= sent_offset))
+                    sent_offset = max(sent_offset, offset)
+                elif operation == Packet.Operation.SESSION_REQUEST:
+                    start_offset = offset = sent_offset = self.AES_BLOCK_SIZE
+                elif operation == Packet.Operation.REWIND:
+                    counters['Host rewinds'] += 1
+                    offset = int.from_bytes(packet.get_payload()[1:5], 'little')
+                    unacked.clear()
+                elif operation == Packet.Operation.RETX:
+                    counters['RETX requested by host'] += 1
+                elif operation == Packet.Operation.ECHO:
+                    echoes[packet.get_payload()[1:3]] = timestamp
+                continue
+
+            if operation == Packet.Operation.ACK and packet.get_length() == Packet.CONTROL_PACKET_LENGTH and len(unacked) > 0:
+                acked_offset, send_time, retransmitted = unacked.pop(0)
+                # Round trips of retransmitted packets are ambiguous
+                if not retransmitted:
+                    data_rtts.append(timestamp - send_time)
+                progress.append((timestamp, acked_offset))
+            elif operation == Packet.Operation.REWIND:
+                counters['Device rewinds'] += 1
+            elif operation == Packet.Operation.FW_UPDATE_DONE:
+                progress.append((timestamp, sent_offset))
+            elif operation == Packet.Operation.RETX:
+                counters['RETX requested by device'] += 1
+            elif operation == Packet.Operation.NACK:
+                nacks.append((timestamp, packet.get_payload()[1:2].hex() or 'none'))
+            elif operation == Packet.Operation.ECHO:
+                # Response carries device's timestamp before the request data
+                send_time = echoes.pop(packet.get_payload()[5:7], None)
+                if send_time is not None:
+                    echo_rtts.append(timestamp - send_time)
+
+        print('\nRound trip times:')
+        self.print_distribution('Data to acknowledge', data_rtts)
+        if len(echo_rtts) > 0:
+            self.print_distribution('Echo', echo_rtts)
+
+        print('\nRetransmissions:')
+        unique_bytes = sent_offset - start_offset
+        print(f'  Data sent: {data_bytes}B, {unique_bytes}B unique, {data_bytes - unique_bytes}B repeated')
+        for name, value in counters.items():
+            print(f'  {name}: {value}')
+        for timestamp, reason in nacks:
+            print(f'  NACK at {1000 * timestamp:.1f}ms, reason {reason}')
+
+        self.print_goodput(progress, start_offset)
+
+
+    def print_goodput(self, progress: list, start_offset: int) -> None:
+        if len(progress) == 0:
+            return
+
+        # Acknowledged data per interval, counted from the session start
+        line_rate = self.header['line_rate']
+        print(f'\nGoodput per {self.interval:.2f}s:')
+        start = math.floor(progress[0][0] / self.interval) * self.interval
+        previous = start_offset
+        index = 0
+        while index < len(progress):
+            end = start + self.interval
+            acked = previous
+            while index < len(progress) and progress[index][0] < end:
+                acked = max(acked, progress[index][1])
+                index += 1
+            rate = (acked - previous) / self.interval
+            print(f'  {start:8.2f}s: {rate:8.0f}B/s, {100 * rate / line_rate:5.1f}% of line rate')
+            previous = acked
+            start = end
+
+
+    def run(self) -> None:
+        self.print_overview()
+        self.print_phases()
+        self.print_gaps()
+        self.analyze_transfer()
+
+
+def main() -> None:
+    parser = argparse.ArgumentParser(description='Analyse a session captured with updater.py --capture')
+    parser.add_argument('capture_path', help='path to the capture file', type=str)
+    parser.add_argument('--gap', help='shortest idle time reported, in milliseconds', type=float, default=50.0)
+    parser.add_argument('--interval', help='goodput sampling interval, in seconds', type=float, default=1.0)
+    args = parser.parse_args()
+
+    SessionAnalyzer(args.capture_path, args.gap / 1000, args.interval).run()
+
+
+if __name__ == "__main__":
+    main()
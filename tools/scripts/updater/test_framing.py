@@ -0,0 +1,94 @@
+from packet import Packet
+from update import Update
+import random
+import unittest
+
+class TestFraming(unittest.TestCase):
+    # Received stream with bytes lost or inserted, every frame after the damaged one has to come through
+    PACKET_COUNT = 4
+
+
+    def setUp(self):
+        self.update = Update()
+        self.packets = [Packet(bytes([0x00, index, 0x00, 0xFF])) for index in range(self.PACKET_COUNT)]
+        self.frames = [packet.get_frame() for packet in self.packets]
+
+
+    def receive(self, data: bytes) -> list:
+        self.update.rx_buffer += data
+        return self.update.split_packets()
+
+
+    def assert_resyncs(self, damaged: int, received: list) -> None:
+        # Damaged frame either fails to decode or fails the CRC check
+        self.assertEqual(len(received), self.PACKET_COUNT)
+        for index, packet_data in enumerate(received):
+            if index == damaged:
+                self.assertTrue(packet_data is None or not self.update.is_valid_packet(packet_data))
+            else:
+                self.assertEqual(packet_data, self.packets[index].get_raw())
+
+
+    def test_clean_stream(self):
+        received = self.receive(b''.join(self.frames))
+        self.assertEqual(received, [packet.get_raw() for packet in self.packets])
+
+
+    def test_dropped_byte(self):
+        # Delimiter is excluded, losing it joins two frames
+        for position in range(len(self.frames[1]) - 1):
+            with self.subTest(position=position):
+                self.setUp()
+                damaged = self.frames[1][:position] + self.frames[1][position + 1:]
+                self.assert_resyncs(1, self.receive(self.frames[0] + damaged + b''.join(self.frames[2:])))
+
+
+    def test_inserted_byte(self):
+        for position in range(len(self.frames[1])):
+            for value in (0x01, 0x13, 0xFF):
+                with self.subTest(position=position, value=value):
+                    self.setUp()
+                    damaged = self.frames[1][:position] + bytes([value]) + self.frames[1][position:]
+                    self.assert_resyncs(1, self.receive(self.frames[0] + damaged + b''.join(self.frames[2:])))
+
+
+    def test_inserted_delimiter(self):
+        # Frame is split in two, neither half decodes to a packet
+        damaged = self.frames[1][:5] + Packet.FRAME_DELIMITER.to_bytes(1, 'little') + self.frames[1][5:]
+        received = self.receive(self.frames[0] + damaged + b''.join(self.frames[2:]))
+        self.assertEqual(len(received), self.PACKET_COUNT + 1)
+        self.assertIsNone(received[1])
+        self.assertIsNone(received[2])
+        self.assertEqual(received[3:], [packet.get_raw() for packet in self.packets[2:]])
+
+
+    def test_lost_delimiter(self):
+        joined = self.frames[1][:-1] + self.frames[2]
+        received = self.receive(self.frames[0] + joined + self.frames[3])
+        self.assertEqual(received, [self.packets[0].get_raw(), None, self.packets[3].get_raw()])
+
+
+    def test_chunked_stream(self):
+        # Serial port hands data over in arbitrary pieces
+        stream = b''.join(self.frames)
+        chunks = random.Random(1).choices(range(1, 8), k=len(stream))
+        received = []
+        offset = 0
+        for size in chunks:
+            received += self.receive(stream[offset:offset + size])
+            offset += size
+        self.assertEqual(received, [packet.get_raw() for packet in self.packets])
+
+
+    def test_fec_corrects_byte(self):
+        self.update.fec = True
+        raw = self.packets[1].get_raw()
+        codeword = bytearray(raw + self.update.reed_solomon.encode(raw))
+        codeword[3] ^= 0x5A
+        received = self.receive(Packet.cobs_encode(bytes(codeword)) + Packet.FRAME_DELIMITER.to_bytes(1, 'little'))
+        self.assertEqual(received, [raw])
+        self.assertEqual(self.update.host_stats['FEC corrections'], 1)
+
+
+if __name__ == "__main__":
+    unittest.main()
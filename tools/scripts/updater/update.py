@@ -1,28 +1,167 @@
 import serial
 import time
 from packet import Packet
+from link_test import LinkTest
+from reed_solomon import ReedSolomon
+from retransmission_timer import RetransmissionTimer
+from capture import Capture
 from enum import IntEnum
-import os
 import math
+import struct
 
 class Update:
     class UpdateState(IntEnum):
         SYNC = 0
         VALIDATE_ID = 1
-        ACK_UPDATE = 2
-        ACK_FW_SIZE = 3
-        SEND_FW_DATA = 4
-        ACK_DATA = 5
-        DONE = 6
+        LINK_TEST = 2
+        GET_INFO = 3
+        ACK_UPDATE = 4
+        ACK_FW_SIZE = 5
+        ACK_AES_IV = 6
+        ACK_SESSION = 7
+        SEND_FW_DATA = 8
+        GET_STATS = 9
+        GET_MEMORY = 10
+        DONE = 11
 
     BAUDRATE = 115200
     SYNC_SEQUENCE = b'\x46\x31\x30\x33'
 
-    def __init__(self):
+    # 8N1 framing, 10 bits on the wire per byte
+    LINE_RATE = BAUDRATE // 10
+
+    # Sync sequence is sent again when the device doesn't answer within that time
+    SYNC_INTERVAL = 0.5
+
+    STATS_TIMEOUT = 0.5
+
+    # Layout of device's RAM usage: RAM size, static data size, stack size, stack peak
+    MEMORY_FORMAT = '<IIII'
+
+    # Device verifies the signature of installed image before answering
+    INFO_TIMEOUT = 3.0
+
+    # Layout of installed image information: IV, version, device ID, code length, valid flag, SHA-256 of the code
+    INFO_FORMAT = '<16sIIIB32s'
+
+    # Followed by microseconds spent on CRC, SHA-256 and signature check, older bootloaders leave them out
+    VERIFY_TIMES_FORMAT = '<III'
+
+    # Signed file is IV followed by encrypted header without IV, code and PKCS7 padding
+    AES_BLOCK_SIZE = 16
+    HEADER_SIZE = 128
+
+    # Packets in flight without acknowledge, the device may grant less
+    DEFAULT_CREDITS = 8
+    RTSCTS_CREDITS = 32
+
+    # Without any response for the estimated retransmission timeout the transfer is rewound to the last
+    # acknowledged packet. The timeout starts at STALL_TIMEOUT until the first round trip is measured.
+    STALL_TIMEOUT = 1.0
+    STALL_RETRIES = 6
+    RTO_MIN = 0.1
+    RTO_MAX = 4.0
+
+    POLL_TIMEOUT = 0.01
+
+    # Progress line is refreshed at most that often, printing it for each packet would slow fast links down
+    PROGRESS_INTERVAL = 0.1
+
+    # Link options requested after credits, the device acknowledges those it supports
+    OPTION_FEC = 0x01
+
+    # Single round trip handshake, the request is sent as pages back to back:
+    # version, device ID, credits, options, flags, file size, IV
+    HANDSHAKE_VERSION = 2
+    SESSION_REQUEST_FORMAT = '<BBBBBI16s'
+    SESSION_FLAG_FORCE = 0x01
+
+    # Device's answer: version, credits, options, max frame size, bit rate, compression, encryption, free flash
+    SESSION_CAPS_FORMAT = '<BBBBIBBI'
+
+    # Device verifies the signature of installed image if the host is about to send the same one
+    SESSION_TIMEOUT = 3.0
+    SESSION_RETRIES = 2
+
+    # Reason the device gives in NACK payload, older bootloaders send none
+    NACK_UP_TO_DATE = 0x07
+    NACK_REASONS = {
+        0x01: 'unexpected packet',
+        0x02: 'invalid request',
+        0x03: 'wrong device',
+        0x04: 'image too large',
+        0x05: 'flash error',
+        0x06: 'timeout',
+        NACK_UP_TO_DATE: 'installed firmware is identical'
+    }
+
+    # Layout of device's statistics, all counters are 32-bit little endian
+    DEVICE_STATS = [
+        'RX bytes',
+        'RX overruns',
+        'RX ring full drops',
+        'CRC failures',
+        'RETX sent',
+        'RETX received',
+        'Timeouts',
+        'Bytes programmed',
+        'Framing errors',
+        'FEC corrections'
+    ]
+
+    def __init__(self, credits: int | None = None, rtscts: bool = False, force: bool = False, link_test: int = 0, framed: bool = True,
+                 fec: bool = False, legacy_handshake: bool = False, capture_path: str | None = None):
+        self.rtscts = rtscts
+        self.capture_path = capture_path
+        self.capture = None
+        self.force = force
+        self.link_test_count = link_test
+        self.framed = framed
+        # Bootloaders that predate framing don't know the session request either
+        self.legacy_handshake = legacy_handshake or not framed
+        # Session request follows the sync sequence right away when there's nothing to do in between
+        self.pipeline_session = not self.legacy_handshake and link_test == 0
+        self.line_rate = self.LINE_RATE
+        self.fec_requested = fec and framed
+        self.fec = False
+        self.reed_solomon = ReedSolomon(Packet.FEC_PARITY_SIZE)
+        self.max_credits = self.RTSCTS_CREDITS if rtscts else self.DEFAULT_CREDITS
+        self.auto_credits = credits is None
+        self.credits = self.max_credits if credits is None else credits
+        # End offset and send time of each packet in flight, and whether it's been sent before
+        self.unacked = []
+        self.acked_offset = 0
+        self.sent_offset = 0
+        self.rto = RetransmissionTimer(self.STALL_TIMEOUT, self.RTO_MIN, self.RTO_MAX)
+        self.last_rx_time = 0.0
+        self.stalls = 0
         self.rx_buffer = bytes()
         self.rx_packets = []
-        self.last_tx_packet = Packet()
+        self.last_tx_frame = bytes()
+        # Firmware data packets are encoded once, when the link options are known
+        self.frames = bytes()
+        self.frame_size = 0
+        self.offset = 0
+        self.progress_time = 0.0
         self.state = self.UpdateState.SYNC
+        self.host_stats = {
+            'TX bytes': 0,
+            'RX bytes': 0,
+            'CRC failures': 0,
+            'Framing errors': 0,
+            'FEC corrections': 0,
+            'RETX sent': 0,
+            'RETX received': 0,
+            'Rewinds': 0
+        }
+        self.stats_data = bytes()
+        self.memory_data = bytes()
+        self.info_data = bytes()
+        self.transfer_start = 0.0
+        self.transfer_end = 0.0
+        self.request_time = 0.0
+        self.sync_time = 0.0
+        self.session_attempts = 0
 
     def print_packet_data(self, packet: Packet) -> None:
         print(f'Type: {packet.get_type()}')
@@ -32,9 +171,12 @@ class Update:
 
 
     def print_progress(self) -> None:
-        current_pos = self.file.tell()
+        now = time.monotonic()
         chunks_total = math.ceil(self.file_size / Packet.PAYLOAD_SIZE)
-        current_chunk = math.ceil(current_pos / Packet.PAYLOAD_SIZE) + 1
+        current_chunk = math.ceil(self.offset / Packet.PAYLOAD_SIZE) + 1
+        if now - self.progress_time < self.PROGRESS_INTERVAL and current_chunk < chunks_total:
+            return
+        self.progress_time = now
         print(f'Sending chunk {current_chunk}/{chunks_total}', end='\r')
 
 
@@ -50,60 +192,384 @@ class Update:
         return True
 
 
+    def write(self, data: bytes) -> None:
+        self.port.write(data)
+        if self.capture is not None:
+            self.capture.record(Capture.Kind.TX, data)
+        self.host_stats['TX bytes'] += len(data)
+
+
+    def encode_packet(self, packet: Packet) -> bytes:
+        # Bootloaders that predate framing send and expect bare packets
+        if not self.framed:
+            return packet.get_raw()
+        if self.fec:
+            return packet.get_frame(self.reed_solomon.encode(packet.get_raw()))
+        return packet.get_frame()
+
+
     def send_packet(self, packet: Packet) -> None:
-        self.port.write(packet.get_raw())
-        self.last_tx_packet = packet
+        self.last_tx_frame = self.encode_packet(packet)
+        self.write(self.last_tx_frame)
+
+
+    def prepare_frames(self) -> None:
+        parity = self.reed_solomon.encode if self.fec else None
+        self.frames = Packet.packetise(self.image, self.framed, parity)
+        self.frame_size = Packet.get_frame_size(self.framed, self.fec)
+
+
+    def send_frame(self) -> None:
+        # Offsets are always at a packet boundary, the last packet may be shorter
+        index = self.offset // Packet.PAYLOAD_SIZE
+        self.print_progress()
+        self.last_tx_frame = self.frames[index * self.frame_size : (index + 1) * self.frame_size]
+        self.write(self.last_tx_frame)
+        self.offset = min(self.file_size, self.offset + Packet.PAYLOAD_SIZE)
+
+
+    def request_update(self) -> None:
+        # Credits are not sent when not needed, older bootloaders accept plain request only
+        if self.fec_requested:
+            packet_data = Packet.Operation.UPDATE_REQUEST.value + bytes([self.credits, self.OPTION_FEC])
+        elif self.credits > 1:
+            packet_data = Packet.Operation.UPDATE_REQUEST.value + self.credits.to_bytes(1, 'little')
+        else:
+            packet_data = Packet.Operation.UPDATE_REQUEST.value
+        self.send_packet(Packet(packet_data, Packet.Type.CONTROL))
+
+
+    def get_session_request_packets(self) -> list:
+        # IV is the start of the image, the rest of the header is encrypted
+        iv = self.image[:self.AES_BLOCK_SIZE]
+        flags = self.SESSION_FLAG_FORCE if self.force else 0
+        options = self.OPTION_FEC if self.fec_requested else 0
+        data = struct.pack(self.SESSION_REQUEST_FORMAT, self.HANDSHAKE_VERSION, self.device_id[0], self.credits, options, flags,
+                           self.file_size, iv)
+
+        packets = []
+        for page, offset in enumerate(range(0, len(data), Packet.PAGE_DATA_SIZE)):
+            packet_data = Packet.Operation.SESSION_REQUEST.value + page.to_bytes(1, 'little') + data[offset:offset + Packet.PAGE_DATA_SIZE]
+            packets.append(Packet(packet_data, Packet.Type.CONTROL))
+        return packets
+
+
+    def send_session_request(self) -> None:
+        for packet in self.get_session_request_packets():
+            self.send_packet(packet)
+        self.request_time = time.monotonic()
+
+
+    def send_sync(self) -> None:
+        data = self.SYNC_SEQUENCE
+
+        # Empty frame flushes the sync sequence on device's side, the whole request goes in the same write
+        if self.pipeline_session:
+            packets = self.get_session_request_packets()
+            data += Packet.FRAME_DELIMITER.to_bytes(1, 'little') + b''.join(self.encode_packet(packet) for packet in packets)
+            self.last_tx_frame = self.encode_packet(packets[-1])
+            self.request_time = time.monotonic()
+
+        self.write(data)
+        self.sync_time = time.monotonic()
+
+
+    def get_nack_reason(self, packet: Packet) -> str | None:
+        payload = packet.get_payload()
+        if not packet.is_operation(Packet.Operation.NACK) or len(payload) < 2:
+            return None
+        return self.NACK_REASONS.get(payload[1], f'unknown reason 0x{payload[1]:02X}')
+
+
+    def print_failure(self, message: str, packet: Packet) -> None:
+        reason = self.get_nack_reason(packet)
+        print(message if reason is None else f'{message} Device reported: {reason}')
+
+
+    def send_fw_data(self) -> None:
+        # Keep as many packets in flight as the device gave credits for
+        while len(self.unacked) < self.credits and self.offset < self.file_size:
+            self.send_frame()
+            self.unacked.append((self.offset, time.monotonic(), self.offset <= self.sent_offset))
+            self.sent_offset = max(self.sent_offset, self.offset)
+
+
+    def rewind(self, offset: int) -> None:
+        # Device drops the data until it gets the offset back, everything before it is acknowledged
+        self.host_stats['Rewinds'] += 1
+        self.offset = offset
+        self.acked_offset = offset
+        self.unacked.clear()
+        self.send_packet(Packet(Packet.Operation.REWIND.value + offset.to_bytes(4, 'little'), Packet.Type.CONTROL))
+        self.last_rx_time = time.monotonic()
+
+
+    def start_session(self) -> None:
+        if not self.legacy_handshake:
+            print('Requesting update session...')
+            self.send_session_request()
+            self.state = self.UpdateState.ACK_SESSION
+        elif self.force:
+            print('Requesting update...')
+            self.request_update()
+            self.state = self.UpdateState.ACK_UPDATE
+        else:
+            print('Checking installed firmware...')
+            self.request_page(Packet.Operation.INFO_REQUEST, 0)
+            self.state = self.UpdateState.GET_INFO
+
+
+    def request_page(self, operation: Packet.Operation, page: int) -> None:
+        self.send_packet(Packet(operation.value + page.to_bytes(1, 'little'), Packet.Type.CONTROL))
+        self.request_time = time.monotonic()
+
+
+    def print_verify_times(self) -> None:
+        offset = struct.calcsize(self.INFO_FORMAT)
+        if len(self.info_data) < offset + struct.calcsize(self.VERIFY_TIMES_FORMAT):
+            return
+
+        # Steps after a failed one are reported as zero
+        crc_us, hash_us, signature_us = struct.unpack_from(self.VERIFY_TIMES_FORMAT, self.info_data, offset)
+        print(f'Image check: CRC {crc_us / 1000:.1f}ms, SHA-256 {hash_us / 1000:.1f}ms, signature {signature_us / 1000:.1f}ms')
+
+
+    def image_matches(self) -> bool:
+        if len(self.info_data) < struct.calcsize(self.INFO_FORMAT):
+            return False
+
+        iv, version, device_id, length, valid, digest = struct.unpack_from(self.INFO_FORMAT, self.info_data)
+        self.print_verify_times()
+        if not valid:
+            print('No valid firmware installed')
+            return False
+        print(f'Installed firmware: version {version}, ID 0x{device_id:02X}, {length}B, SHA-256 {digest.hex()}')
+
+        # IV is random for each signing, together with the size it identifies the signed file
+        file_iv = self.image[:self.AES_BLOCK_SIZE]
+
+        encrypted_size = ((self.HEADER_SIZE - self.AES_BLOCK_SIZE + length) // self.AES_BLOCK_SIZE + 1) * self.AES_BLOCK_SIZE
+        return iv == file_iv and self.file_size == self.AES_BLOCK_SIZE + encrypted_size
+
+
+    def print_summary(self) -> None:
+        duration = self.transfer_end - self.transfer_start
+        goodput = self.file_size / duration if duration > 0 else 0
+
+        print('\nLink summary:')
+        print(f'  Transfer time: {duration:.2f}s')
+        print(f'  Goodput: {goodput:.0f}B/s, {100 * goodput / self.line_rate:.1f}% of {self.line_rate}B/s raw line rate')
+
+        print('  Host:')
+        for name, value in self.host_stats.items():
+            print(f'    {name}: {value}')
+        if self.rto.srtt is not None:
+            print(f'    SRTT: {1000 * self.rto.srtt:.2f}ms, RTO: {1000 * self.rto.timeout:.0f}ms, {self.rto.samples} samples')
+
+        if len(self.stats_data) < 4:
+            print('  Device: statistics not available')
+            return
+
+        # Older bootloaders report fewer counters
+        print('  Device:')
+        for i, name in enumerate(self.DEVICE_STATS[:len(self.stats_data) // 4]):
+            value = int.from_bytes(self.stats_data[4 * i : 4 * (i + 1)], 'little')
+            print(f'    {name}: {value}')
+
+        if len(self.memory_data) < struct.calcsize(self.MEMORY_FORMAT):
+            return
+
+        # Stack peak covers signature verification only if installed firmware was checked
+        ram_size, static_size, stack_size, stack_peak = struct.unpack_from(self.MEMORY_FORMAT, self.memory_data)
+        print('\nDevice memory:')
+        print(f'  RAM: {ram_size}B')
+        print(f'  Static data: {static_size}B')
+        print(f'  Stack: peak {stack_peak}B of {stack_size}B, {stack_size - stack_peak}B headroom')
 
 
     def rx_callback(self, data: bytes) -> None:
         # Append new data to buffer
         self.rx_buffer += data
+        self.host_stats['RX bytes'] += len(data)
+        self.last_rx_time = time.monotonic()
+        self.stalls = 0
+
+        for packet_data in self.split_packets():
+            # Firmware may still be writing its own output before it resets into the bootloader
+            if self.state == self.UpdateState.SYNC and (packet_data is None or not self.is_valid_packet(packet_data)):
+                continue
+
+            # Frame with a byte lost or inserted doesn't decode to a packet
+            if packet_data is None:
+                print('Got malformed frame, requesting retransmission')
+                self.host_stats['Framing errors'] += 1
+                self.host_stats['RETX sent'] += 1
+                self.send_packet(Packet(Packet.Operation.RETX.value, Packet.Type.CONTROL))
+                continue
 
-        while len(self.rx_buffer) >= Packet.TOTAL_SIZE:
             # Create new packet
             packet = Packet()
-            packet.from_bytes(self.rx_buffer[:Packet.TOTAL_SIZE])
-
-            # Remove current packet data from buffer
-            self.rx_buffer = self.rx_buffer[Packet.TOTAL_SIZE:]
+            packet.from_bytes(packet_data)
 
             # Validate packet
             if not packet.is_valid():
                 print('Got invalid packet, requesting retransmission')
+                self.host_stats['CRC failures'] += 1
+                self.host_stats['RETX sent'] += 1
                 self.send_packet(Packet(Packet.Operation.RETX.value, Packet.Type.CONTROL))
             elif packet.is_operation(Packet.Operation.RETX):
                 print('Requested retransmission of last packet')
-                self.port.write(self.last_tx_packet.get_raw())
+                self.host_stats['RETX received'] += 1
+                self.write(self.last_tx_frame)
             else:
                 self.rx_packets.append(packet)
                 # self.print_packet_data(packet)
 
 
+    def is_valid_packet(self, packet_data: bytes) -> bool:
+        packet = Packet()
+        packet.from_bytes(packet_data)
+        return packet.is_valid()
+
+
+    def split_packets(self) -> list:
+        packets = []
+
+        if not self.framed:
+            while len(self.rx_buffer) >= Packet.TOTAL_SIZE:
+                packets.append(self.rx_buffer[:Packet.TOTAL_SIZE])
+                self.rx_buffer = self.rx_buffer[Packet.TOTAL_SIZE:]
+            return packets
+
+        # Whatever got corrupted, the next frame starts right after the delimiter
+        delimiter = Packet.FRAME_DELIMITER.to_bytes(1, 'little')
+        while delimiter in self.rx_buffer:
+            frame, _, self.rx_buffer = self.rx_buffer.partition(delimiter)
+            if len(frame) == 0:
+                continue
+            packets.append(self.decode_frame(frame))
+        return packets
+
+
+    def decode_frame(self, frame: bytes) -> bytes | None:
+        packet_data = Packet.cobs_decode(frame)
+        if packet_data is None:
+            return None
+        if len(packet_data) == Packet.TOTAL_SIZE:
+            return packet_data
+        if len(packet_data) != Packet.FEC_CODEWORD_SIZE:
+            return None
+
+        # Uncorrectable codeword is passed on as it is, CRC check rejects it then
+        result = self.reed_solomon.decode(packet_data)
+        if result is None:
+            return packet_data[:Packet.TOTAL_SIZE]
+        codeword, corrected = result
+        self.host_stats['FEC corrections'] += corrected
+        return codeword[:Packet.TOTAL_SIZE]
+
+
     def update_handler(self) -> None:
         match self.state:
             case self.UpdateState.SYNC:
                 if self.packets_available():
                     packet = self.rx_packets.pop(0)
+
+                    # Device got the sync, but its response was lost, the answer to the request came already
+                    if self.pipeline_session and not packet.is_operation(Packet.Operation.SYNCED):
+                        self.rx_packets.insert(0, packet)
+                        self.state = self.UpdateState.ACK_SESSION
+                        return
+
                     if not self.validate_device_id(packet):
                         print('Failed to validate device ID!')
                         self.state = self.UpdateState.DONE
+                        return
+
+                    if self.pipeline_session:
+                        print('Device ID valid, waiting for session confirmation...')
+                        self.state = self.UpdateState.ACK_SESSION
+                        return
+
+                    # Empty frame flushes anything that preceded the session on device's side
+                    if self.framed:
+                        self.write(Packet.FRAME_DELIMITER.to_bytes(1, 'little'))
+
+                    if self.link_test_count > 0:
+                        print(f'Device ID valid, testing the link with {self.link_test_count} echoes...')
+                        frame_size = Packet.FRAME_SIZE if self.framed else Packet.TOTAL_SIZE
+                        self.link_test = LinkTest(self.send_packet, self.link_test_count, self.line_rate, frame_size)
+                        self.link_test_stats = dict(self.host_stats)
+                        self.state = self.UpdateState.LINK_TEST
                     else:
-                        print('Device ID valid, requesting update...')
-                        self.send_packet(Packet(Packet.Operation.UPDATE_REQUEST.value, Packet.Type.CONTROL))
-                        self.state = self.UpdateState.ACK_UPDATE
-                else:
+                        print('Device ID valid')
+                        self.start_session()
+                elif time.monotonic() - self.sync_time > self.SYNC_INTERVAL:
+                    # Leftovers of firmware's output would make the response look corrupted
+                    self.rx_buffer = bytes()
                     print('Sending sync sequence...')
-                    self.port.write(self.SYNC_SEQUENCE)
-                    time.sleep(0.5)
+                    self.send_sync()
+
+            case self.UpdateState.LINK_TEST:
+                if not self.link_test.poll(self.rx_packets):
+                    return
+
+                # Corruption seen by either side during the test
+                errors = self.host_stats['CRC failures'] - self.link_test_stats['CRC failures']
+                errors += self.host_stats['Framing errors'] - self.link_test_stats['Framing errors']
+                errors += self.host_stats['RETX received'] - self.link_test_stats['RETX received']
+                self.link_test.print_summary(errors, self.max_credits)
+                if self.auto_credits:
+                    self.credits = self.link_test.get_recommended_credits(self.max_credits)
+                for rtt in self.link_test.rtts:
+                    self.rto.sample(rtt)
+                print()
+                self.start_session()
+
+            case self.UpdateState.GET_INFO:
+                if self.packets_available():
+                    packet = self.rx_packets.pop(0)
+                    if not packet.is_operation(Packet.Operation.INFO_REQUEST):
+                        print('Failed to get installed firmware information, use --force with older bootloaders!')
+                        self.state = self.UpdateState.DONE
+                        return
+
+                    # Response holds page number and up to one page of data
+                    page_data = packet.get_payload()[2:]
+                    self.info_data += page_data
+                    if len(page_data) == Packet.PAGE_DATA_SIZE:
+                        self.request_page(Packet.Operation.INFO_REQUEST, packet.get_payload()[1] + 1)
+                        return
+
+                    if self.image_matches():
+                        print('Installed firmware is identical, skipping update')
+                        self.send_packet(Packet(Packet.Operation.SESSION_END.value, Packet.Type.CONTROL))
+                        self.state = self.UpdateState.DONE
+                        return
+
+                    print('Requesting update...')
+                    self.request_update()
+                    self.state = self.UpdateState.ACK_UPDATE
+                elif time.monotonic() - self.request_time > self.INFO_TIMEOUT:
+                    print('No response to firmware information request!')
+                    self.state = self.UpdateState.DONE
 
             case self.UpdateState.ACK_UPDATE:
                 if self.packets_available():
                     packet = self.rx_packets.pop(0)
                     if not packet.is_operation(Packet.Operation.ACK):
-                        print('Failed to get update confirmation!')
+                        self.print_failure('Failed to get update confirmation!', packet)
                         self.state = self.UpdateState.DONE
                     else:
-                        print('Update request confirmed, sending firmware size...')
+                        # Older bootloaders don't grant credits, that means waiting for each acknowledge
+                        payload = packet.get_payload()
+                        self.credits = payload[1] if len(payload) > 1 else 1
+                        options = payload[2] if len(payload) > 2 else 0
+                        self.fec = bool(options & self.OPTION_FEC)
+                        if self.fec_requested and not self.fec:
+                            print('Device does not support FEC, continuing without it')
+                        fec_note = ' and FEC' if self.fec else ''
+                        print(f'Update request confirmed with {self.credits} credits{fec_note}, sending firmware size...')
                         packet_data = Packet.Operation.FW_SIZE_REQUEST.value + int.to_bytes(self.file_size, 4, 'little')
                         self.send_packet(Packet(packet_data, Packet.Type.CONTROL))
                         self.state = self.UpdateState.ACK_FW_SIZE
@@ -112,43 +578,187 @@ class Update:
                 if self.packets_available():
                     packet = self.rx_packets.pop(0)
                     if not packet.is_operation(Packet.Operation.ACK):
-                        print('Failed to get firmware size confirmation!')
+                        self.print_failure('Failed to get firmware size confirmation!', packet)
                         self.state = self.UpdateState.DONE
                     else:
                         print('Firmware size confirmed, sending firmware...')
-                        self.state = self.UpdateState.SEND_FW_DATA
+                        self.transfer_start = time.monotonic()
 
-            case self.UpdateState.SEND_FW_DATA:
-                self.print_progress()
-                chunk = self.file.read(Packet.PAYLOAD_SIZE)
-                self.send_packet(Packet(chunk))
-                self.state = self.UpdateState.ACK_DATA
+                        # IV goes first and is always acknowledged on its own
+                        self.prepare_frames()
+                        self.send_frame()
+                        self.state = self.UpdateState.ACK_AES_IV
 
-            case self.UpdateState.ACK_DATA:
+            case self.UpdateState.ACK_AES_IV:
                 if self.packets_available():
                     packet = self.rx_packets.pop(0)
-                    if packet.is_operation(Packet.Operation.ACK):
+                    if not packet.is_operation(Packet.Operation.ACK):
+                        self.print_failure('\nFailed to get ACK!', packet)
+                        self.state = self.UpdateState.DONE
+                    else:
+                        self.acked_offset = self.offset
+                        self.send_fw_data()
                         self.state = self.UpdateState.SEND_FW_DATA
+
+            case self.UpdateState.ACK_SESSION:
+                if self.packets_available():
+                    packet = self.rx_packets.pop(0)
+                    if packet.is_operation(Packet.Operation.NACK) and packet.get_payload()[1:2] == bytes([self.NACK_UP_TO_DATE]):
+                        print('Installed firmware is identical, skipping update')
+                        self.state = self.UpdateState.DONE
+                        return
+
+                    # Older bootloaders refuse the request without giving a reason
+                    if packet.is_operation(Packet.Operation.NACK) and packet.get_length() == Packet.CONTROL_PACKET_LENGTH:
+                        print('Failed to get session confirmation, use --legacy-handshake with older bootloaders!')
+                        self.state = self.UpdateState.DONE
+                        return
+
+                    payload = packet.get_payload()
+                    if not packet.is_operation(Packet.Operation.ACK) or len(payload) < 1 + struct.calcsize(self.SESSION_CAPS_FORMAT):
+                        self.print_failure('Failed to get session confirmation!', packet)
+                        self.state = self.UpdateState.DONE
+                        return
+
+                    version, credits, options, max_frame_size, bit_rate, compression, encryption, free_flash = \
+                        struct.unpack_from(self.SESSION_CAPS_FORMAT, payload, 1)
+                    self.credits = credits
+                    self.fec = bool(options & self.OPTION_FEC)
+                    if bit_rate > 0:
+                        self.line_rate = bit_rate // 10
+                    if self.fec_requested and not self.fec:
+                        print('Device does not support FEC, continuing without it')
+                    fec_note = ' and FEC' if self.fec else ''
+                    print(f'Session confirmed with {self.credits} credits{fec_note}, {bit_rate}bit/s link, '
+                          f'{max_frame_size}B frames, {free_flash}B for firmware, sending firmware...')
+
+                    # IV went with the request, data continues right after it
+                    self.transfer_start = time.monotonic()
+                    self.prepare_frames()
+                    self.offset = self.AES_BLOCK_SIZE
+                    self.acked_offset = self.offset
+                    self.send_fw_data()
+                    self.state = self.UpdateState.SEND_FW_DATA
+                elif time.monotonic() - self.request_time > self.SESSION_TIMEOUT:
+                    if self.session_attempts >= self.SESSION_RETRIES:
+                        print('No response to session request!')
+                        self.state = self.UpdateState.DONE
+                        return
+                    print('No response to session request, sending it again...')
+                    self.session_attempts += 1
+                    self.send_session_request()
+
+            case self.UpdateState.SEND_FW_DATA:
+                while self.packets_available():
+                    packet = self.rx_packets.pop(0)
+                    if packet.is_operation(Packet.Operation.ACK):
+                        # Session confirmation comes again when the request was repeated
+                        if packet.get_length() > Packet.CONTROL_PACKET_LENGTH:
+                            continue
+                        # Duplicates may come from retransmission requests
+                        if len(self.unacked) > 0:
+                            self.acked_offset, send_time, retransmitted = self.unacked.pop(0)
+                            if not retransmitted:
+                                self.rto.sample(time.monotonic() - send_time)
+                    elif packet.is_operation(Packet.Operation.REWIND):
+                        offset = int.from_bytes(packet.get_payload()[1:5], 'little')
+                        print(f'\nDevice requested rewind to offset {offset}')
+                        self.rewind(offset)
                     elif packet.is_operation(Packet.Operation.FW_UPDATE_DONE):
                         print('\nUpdate done!')
-                        self.state = self.UpdateState.DONE
+                        self.transfer_end = time.monotonic()
+                        self.request_page(Packet.Operation.STATS_REQUEST, 0)
+                        self.state = self.UpdateState.GET_STATS
+                        return
                     else:
-                        print('\nFailed to get ACK!')
+                        self.print_failure('\nFailed to get ACK!', packet)
                         self.state = self.UpdateState.DONE
+                        return
+
+                # Bootloaders that predate framing don't support rewinding without credits
+                can_rewind = self.framed or self.credits > 1
+                if can_rewind and len(self.unacked) > 0 and time.monotonic() - self.last_rx_time > self.rto.timeout:
+                    if self.stalls >= self.STALL_RETRIES:
+                        print('\nTransfer stalled!')
+                        self.state = self.UpdateState.DONE
+                        return
+                    print(f'\nNo response for {1000 * self.rto.timeout:.0f}ms, rewinding...')
+                    self.stalls += 1
+                    self.rto.backoff()
+                    self.rewind(self.acked_offset)
+
+                self.send_fw_data()
+
+            case self.UpdateState.GET_STATS:
+                if self.packets_available():
+                    packet = self.rx_packets.pop(0)
+                    if not packet.is_operation(Packet.Operation.STATS_REQUEST):
+                        print('Failed to get device statistics!')
+                        self.state = self.UpdateState.DONE
+                        return
+
+                    # Response holds page number and up to one page of data
+                    page_data = packet.get_payload()[2:]
+                    self.stats_data += page_data
+                    if len(page_data) == Packet.PAGE_DATA_SIZE:
+                        self.request_page(Packet.Operation.STATS_REQUEST, packet.get_payload()[1] + 1)
+                        return
+
+                    self.request_page(Packet.Operation.MEMORY_REQUEST, 0)
+                    self.state = self.UpdateState.GET_MEMORY
+                elif time.monotonic() - self.request_time > self.STATS_TIMEOUT:
+                    # Older bootloaders don't support statistics
+                    self.print_summary()
+                    self.state = self.UpdateState.DONE
+
+            case self.UpdateState.GET_MEMORY:
+                if self.packets_available():
+                    packet = self.rx_packets.pop(0)
+                    if not packet.is_operation(Packet.Operation.MEMORY_REQUEST):
+                        print('Failed to get device memory usage!')
+                        self.print_summary()
+                        self.state = self.UpdateState.DONE
+                        return
+
+                    page_data = packet.get_payload()[2:]
+                    self.memory_data += page_data
+                    if len(page_data) == Packet.PAGE_DATA_SIZE:
+                        self.request_page(Packet.Operation.MEMORY_REQUEST, packet.get_payload()[1] + 1)
+                        return
+
+                    self.send_packet(Packet(Packet.Operation.SESSION_END.value, Packet.Type.CONTROL))
+                    self.print_summary()
+                    self.state = self.UpdateState.DONE
+                elif time.monotonic() - self.request_time > self.STATS_TIMEOUT:
+                    # Older bootloaders don't report memory usage
+                    self.print_summary()
+                    self.state = self.UpdateState.DONE
 
 
     def run(self, port_path: str, file_path: str, device_id: bytes) -> None:
         self.device_id = device_id
-        self.file = open(file_path, 'rb')
-        self.file_size = os.path.getsize(file_path)
-        self.port = serial.Serial(port_path, baudrate=self.BAUDRATE, timeout=1)
+        with open(file_path, 'rb') as f:
+            self.image = f.read()
+        self.file_size = len(self.image)
+        self.port = serial.Serial(port_path, baudrate=self.BAUDRATE, timeout=self.POLL_TIMEOUT, rtscts=self.rtscts)
+
+        # Everything that goes over the port is logged along with state changes, for offline analysis
+        if self.capture_path is not None:
+            self.capture = Capture(self.capture_path, self.framed, self.LINE_RATE)
+            self.capture.record(Capture.Kind.STATE, self.state.name.encode())
 
         while self.state != self.UpdateState.DONE:
-            if self.port.in_waiting > 0:
-                data = self.port.read_all()
+            # Blocks for at most poll timeout, so that the packets are handled as soon as they come
+            data = self.port.read(max(1, self.port.in_waiting))
+            state = self.state
+            if len(data) > 0:
+                if self.capture is not None:
+                    self.capture.record(Capture.Kind.RX, data)
                 self.rx_callback(data)
             self.update_handler()
-            time.sleep(0.01)
+            if self.capture is not None and self.state != state:
+                self.capture.record(Capture.Kind.STATE, self.state.name.encode())
 
+        if self.capture is not None:
+            self.capture.close()
         self.port.close()
-        self.file.close()
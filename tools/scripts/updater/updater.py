@@ -6,6 +6,14 @@ def main() -> None:
     parser.add_argument('port_path', help='path to device serial port', type=str)
     parser.add_argument('firmware_path', help='path to signed binary for update', type=str)
     parser.add_argument('device_id', help='ID of the device to update', type=str)  # TODO this should be read from the firmware file
+    parser.add_argument('--rtscts', help='use RTS/CTS hardware flow control, bootloader has to be built with it', action='store_true')
+    parser.add_argument('--force', help='update even if the installed firmware is identical, needed for older bootloaders', action='store_true')
+    parser.add_argument('--link-test', help='measure the link with given number of echoes first, picks credits unless set', type=int, default=0, metavar='COUNT')
+    parser.add_argument('--credits', help='packets sent ahead without waiting for acknowledge, 1 for older bootloaders', type=int)
+    parser.add_argument('--unframed', help='send bare packets without COBS framing, needed for older bootloaders', action='store_true')
+    parser.add_argument('--fec', help='protect packets with Reed-Solomon parity, corrects up to 2 bytes per packet', action='store_true')
+    parser.add_argument('--legacy-handshake', help='negotiate the session step by step, needed for older bootloaders', action='store_true')
+    parser.add_argument('--capture', help='log every byte sent and received with timestamps, for session_analyzer.py', type=str, metavar='PATH')
     args = parser.parse_args()
 
     if args.device_id.startswith('0x'):
@@ -13,7 +21,7 @@ def main() -> None:
     else:
         device_id = int(args.device_id)
 
-    updater = Update()
+    updater = Update(args.credits, args.rtscts, args.force, args.link_test, not args.unframed, args.fec, args.legacy_handshake, args.capture)
     updater.run(args.port_path, args.firmware_path, device_id.to_bytes(1, 'little'))
 
 